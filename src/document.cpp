@@ -3,117 +3,506 @@
 #include "common.hpp"
 #include "logger.hpp"
 #include "settings.hpp"
+#include "mapped_file.hpp"
 
+#include <chrono>
 #include <cassert>
-#include <fstream>
+#include <cstring>
+#include <thread>
+#include <sstream>
+#include <algorithm>
+
+
+namespace {
+
+// Collects encoded text in a string, writes like FileWriter
+struct StringWriter {
+    std::string& out;
+
+    void put(char c) { out += c; }
+    void write(const char* data, size_t size) { out.append(data, size); }
+};
+
+} // namespace
+
+// Encodes glyphs back to UTF-8: codepoints are encoded directly, real text
+// is looked up only for special glyphs (tabs, invalid bytes)
+template<typename Out>
+void Document::_write_line(const line_t& line, Out& out) {
+    char buf[4];
+    for (const Glyph& g: line) {
+        if (g.special()) {
+            const std::string& real = g.real();
+            out.write(real.data(), real.size());
+        } else if (g.code() < 0x80) {
+            out.put(static_cast<char>(g.code()));
+        } else {
+            out.write(buf, encode_utf8(g.code(), buf));
+        }
+    }
+}
 
 
-Document::Document() : max_line_width_(0), filepath_("out.txt") {
+Document::Document()
+    : max_line_width_(0), filepath_("out.txt"), invalid_lines_(0), complete_(true), compressed_(false), placeholder_(false),
+      changed_row_(NO_CHANGES), disk_stamp_({0, 0}), disk_size_(0), following_(false), streaming_(false)
+{
     _init_special_chars();
+    // texts of old edits are spilled as UTF-8 and decoded back into the document arena
+    history_.set_spill([](const line_t& line, std::string& out) {
+        StringWriter writer{out};
+        _write_line(line, writer);
+    }, [this](const char* start, const char* stop) {
+        LineArena::Scope scope(arena_);
+        return Text(_load_lines(start, stop));
+    });
+}
+
+Document::~Document() {
+    // journal is needed only to recover from a crash
+    _close_journal();
+    history_.close_store();
+    // pages may still be decoded on the background thread, which uses the decoder
+    if (paged_) {
+        paged_->stop();
+    }
 }
 
 line_t Document::load_line(const char* start, const char* stop) {
     line_t glyphs;
+    glyphs.reserve(stop - start);
+    if (!decoder_.decode(start, stop, glyphs)) {
+        invalid_lines_++;
+    }
+    return glyphs;
+}
 
-    char buf[3] = {0};
-    const char* pos = start;
-    while (pos < stop) {
-        char c = *pos;
-        Glyph g;
-
-        auto it = special_chars_.find(c);
-        if ( it != special_chars_.end() ) {
-            g = it->second;
-            pos++;
+Text Document::load_raw(const char *start) {
+    LineArena::Scope scope(arena_);
+
+    content_t content = _load_lines(start, start + std::strlen(start));
+    _check_invalid_lines("raw text");
+    return Text(std::move(content));
+}
+
+void Document::load_from_file(const std::string& filepath) {
+    if ( !start_loading(filepath) ) {
+        return;
+    }
+    if (loader_) {
+        loader_->wait();
+        poll_loading();
+    }
+}
+
+bool Document::start_loading(const std::string& filepath) {
+    _close_sources();
+    filepath_ = filepath;
+    load_start_ = std::chrono::steady_clock::now();
+
+    // compressed file cannot be read from the middle, it is always decompressed completely
+    compressed_ = FileLoader::is_gzip(filepath_);
+    long long paged_size = Settings::const_instance().const_paged().min_file_size;
+    if (!compressed_ && (paged_size >= 0) && (FileStamp::of(filepath_).size >= static_cast<uint64_t>(paged_size))) {
+        return _open_paged();
+    }
+
+    // arenas are created before the workers start and are never removed,
+    // lines loaded before keep using them
+    size_t threads = _load_threads();
+    while (load_arenas_.size() < threads) {
+        load_arenas_.emplace_back();
+    }
+
+    // parsing runs on the worker threads, every worker allocates lines from its own arena
+    loader_.reset(new FileLoader(filepath_, threads, [this](const char* start, const char* stop, size_t worker) {
+        LineArena::Scope scope(load_arenas_[worker]);
+        return _load_lines(start, stop);
+    }));
+    if ( !loader_->is_open() ) {
+        Logger::instance().error("Cannot load file: " + filepath_);
+        loader_.reset();
+        return false;
+    }
+
+    complete_ = false;
+    placeholder_ = true;
+    return true;
+}
+
+bool Document::start_reading(int fd, const std::string& filepath) {
+    _close_sources();
+    filepath_ = filepath;
+    load_start_ = std::chrono::steady_clock::now();
+
+    // stream cannot be read again, so it is never paged: read lines stay in the text
+    // like lines of a loaded file, and all of them are unsaved
+    text_ = Text();
+    compressed_ = false;
+    complete_ = true;
+    placeholder_ = false;
+    disk_stamp_ = {0, 0};
+    disk_size_ = 0;
+    changed_row_ = 0;
+
+    // lines are parsed on the reader thread, the first one continues the empty line of the new text
+    follower_.reset(new FileFollower(fd, "input stream", Settings::const_instance().const_follow().interval_ms,
+        [this](const char* start, const char* stop) {
+            LineArena::Scope scope(arena_);
+            return _load_lines(start, stop);
+        }));
+    if ( !follower_->is_open() ) {
+        follower_.reset();
+        return false;
+    }
+    streaming_ = true;
+    return true;
+}
+
+void Document::_close_sources() {
+    loader_.reset();
+    follower_.reset();
+    streaming_ = false;
+    _close_journal();
+    history_.close_store();
+    // edits of the previous text cannot be applied to the next one, stored or not
+    history_.clear();
+    disk_index_.clear();
+    changed_row_ = NO_CHANGES;
+    if (paged_) {
+        paged_->stop();
+        paged_.reset();
+    }
+}
+
+bool Document::poll_loading() {
+    if ( !loader_ ) {
+        return false;
+    }
+
+    bool finished = loader_->finished();
+    std::vector<content_t> chunks;
+    std::vector<size_t> offsets;
+    bool changed = loader_->take(chunks, offsets);
+    // every chunk becomes a piece of its own, lines are not copied
+    for (size_t i = 0; i < chunks.size(); i++) {
+        content_t& chunk = chunks[i];
+        disk_index_.push_back({placeholder_? 0: static_cast<size_t>(text_.total_lines()), offsets[i]});
+        if (placeholder_) {
+            text_ = Text(std::move(chunk));
+            placeholder_ = false;
         } else {
-            buf[0] = c;
-            if ( (c >= ASCII_CHAR_LOW) && (c <= ASCII_CHAR_HIGH) ) {
-                buf[1] = 0;
-                pos++;
-            } else {
-                buf[1] = *(pos+1);
-                pos += 2;
+            text_.append_lines(Text(std::move(chunk)));
+        }
+    }
+
+    if (finished) {
+        complete_ = loader_->done();
+        _check_invalid_lines(filepath_);
+        if (complete_) {
+            _log_loaded(loader_->total_bytes(), std::to_string(loader_->threads()) + " threads" +
+                        (compressed_? ", gzip": ""), load_start_);
+            disk_stamp_ = FileStamp::of(filepath_);
+            disk_size_ = loader_->total_bytes();
+            _open_journal();
+            _open_history();
+            if (following_) {
+                _start_follower();
             }
-            g = Glyph(buf, nullptr);
-            g.set_color(Settings::const_instance().const_colors().text);
+            changed = true;
+        } else {
+            Logger::instance().warning("Loading of " + filepath_ + " was cancelled after " +
+                                       std::to_string(loader_->loaded_bytes()) + " bytes, saving is disabled");
         }
-        glyphs.push_back(g);
+        loader_.reset();
     }
+    return changed;
+}
 
-    return glyphs;
+bool Document::_open_paged() {
+    // pages are decoded on the owner thread and on the prefetching thread, both use the document arena
+    const PagedSettings& settings = Settings::const_instance().const_paged();
+    std::string index_dir;
+    if (settings.index_cache) {
+        index_dir = settings.index_dir.empty()? PagedFile::default_index_dir(): settings.index_dir;
+    }
+    paged_ = std::make_shared<PagedFile>(filepath_, static_cast<size_t>(std::max(settings.cache_size, 0LL)), index_dir,
+        [this](const char* start, const char* stop) {
+            LineArena::Scope scope(arena_);
+            return _load_lines(start, stop);
+        });
+    if ( !paged_->is_open() ) {
+        Logger::instance().error("Cannot load file: " + filepath_);
+        paged_.reset();
+        return false;
+    }
+
+    text_ = Text(std::make_shared<LineBuffer>(paged_));
+    for (size_t page = 0; page < paged_->pages(); page++) {
+        disk_index_.push_back({page * PagedFile::PAGE_LINES, paged_->page_offset(page)});
+    }
+    complete_ = true;
+    placeholder_ = false;
+
+    disk_stamp_ = FileStamp::of(filepath_);
+    disk_size_ = paged_->file_size();
+    _log_loaded(disk_size_, "paged, " + std::to_string(paged_->pages()) +
+                (paged_->index_loaded()? " pages, saved index": " pages indexed"), load_start_);
+    _open_journal();
+    _open_history();
+    if (following_) {
+        _start_follower();
+    }
+    return true;
 }
 
-Text Document::load_raw(const char *start) {
-    content_t content;
-    const char* cur = start;
-    const char* pos = start;
-    while (true) {
-        if ((*cur == '\n') || (*cur == '\0')) {
-            content.push_back(Document::load_line(pos, cur));
-            if (*cur == '\0')
-                break;
-            pos = cur+1;
-            cur = pos;
-            continue;
-        }
-        cur++;
+void Document::prefetch(int row, int count) {
+    if ( !paged_ ) {
+        return;
     }
-    return Text(content);
+    int total = total_lines();
+    int first = bounded(0, total, row);
+    int last = bounded(0, total, row + count);
+    text_.lines().for_each_piece(first, last - first, [](const Piece& piece) {
+        piece.buffer->prefetch(piece.start, piece.count);
+    });
 }
 
-void Document::load_from_file(const std::string& filepath) {
-    filepath_ = filepath;
+void Document::set_following(bool follow) {
+    following_ = follow;
+    // stream is read until its end anyway
+    if (streaming_) {
+        return;
+    }
+    follower_.reset();
+    // new document is followed once it is loaded from a file or saved to one
+    bool on_disk = (disk_stamp_.mtime_ns != 0);
+    if ( following_ && on_disk && !is_loading() && is_complete() ) {
+        _start_follower();
+    }
+}
 
-    std::ifstream infile(filepath_);
-    if ( !infile.is_open() ) {
-        Logger::instance().error("Cannot load file: " + filepath_);
+bool Document::poll_following() {
+    if ( !follower_ ) {
+        return false;
+    }
+
+    std::vector<FileFollower::Chunk> chunks;
+    FileFollower::Status status = follower_->take(chunks);
+    bool changed = !chunks.empty();
+    // lines read from a stream are unsaved text
+    if (changed && streaming_) {
+        _mark_changed(total_lines() - 1);
+    }
+
+    // all chunks taken at once become a single piece of the text
+    LineArena::Scope scope(arena_);
+    content_t lines;
+    for (FileFollower::Chunk& chunk: chunks) {
+        auto first = chunk.lines.begin();
+        if (chunk.continued) {
+            // the last line was being written when it was loaded
+            int last = total_lines() - 1;
+            content_t head;
+            head.push_back(std::move(*first++));
+            text_.insert_at({line_width(last), last}, Text(std::move(head)), SelectionShape::TEXT_LIKE);
+        } else if (changed_row_ == NO_CHANGES) {
+            disk_index_.push_back({static_cast<size_t>(total_lines()) + lines.size(), chunk.offset});
+        }
+        lines.insert(lines.end(), std::make_move_iterator(first), std::make_move_iterator(chunk.lines.end()));
+        if ( !streaming_ ) {
+            disk_size_ = chunk.offset + chunk.size;
+        }
+    }
+    if ( !lines.empty() ) {
+        text_.append_lines(Text(std::move(lines)));
+    }
+    if (changed && streaming_) {
+        _check_invalid_lines("input stream");
+    } else if (changed) {
+        _check_invalid_lines(filepath_);
+        // text is still the same as the file, unless the file has grown since
+        FileStamp stamp = FileStamp::of(filepath_);
+        if ((changed_row_ == NO_CHANGES) && (stamp.size == disk_size_)) {
+            disk_stamp_ = stamp;
+        }
+    }
+
+    if (status == FileFollower::Status::FOLLOWING) {
+        return changed;
+    }
+    follower_.reset();
+    if (streaming_) {
+        streaming_ = false;
+        if (status == FileFollower::Status::FINISHED) {
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - load_start_).count();
+            Logger::instance().info("Read " + std::to_string(total_lines()) + " lines from input stream in " +
+                                    std::to_string(static_cast<int>(seconds * 1000)) + " ms, they are saved to " + filepath_);
+        } else {
+            Logger::instance().warning("Reading of input stream is stopped, lines read so far are kept");
+        }
+        return changed;
+    }
+    if (status == FileFollower::Status::FAILED) {
+        following_ = false;
+        Logger::instance().warning("Following of " + filepath_ + " is stopped");
+        return changed;
+    }
+
+    // rotated or truncated log is loaded anew, unless that would lose unsaved edits
+    std::string what = filepath_ + ((status == FileFollower::Status::TRUNCATED)? " was truncated": " was replaced");
+    if (changed_row_ != NO_CHANGES) {
+        following_ = false;
+        Logger::instance().warning(what + ", following is stopped: the text has unsaved changes");
+        return changed;
+    }
+    Logger::instance().warning(what + ", it is loaded again");
+    if ( !start_loading(filepath_) ) {
+        following_ = false;
+    }
+    return true;
+}
+
+void Document::_start_follower() {
+    if (compressed_) {
+        Logger::instance().warning("Cannot follow " + filepath_ + ": compressed files are not followed");
+        following_ = false;
         return;
     }
+    // appended lines are parsed on the follower thread, like pages of the paged file they use the document arena
+    follower_.reset();
+    follower_.reset(new FileFollower(filepath_, disk_size_, Settings::const_instance().const_follow().interval_ms,
+        [this](const char* start, const char* stop) {
+            LineArena::Scope scope(arena_);
+            return _load_lines(start, stop);
+        }));
+    if ( !follower_->is_open() ) {
+        follower_.reset();
+        following_ = false;
+    }
+}
 
-    std::string line;
-    content_t content;
+void Document::cancel_loading() {
+    if (loader_) {
+        loader_->cancel();
+    }
+}
 
-    while (std::getline(infile, line))
-    {
-        line_t glyphs = Document::load_line(line.c_str(), line.c_str() + line.size());
-        content.push_back(glyphs);
+int Document::loading_percent() const {
+    if ( !loader_ || !loader_->total_bytes() ) {
+        return 0;
     }
-    infile.close();
+    return static_cast<int>(100.0 * loader_->loaded_bytes() / loader_->total_bytes());
+}
 
-    text_ = Text(content);
+size_t Document::arena_reserved() const {
+    size_t reserved = arena_.reserved();
+    for (const LineArena& arena: load_arenas_) {
+        reserved += arena.reserved();
+    }
+    return reserved;
+}
+
+size_t Document::arena_used() const {
+    size_t used = arena_.used();
+    for (const LineArena& arena: load_arenas_) {
+        used += arena.used();
+    }
+    return used;
 }
 
 void Document::save_to_file() {
-    std::ofstream outfile(filepath_.c_str());
-    if ( !outfile.is_open() ) {
+    if ( is_loading() || !is_complete() ) {
+        Logger::instance().error("Cannot save " + filepath_ + ": file is not loaded completely");
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    // big files keep unchanged lines on the disk, the rest is written after them;
+    // a crash meanwhile tears the file and orphans the journal (see Journal)
+    size_t row = 0;
+    uint64_t offset = 0;
+    bool in_place = _find_changed_tail(row, offset);
+    std::unique_ptr<FileWriter> file(in_place? new FileWriter(filepath_, offset):
+        new FileWriter(filepath_, compressed_? FileWriter::Compression::GZIP: FileWriter::Compression::NONE));
+    if ( !file->is_open() ) {
         Logger::instance().error("Cannot save to file: " + filepath_);
         return;
     }
 
-    for (const auto& line: text_.content()) {
-        for (const Glyph& g: line) {
-            outfile << g.real().c_str();
+    std::vector<DiskLine> index;
+    for (size_t i = 0; in_place && (i < disk_index_.size()) && (disk_index_[i].row < row); i++) {
+        index.push_back(disk_index_[i]);
+    }
+    index.push_back({row, offset});
+
+    uint64_t next_index = offset + DISK_INDEX_STEP;
+    text_.for_each_line([&](const line_t& line) {
+        uint64_t pos = offset + file->written();
+        if (pos >= next_index) {
+            index.push_back({row, pos});
+            next_index = pos + DISK_INDEX_STEP;
         }
-        outfile << std::endl;
+        _write_line(line, *file);
+        file->put('\n');
+        row++;
+    }, row);
+
+    if ( !file->commit() ) {
+        // file rewritten in place is damaged, next save writes it completely
+        disk_stamp_ = {0, 0};
+        Logger::instance().error("Cannot save to file: " + filepath_ + (in_place? "": ", file is not changed"));
+        return;
+    }
+    disk_index_.swap(index);
+    changed_row_ = NO_CHANGES;
+    disk_stamp_ = FileStamp::of(filepath_);
+    disk_size_ = offset + file->written();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::stringstream msg;
+    msg << "Saved " << text_.total_lines() << " lines to " << file->path() << ": " << file->written() << " bytes ";
+    if (in_place) {
+        msg << "written in place from byte " << offset;
+    } else {
+        msg << "written to a new " << (compressed_? "gzip file": "file");
+    }
+    msg << " in " << static_cast<int>(seconds * 1000) << " ms, "
+        << static_cast<size_t>(file->written() / std::max(seconds, 1e-6)) << " bytes/s";
+    Logger::instance().info(msg.str());
+
+    // saved edits are not needed for recovery anymore
+    if (journal_) {
+        journal_->reset(disk_stamp_);
+    }
+    if (history_.is_stored()) {
+        history_.mark_saved(HistoryStore::Version::of(filepath_));
+    }
+    // file saved as a new one is followed from its end, stream is read further into the text
+    if (follower_ && !streaming_) {
+        _start_follower();
     }
-    outfile.close();
 }
 
 
 void Document::insert_glyph(const Vec2i& pos, const Glyph& glyph, const Vec2i& cursor, SelectionShape shape, bool remember) {
+    LineArena::Scope scope(arena_);
     content_t content;
     content.resize(1);
     content[0].push_back(glyph);
-    Text text(content);
+    Text text(std::move(content));
     insert_text(pos, text, cursor, shape, remember);
 }
 
 void Document::insert_text(const Vec2i& pos, const Text& text, const Vec2i& cursor, SelectionShape shape, bool remember) {
+    LineArena::Scope scope(arena_);
     if (remember) {
-        AddTextItem* item = new AddTextItem(pos, text, cursor, shape);
-        history_.push_back(item);
+        history_.push_text(EditKind::ADD_TEXT, pos, text, cursor, shape);
     }
     text_.insert_at(pos, text, shape);
+    _mark_changed(pos.y);
+    _journal(Journal::Op::INSERT_TEXT, pos, pos, shape, &text);
 }
 
 void Document::remove_text(Vec2i from, Vec2i to, const Vec2i& cursor, SelectionShape shape, bool remember) {
@@ -121,33 +510,103 @@ void Document::remove_text(Vec2i from, Vec2i to, const Vec2i& cursor, SelectionS
         std::swap(from, to);
     }
 
+    LineArena::Scope scope(arena_);
     Text removed = text_.remove(from, to, shape);
+    _mark_changed(from.y);
+    _journal(Journal::Op::REMOVE_TEXT, from, to, shape);
 
     if (remember) {
-        RemoveTextItem* item = new RemoveTextItem(from, removed, cursor, shape);
-        history_.push_back(item);
+        history_.push_back(HistoryItem(EditKind::REMOVE_TEXT, from, std::move(removed), cursor, shape));
     }
 }
 
 void Document::add_newline(const Vec2i& pos, const Vec2i& cursor, bool remember) {
+    LineArena::Scope scope(arena_);
     text_.add_newline(pos);
+    _mark_changed(pos.y);
+    _journal(Journal::Op::ADD_NEWLINE, pos, pos, SelectionShape::NONE);
 
     if (remember) {
-        AddNewLineItem *item = new AddNewLineItem(pos, cursor);
-        history_.push_back(item);
+        history_.push_back(HistoryItem(EditKind::ADD_NEWLINE, pos, cursor));
     }
 }
 
 void Document::remove_newline(const Vec2i& pos, const Vec2i& cursor, bool remember) {
+    LineArena::Scope scope(arena_);
     text_.remove_newline(pos);
+    _mark_changed(pos.y);
+    _journal(Journal::Op::REMOVE_NEWLINE, pos, pos, SelectionShape::NONE);
 
     if (remember) {
-        RemoveNewLineItem *item = new RemoveNewLineItem(pos, cursor);
-        history_.push_back(item);
+        history_.push_back(HistoryItem(EditKind::REMOVE_NEWLINE, pos, cursor));
     }
 }
 
 
+bool Document::filter_text(Vec2i from, Vec2i to, const std::string& command, const Vec2i& cursor, SelectionShape shape) {
+    if ( (from.y > to.y) || ((from.y == to.y) && (from.x > to.x)) ) {
+        std::swap(from, to);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    LineArena::Scope scope(arena_);
+    // the copy shares lines with the text, only the cut first and last lines are new
+    Text selected = Text(text_).remove(from, to, shape);
+
+    // selected lines are encoded on the feeding thread, the output is parsed here into the document arena
+    FilterProcess process(command, [this](const char* start, const char* stop) {
+        return _load_lines(start, stop);
+    });
+    std::vector<content_t> chunks;
+    bool success = process.run([&selected](FilterProcess& input) {
+        selected.for_each_line([&input](const line_t& line) {
+            _write_line(line, input);
+            input.put('\n');
+        });
+    }, chunks);
+    _check_invalid_lines("output of `" + command + "`");
+    if ( !success ) {
+        Logger::instance().error("Cannot filter text through `" + command + "`, text is not changed");
+        return false;
+    }
+
+    // every read block becomes a piece of its own, empty output is a single empty line
+    Text output;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (i == 0) {
+            output = Text(std::move(chunks[i]));
+        } else {
+            output.append_lines(Text(std::move(chunks[i])));
+        }
+    }
+
+    // output of a block is inserted line by line into the rows of the block
+    if ( (shape == SelectionShape::RECTANGULAR) && (output.total_lines() != selected.total_lines()) ) {
+        Logger::instance().error("`" + command + "` printed " + std::to_string(output.total_lines()) + " lines for a block of " +
+                                 std::to_string(selected.total_lines()) + " rows, text is not changed");
+        return false;
+    }
+
+    Text removed = text_.remove(from, to, shape);
+    text_.insert_at(from, output, shape);
+    _mark_changed(from.y);
+    _journal(Journal::Op::REMOVE_TEXT, from, to, shape);
+    _journal(Journal::Op::INSERT_TEXT, from, from, shape, &output);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::stringstream msg;
+    msg << "Filtered " << removed.total_lines() << " lines through `" << command << "`: " << process.written()
+        << " bytes in, " << output.total_lines() << " lines (" << process.read() << " bytes) out in "
+        << static_cast<int>(seconds * 1000) << " ms";
+    Logger::instance().info(msg.str());
+
+    // the replacement is undone in one step
+    history_.push_back(HistoryItem(EditKind::REMOVE_TEXT, from, std::move(removed), cursor, shape), false);
+    history_.push_back(HistoryItem(EditKind::ADD_TEXT, from, std::move(output), cursor, shape, true));
+    return true;
+}
+
+
 // TODO: add setting for special chars color
 void Document::_init_special_chars() {
     // tab -> →
@@ -157,6 +616,219 @@ void Document::_init_special_chars() {
     Glyph g("\t", buf);
     g.set_color(0x888888ff);
     special_chars_['\t'] = g;
+
+    for (const auto& special: special_chars_) {
+        decoder_.set_special(special.first, special.second);
+    }
+}
+
+// Splits [start, stop) into lines by '\n', the last line is stored even if it is empty.
+// memchr is vectorized by the C library, so line boundaries are found 16-64 bytes at a time.
+content_t Document::_load_lines(const char* start, const char* stop) {
+    content_t content;
+    const char* pos = start;
+    while (true) {
+        const char* eol = static_cast<const char*>(std::memchr(pos, '\n', stop - pos));
+        if (!eol) {
+            content.push_back(load_line(pos, stop));
+            break;
+        }
+        content.push_back(load_line(pos, eol));
+        pos = eol + 1;
+    }
+    return content;
+}
+
+// Finds the first changed line and its offset in the file on the disk.
+// Returns false if the whole file has to be written anew: the file is small, it was
+// changed by someone else, or most of it has to be rewritten anyway, and then an atomic
+// save is worth more than saved writes.
+bool Document::_find_changed_tail(size_t& row, uint64_t& offset) const {
+    // lines of the paged file after the changed one are read from the file being rewritten,
+    // compressed file is compressed anew as a whole
+    if (paged_ || compressed_) {
+        return false;
+    }
+    size_t changed = std::min(changed_row_, static_cast<size_t>(text_.total_lines()));
+    if ( disk_index_.empty() || (changed == 0) || !(FileStamp::of(filepath_) == disk_stamp_) ) {
+        return false;
+    }
+    int min_size = Settings::const_instance().const_text().incremental_save_min_size;
+    if ((min_size < 0) || (disk_stamp_.size < static_cast<uint64_t>(min_size))) {
+        return false;
+    }
+
+    MappedFile file(filepath_);
+    if ( !file.is_mapped() ) {
+        return false;
+    }
+
+    // lines are counted from the nearest known offset before the changed line
+    auto it = std::upper_bound(disk_index_.begin(), disk_index_.end(), changed,
+                               [](size_t r, const DiskLine& line) { return r < line.row; });
+    --it;
+    const char* pos = file.begin() + it->offset;
+    for (size_t r = it->row; r < changed; r++) {
+        const char* eol = static_cast<const char*>(std::memchr(pos, '\n', file.end() - pos));
+        if (!eol) {
+            return false;
+        }
+        pos = eol + 1;
+    }
+
+    offset = pos - file.begin();
+    if (file.size() - offset > file.size() / 2) {
+        return false;
+    }
+    row = changed;
+    return true;
+}
+
+void Document::_mark_changed(int row) {
+    changed_row_ = std::min(changed_row_, static_cast<size_t>(std::max(row, 0)));
+}
+
+void Document::_open_journal() {
+    const JournalSettings& settings = Settings::const_instance().const_journal();
+    if ( !settings.enabled ) {
+        return;
+    }
+
+    std::string path = Journal::path_for(filepath_);
+    size_t valid_size = 0;
+    _recover_journal(path, disk_stamp_, valid_size);
+    journal_.reset(new Journal(path, disk_stamp_, valid_size, settings.sync_interval_ms));
+}
+
+// Edits left by a crashed session are replayed before the journal is continued
+void Document::_recover_journal(const std::string& path, const FileStamp& stamp, size_t& valid_size) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Journal::Record> records;
+    Journal::Status status = Journal::read(path, stamp, records, valid_size);
+    if (status == Journal::Status::MISSING) {
+        return;
+    }
+    if (status == Journal::Status::MISMATCH) {
+        std::string orphaned = path + ".orphaned";
+        std::rename(path.c_str(), orphaned.c_str());
+        Logger::instance().warning("Journal " + path + " does not match " + filepath_ + ", it is moved to " + orphaned +
+                                   ": the file was changed outside or its save was interrupted");
+        return;
+    }
+
+    // journal_ is not open yet, so replayed edits are not journaled twice
+    LineArena::Scope scope(arena_);
+    for (const Journal::Record& record: records) {
+        switch (record.op) {
+            case Journal::Op::INSERT_TEXT: {
+                const char* data = record.text.data();
+                Text text(_load_lines(data, data + record.text.size()));
+                insert_text(record.from, text, record.from, record.shape, false);
+                break;
+            }
+            case Journal::Op::REMOVE_TEXT:
+                remove_text(record.from, record.to, record.from, record.shape, false);
+                break;
+            case Journal::Op::ADD_NEWLINE:
+                add_newline(record.from, record.from, false);
+                break;
+            case Journal::Op::REMOVE_NEWLINE:
+                remove_newline(record.from, record.from, false);
+                break;
+        }
+    }
+    _check_invalid_lines(path);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    Logger::instance().warning("Recovered " + std::to_string(records.size()) + " unsaved edits of " + filepath_ +
+                               " from " + path + " in " + std::to_string(static_cast<int>(seconds * 1000)) + " ms");
+}
+
+void Document::_close_journal() {
+    if (journal_) {
+        journal_->remove();
+        journal_.reset();
+    }
+}
+
+// Inserted text is encoded only when the journal is written. Long text is journaled as
+// inserts of blocks of whole lines, each one after the previous, so the whole text is never
+// encoded into a single string.
+void Document::_journal(Journal::Op op, const Vec2i& from, const Vec2i& to, SelectionShape shape, const Text* text) {
+    if ( !journal_ ) {
+        return;
+    }
+    if ( !text ) {
+        journal_->append({op, shape, from, to, std::string()});
+        return;
+    }
+
+    Journal::Record record{op, shape, from, from, std::string()};
+    StringWriter out{record.text};
+    int block_lines = 0;
+    text->for_each_line([&](const line_t& line) {
+        if (block_lines > 0) {
+            if (record.text.size() < JOURNAL_BLOCK_SIZE) {
+                out.put('\n');
+            } else {
+                // text-like block ends with the line break, the next one starts at the next line
+                if (shape != SelectionShape::RECTANGULAR) {
+                    out.put('\n');
+                }
+                journal_->append(record);
+                record.from = Vec2i((shape == SelectionShape::RECTANGULAR)? from.x: 0, record.from.y + block_lines);
+                record.to = record.from;
+                record.text.clear();
+                block_lines = 0;
+            }
+        }
+        _write_line(line, out);
+        block_lines++;
+    });
+    journal_->append(record);
+}
+
+// History of the file is restored from its store only if the text is the same as the file
+void Document::_open_history() {
+    const HistorySettings& settings = Settings::const_instance().const_history();
+    if ( !settings.persistent || (changed_row_ != NO_CHANGES) ) {
+        return;
+    }
+    std::string dir = settings.store_dir;
+    if (dir.empty()) {
+        std::string cache = PagedFile::default_index_dir();
+        if (cache.empty()) {
+            return;
+        }
+        dir = cache + "/history";
+    }
+    history_.open_store(HistoryStore::path_for(dir, filepath_), HistoryStore::Version::of(filepath_));
+}
+
+size_t Document::_load_threads() const {
+    int threads = Settings::const_instance().const_text().load_threads;
+    if (threads <= 0) {
+        threads = static_cast<int>(std::thread::hardware_concurrency());
+    }
+    return static_cast<size_t>(std::max(threads, 1));
+}
+
+void Document::_log_loaded(size_t bytes, const std::string& how, std::chrono::steady_clock::time_point start) {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::stringstream msg;
+    msg << "Loaded " << text_.total_lines() << " lines (" << bytes << " bytes, " << how << ") from " << filepath_
+        << " in " << static_cast<int>(seconds * 1000) << " ms, "
+        << static_cast<size_t>(bytes / std::max(seconds, 1e-6)) << " bytes/s"
+        << ", line arenas: " << arena_used() << " of " << arena_reserved() << " reserved bytes used";
+    Logger::instance().info(msg.str());
+}
+
+void Document::_check_invalid_lines(const std::string& source) {
+    if (invalid_lines_) {
+        Logger::instance().warning("Document: " + std::to_string(invalid_lines_) + " lines of " + source +
+                                   " are not valid UTF-8, invalid bytes are shown as U+FFFD");
+        invalid_lines_ = 0;
+    }
 }
 
 void Document::log_items() {
@@ -164,20 +836,67 @@ void Document::log_items() {
 }
 
 
-const pItem_t& Document::undo() {
-    const pItem_t& item = history_.current_item();
-    if (item) {
+// Joined items are undone together, the first of them is returned
+const HistoryItem* Document::undo() {
+    // joined items are undone all or none
+    if ( !history_.load_undo_group() ) {
+        return nullptr;
+    }
+    const HistoryItem* undone = nullptr;
+    while (const HistoryItem* item = history_.current_item()) {
         item->undo(*this);
         history_.dec();
+        undone = item;
+        if ( !item->joined ) {
+            break;
+        }
     }
-    return item;
+    return undone;
 }
 
-const pItem_t& Document::redo() {
-    const pItem_t& item = history_.next_item();
-    if (item) {
+// Joined items are redone together, the last of them is returned
+const HistoryItem* Document::redo() {
+    if ( !history_.load_redo_group() ) {
+        return nullptr;
+    }
+    const HistoryItem* redone = nullptr;
+    while (const HistoryItem* item = history_.next_item()) {
+        if ( redone && !item->joined ) {
+            break;
+        }
+        item->redo(*this);
+        history_.inc();
+        redone = item;
+    }
+    return redone;
+}
+
+const HistoryItem* Document::jump_to(uint64_t id) {
+    size_t undos = 0;
+    std::vector<uint64_t> redos;
+    if ( !history_.path_to(id, undos, redos) ) {
+        return nullptr;
+    }
+    const HistoryItem* last = nullptr;
+    // the path stops before a group which cannot be read back, never inside it
+    for (size_t i = 0; i < undos; i++) {
+        const HistoryItem* item = history_.load_undo_group()? history_.current_item(): nullptr;
+        if ( !item ) {
+            return last;
+        }
+        item->undo(*this);
+        history_.dec();
+        last = item;
+    }
+    for (auto it = redos.rbegin(); it != redos.rend(); ++it) {
+        history_.choose(*it);
+        const HistoryItem* item = history_.load_redo_group()? history_.next_item(): nullptr;
+        if ( !item ) {
+            return last;
+        }
         item->redo(*this);
         history_.inc();
+        last = item;
     }
-    return item;
+    return last;
 }
@@ -4,15 +4,25 @@
 #include "text.hpp"
 #include "la.hpp"
 #include "history.hpp"
+#include "utf8.hpp"
+#include "line_arena.hpp"
+#include "file_loader.hpp"
+#include "file_writer.hpp"
+#include "file_follower.hpp"
+#include "filter_process.hpp"
+#include "journal.hpp"
+#include "paged_file.hpp"
 
+#include <atomic>
+#include <deque>
+#include <chrono>
+#include <memory>
 
-constexpr char ASCII_CHAR_LOW = 32;
-constexpr char ASCII_CHAR_HIGH = 126;
 
 class Document {
 public:
     Document();
-    ~Document() {}
+    ~Document();
 
     const Glyph& glyph_at(const Vec2i& pos) const { return line_at(pos).at(pos.x); }
     const line_t& line_at(const Vec2i& pos) const { return text_.line_at(pos); }
@@ -20,7 +30,11 @@ public:
     int line_width(int row) const { return text_.line_width(row); }
     int max_line_width() const { return text_.max_line_width(); }
     const Text& text() const { return text_; }
+    const History& history() const { return history_; }
     const std::string& filepath() const { return filepath_; }
+    // memory of all line arenas of the document
+    size_t arena_reserved() const;
+    size_t arena_used() const;
 
     line_t load_line(const char* start, const char* stop);
     Text load_raw(const char* start);
@@ -28,23 +42,88 @@ public:
     void load_from_file(const std::string& filepath);
     void save_to_file();
 
+    // Loads file on background threads, loaded lines appear in the text on poll_loading()
+    bool start_loading(const std::string& filepath);
+    // Takes lines loaded so far, returns true if the text was changed
+    bool poll_loading();
+    void cancel_loading();
+    bool is_loading() const { return loader_ != nullptr; }
+    int loading_percent() const;
+    // false if loading of the file was cancelled, such document cannot be saved
+    bool is_complete() const { return complete_; }
+    // big file is shown page by page, see PagedFile
+    bool is_paged() const { return paged_ != nullptr; }
+    // gzip file is decompressed when loaded and compressed again when saved
+    bool is_compressed() const { return compressed_; }
+    // Lines [row, row + count) are going to be shown soon
+    void prefetch(int row, int count);
+
+    // Follows the file growing at the end, appended lines appear in the text on poll_following().
+    // Following starts once the file is loaded completely.
+    void set_following(bool follow);
+    // Like set_following(), but only for the file loaded next: the current one is not followed
+    void follow_next_load(bool follow) { following_ = follow; }
+    bool is_following() const { return following_; }
+    // Takes lines appended to the file so far, returns true if the text was changed
+    bool poll_following();
+
+    // Reads the stream `fd`, e.g. the standard input fed by a pipe, into a new text on the background
+    // thread. Read lines appear in the text on poll_following(), the text is saved to `filepath`.
+    bool start_reading(int fd, const std::string& filepath);
+    bool is_streaming() const { return streaming_; }
+
     void insert_glyph(const Vec2i& pos, const Glyph& glyph, const Vec2i& cursor, SelectionShape shape, bool remember=true);
 
     void insert_text(const Vec2i& pos, const Text& text, const Vec2i& cursor, SelectionShape shape, bool remember=true);
     void remove_text(Vec2i from, Vec2i to, const Vec2i& cursor, SelectionShape shape, bool remember=true);
     void add_newline(const Vec2i& pos, const Vec2i& cursor, bool remember=true);
     void remove_newline(const Vec2i& pos, const Vec2i& cursor, bool remember=true);
+    // Replaces the text between `from` and `to` with the output of `command` fed with it,
+    // as a single history item. Returns false if the command failed, the text is not changed then.
+    bool filter_text(Vec2i from, Vec2i to, const std::string& command, const Vec2i& cursor, SelectionShape shape);
 
     const char_map_t& specials() const { return special_chars_; }
 
     void log_items();
 
-    const pItem_t& undo();
-    const pItem_t& redo();
+    const HistoryItem* undo();
+    const HistoryItem* redo();
+    // Moves the text to the state after history item `id` through the common ancestor of the states,
+    // the last item undone or redone is returned
+    const HistoryItem* jump_to(uint64_t id);
+    // states made right before and after the current one, on any branch of the history
+    const HistoryItem* earlier() { return jump_to(history_.earlier()); }
+    const HistoryItem* later() { return jump_to(history_.later()); }
+    // the next branch is redone after undo, false if there is one branch only
+    bool switch_branch() { return history_.switch_branch(); }
 private:
     void _init_special_chars();
+    void _close_sources();
+    content_t _load_lines(const char* start, const char* stop);
+    bool _open_paged();
+    void _start_follower();
+    size_t _load_threads() const;
+    template<typename Out>
+    static void _write_line(const line_t& line, Out& out);
+
+    bool _find_changed_tail(size_t& row, uint64_t& offset) const;
+    void _mark_changed(int row);
+
+    // edits are journaled once the file is loaded completely
+    void _open_journal();
+    void _recover_journal(const std::string& path, const FileStamp& stamp, size_t& valid_size);
+    void _close_journal();
+    void _journal(Journal::Op op, const Vec2i& from, const Vec2i& to, SelectionShape shape, const Text* text = nullptr);
+    void _open_history();
+    void _log_loaded(size_t bytes, const std::string& how, std::chrono::steady_clock::time_point start);
+    void _check_invalid_lines(const std::string& source);
 
 private:
+    // declared first: lines of the text and history are released before the arena
+    LineArena arena_;
+    // one arena per loading thread, so parallel parsing does not contend on a single arena lock
+    std::deque<LineArena> load_arenas_;
+
     Text text_;
     History history_;
 
@@ -53,6 +132,40 @@ private:
     std::string filepath_;
 
     char_map_t special_chars_;
+    Utf8Decoder decoder_;
+    std::atomic<size_t> invalid_lines_;     // lines that are not valid UTF-8 since the last check
+
+    bool complete_;
+    bool compressed_;
+    bool placeholder_;      // text is the empty line shown until first lines are loaded
+    std::chrono::steady_clock::time_point load_start_;
+
+    std::unique_ptr<Journal> journal_;
+    // lines of the paged file are referenced by the text and the history
+    std::shared_ptr<PagedFile> paged_;
+
+    // Rows of the text with byte offsets of their lines in the file on the disk, one per
+    // loaded chunk or per DISK_INDEX_STEP bytes of saved text. Lines before `changed_row_`
+    // are the same as on the disk, so the file is rewritten starting from there.
+    struct DiskLine {
+        size_t row;
+        uint64_t offset;
+    };
+    std::vector<DiskLine> disk_index_;
+    size_t changed_row_;        // NO_CHANGES if text was not changed since load or save
+    FileStamp disk_stamp_;      // version of the file the text was loaded from or saved to
+    uint64_t disk_size_;        // bytes of the file shown in the text, following starts after them
+
+    bool following_;
+    bool streaming_;        // follower_ reads a stream, not a file
+
+    static constexpr size_t NO_CHANGES = static_cast<size_t>(-1);
+    static constexpr uint64_t DISK_INDEX_STEP = 4 * 1024 * 1024;
+    static constexpr size_t JOURNAL_BLOCK_SIZE = 1024 * 1024;
+
+    // declared last: the workers use other members until they are stopped
+    std::unique_ptr<FileFollower> follower_;
+    std::unique_ptr<FileLoader> loader_;
 };
 
 #endif // DOCUMENT_HPP_
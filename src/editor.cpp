@@ -4,6 +4,8 @@
 #include "settings.hpp"
 #include "selection.hpp"
 
+#include <unistd.h>
+
 #include <cfenv>
 #include <string>
 #include <cassert>
@@ -57,14 +59,50 @@ void Editor::set_renderer( SDL_Renderer *r, SDL_Window* w ) {
 }
 
 void Editor::load_from_file(const char* filepath) {
-    doc_.load_from_file(filepath);
+    // follower starts when the new file is loaded, the previous file is not followed meanwhile
+    doc_.follow_next_load(Settings::const_instance().const_follow().enabled);
+    doc_.start_loading(filepath);
+    _update_max_line_no_chars_width();
+}
+
+void Editor::read_stdin(const char* filepath) {
+    doc_.start_reading(STDIN_FILENO, filepath? std::string(filepath): doc_.filepath());
     _update_max_line_no_chars_width();
 }
 
+void Editor::cancel_loading() {
+    doc_.cancel_loading();
+}
+
 void Editor::save_to_file() {
     doc_.save_to_file();
 }
 
+void Editor::toggle_following() {
+    doc_.set_following(!doc_.is_following());
+    if (doc_.is_following()) {
+        Logger::instance().info("Following " + doc_.filepath());
+        _move_to_end();
+    }
+}
+
+void Editor::_move_to_end() {
+    if (selection_.get_state() == SelectionState::HIDDEN) {
+        move_cursor(-cursor_pos().x, doc_.total_lines() - 1 - cursor_pos().y);
+    }
+}
+
+// Lines of the next screen in the direction of scrolling are decoded ahead for paged files
+void Editor::_prefetch(int direction) {
+    int height = text_area_char_rect().h;
+    doc_.prefetch(camera_pos_.y + direction * height, height);
+}
+
+// Text cannot be changed until the file is loaded completely
+bool Editor::_editable() const {
+    return !doc_.is_loading();
+}
+
 void Editor::move_camera(const Vec2i& cursor_pos, bool cursor_sync) {
     const SDL_Rect& text_viewport = resize_to_char_size(renderer_.text_viewport(), renderer_.font_width(), renderer_.font_height());
 
@@ -93,10 +131,26 @@ void Editor::move_camera(const Vec2i& cursor_pos, bool cursor_sync) {
 }
 
 void Editor::render() {
-    renderer_.render_editor_area(cursor_, doc_.text(), selection_, camera_pos_);
+    if (doc_.poll_loading()) {
+        _update_max_line_no_chars_width();
+    }
+    // cursor on the last line stays at the end of the followed file
+    bool at_end = cursor_pos().y >= doc_.total_lines() - 1;
+    if (doc_.poll_following()) {
+        _update_max_line_no_chars_width();
+        _adjust_cursor();
+        if (at_end && Settings::const_instance().const_follow().pin_to_end) {
+            _move_to_end();
+        }
+    }
+    int loading_percent = doc_.is_loading()? doc_.loading_percent(): -1;
+    renderer_.render_editor_area(cursor_, doc_.text(), selection_, camera_pos_, loading_percent);
 }
 
 void Editor::handle_text_input(const char* text) {
+    if (!_editable()) {
+        return;
+    }
     if (selection_.get_state() != SelectionState::HIDDEN) {
         remove_text(selection_.start(), selection_.finish(), selection_.get_shape());
         selection_.set_state(SelectionState::HIDDEN);
@@ -192,6 +246,9 @@ void Editor::selection_to_clipboard() {
 }
 
 void Editor::insert_from_clipboard() {
+    if (!_editable()) {
+        return;
+    }
     char *clipboard_text = SDL_GetClipboardText();
     if (clipboard_text) {
         Text text = doc_.load_raw(clipboard_text);
@@ -203,6 +260,9 @@ void Editor::insert_from_clipboard() {
 }
 
 void Editor::cut_to_clipboard() {
+    if (!_editable()) {
+        return;
+    }
     if ( selection_.get_state() != SelectionState::HIDDEN ) {
         selection_to_clipboard();
         remove_text(selection_.start(), selection_.finish(), selection_.get_shape());
@@ -232,6 +292,28 @@ void Editor::toggle_selection_shape() {
     selection_.set_shape(new_shape);
 }
 
+// Selection, or the whole text without one, is replaced by the output of the filter command
+void Editor::filter_selection() {
+    if (!_editable()) {
+        return;
+    }
+    Vec2i from(0, 0);
+    Vec2i to(doc_.line_width(-1), doc_.total_lines() - 1);
+    SelectionShape shape = SelectionShape::TEXT_LIKE;
+    if (selection_.get_state() != SelectionState::HIDDEN) {
+        from = selection_.start();
+        to = selection_.finish();
+        shape = selection_.get_shape();
+    }
+
+    if ( !doc_.filter_text(from, to, Settings::const_instance().const_filter().command, cursor_pos(), shape) ) {
+        return;
+    }
+    selection_.set_state(SelectionState::HIDDEN);
+    _update_max_line_no_chars_width();
+    _adjust_cursor();
+}
+
 void Editor::insert_text(const Vec2i& pos, const Text& text) {
     doc_.insert_text(pos, text, cursor_.text_pos(), SelectionShape::TEXT_LIKE);
 }
@@ -274,6 +356,9 @@ void Editor::goto_space(bool forward) {
 }
 
 void Editor::add_new_line() {
+    if (!_editable()) {
+        return;
+    }
     if (selection_.get_state() != SelectionState::HIDDEN) {
         remove_text(selection_.start(), selection_.finish(), selection_.get_shape());
         selection_.set_state(SelectionState::HIDDEN);
@@ -289,6 +374,9 @@ void Editor::add_new_line() {
 }
 
 void Editor::handle_backspace() {
+    if (!_editable()) {
+        return;
+    }
     const Vec2i& pos = cursor_pos();
 
     if (selection_.get_state() == SelectionState::HIDDEN) {
@@ -313,6 +401,9 @@ void Editor::handle_backspace() {
 }
 
 void Editor::handle_delete() {
+    if (!_editable()) {
+        return;
+    }
     const Vec2i& pos = cursor_pos();
 
     if (selection_.get_state() == SelectionState::HIDDEN) {
@@ -375,6 +466,9 @@ void Editor::handle_shift_released() {
 
 
 void Editor::handle_tab_pressed() {
+    if (!_editable()) {
+        return;
+    }
     const Glyph& tab_glyph = doc_.specials().at('\t');
     Vec2i dpos(1, 0);
 
@@ -442,6 +536,7 @@ void Editor::handle_pageup_pressed() {
 
     update_selection(shift_down);
     move_cursor({0, -text_area_char_rect().h});
+    _prefetch(-1);
 }
 
 void Editor::handle_pagedown_pressed() {
@@ -449,6 +544,7 @@ void Editor::handle_pagedown_pressed() {
 
     update_selection(shift_down);
     move_cursor({0, text_area_char_rect().h});
+    _prefetch(1);
 }
 
 void Editor::handle_window_size_changed(int new_width, int new_height) {
@@ -512,6 +608,9 @@ void Editor::handle_wheel(const SDL_MouseWheelEvent& wheel) {
         diff = {-1, 0};
     }
     move_camera(camera_pos() + diff, false);
+    if (diff.y) {
+        _prefetch(diff.y);
+    }
 }
 
 Vec2i Editor::_get_mouse_local_delta(bool &success) {
@@ -543,15 +642,18 @@ void Editor::log_debug_history() {
 
 
 void Editor::handle_undo() {
+    if (!_editable()) {
+        return;
+    }
     selection_.set_state(SelectionState::HIDDEN);
-    const pItem_t& item = doc_.undo();
+    const HistoryItem* item = doc_.undo();
     const Vec2i& cursor_pos = cursor_.text_pos();
     Vec2i delta(0, 0);
 
     if ( item ) {
         SelectionShape shape = item->selection_shape();
         if ( shape != SelectionShape::NONE) {
-            const Vec2i begin = item->pos();
+            const Vec2i begin = item->pos;
             const Vec2i end = item->end();
 
             selection_.set_begin(begin);
@@ -559,22 +661,43 @@ void Editor::handle_undo() {
             selection_.set_state(SelectionState::FINISHED);
             selection_.set_shape(shape);
         }
-        delta = item->cursor() - cursor_pos;
+        delta = item->cursor - cursor_pos;
     }
     move_cursor(delta);
     // _adjust_cursor();
 }
 
 void Editor::handle_redo() {
+    if (!_editable()) {
+        return;
+    }
     selection_.set_state(SelectionState::HIDDEN);
-    const pItem_t& item = doc_.redo();
+    const HistoryItem* item = doc_.redo();
     const Vec2i& cursor_pos = cursor_.text_pos();
     Vec2i delta(0, 0);
 
     if (item) {
-        delta = item->cursor() - cursor_pos;
+        delta = item->cursor - cursor_pos;
     }
 
     move_cursor(delta);
     // _adjust_cursor();
 }
+
+void Editor::handle_time_travel(bool later) {
+    if (!_editable()) {
+        return;
+    }
+    selection_.set_state(SelectionState::HIDDEN);
+    const HistoryItem* item = later? doc_.later(): doc_.earlier();
+    if (item) {
+        move_cursor(item->cursor - cursor_.text_pos());
+    }
+}
+
+void Editor::handle_switch_branch() {
+    if (!_editable()) {
+        return;
+    }
+    doc_.switch_branch();
+}
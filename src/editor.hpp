@@ -27,7 +27,11 @@ public:
     void set_renderer( SDL_Renderer* r, SDL_Window* w);
 
     void load_from_file(const char* filepath);
+    // reads the standard input, the text is saved to `filepath` or to the default file
+    void read_stdin(const char* filepath);
+    void cancel_loading();
     void save_to_file();
+    void toggle_following();
 
     void move_cursor(int dx, int dy);
     void move_cursor(Vec2i delta);
@@ -41,6 +45,7 @@ public:
     void cut_to_clipboard();
     void select_all();
     void toggle_selection_shape();
+    void filter_selection();
 
     void insert_text(const Vec2i& pos, const Text& text);
     void remove_text(Vec2i from, Vec2i to, SelectionShape shape);
@@ -76,12 +81,18 @@ public:
     void handle_wheel(const SDL_MouseWheelEvent& wheel);
     void handle_undo();
     void handle_redo();
+    // to the state of the text made before or after the current one, on any branch of the history
+    void handle_time_travel(bool later);
+    void handle_switch_branch();
 
     void goto_space(bool forward);
 private:
     void _update_max_line_no_chars_width();
     void _adjust_cursor();
     void _set_mouse_cursor_shape(int x, int y);
+    bool _editable() const;
+    void _prefetch(int direction);
+    void _move_to_end();
 
 protected:
     Vec2i _get_mouse_local_delta(bool &success);
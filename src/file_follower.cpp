@@ -0,0 +1,265 @@
+#include "file_follower.hpp"
+
+#include "logger.hpp"
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+
+FileFollower::FileFollower(const std::string& filepath, uint64_t offset, int interval_ms, parse_t parse)
+    : filepath_(filepath), parse_(parse), interval_ms_(std::max(interval_ms, 0)),
+      fd_(-1), stream_(false), inotify_fd_(-1), stop_fd_(-1), offset_(offset), parsed_(offset), continued_(true),
+      status_(Status::FOLLOWING), stopping_(false)
+{
+    int fd = ::open(filepath_.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if ((fd < 0) || (::fstat(fd, &st) != 0) || !S_ISREG(st.st_mode)) {
+        Logger::instance().error("Cannot follow " + filepath_ + ": not a regular file");
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return;
+    }
+    fd_ = fd;
+
+    // without inotify the file is only checked every CHECK_INTERVAL_MS
+    inotify_fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if ((inotify_fd_ < 0) ||
+        (::inotify_add_watch(inotify_fd_, filepath_.c_str(), IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF) < 0)) {
+        Logger::instance().warning("Cannot watch " + filepath_ + " with inotify: " + std::strerror(errno) +
+                                   ", it is checked every " + std::to_string(CHECK_INTERVAL_MS) + " ms");
+    }
+
+    // the line shown last is continued if the shown part does not end with a newline
+    char last = 0;
+    if (offset_ > 0) {
+        continued_ = (::pread(fd_, &last, 1, static_cast<off_t>(offset_ - 1)) != 1) || (last != '\n');
+    }
+    _start();
+}
+
+FileFollower::FileFollower(int fd, const std::string& name, int interval_ms, parse_t parse)
+    : filepath_(name), parse_(parse), interval_ms_(std::max(interval_ms, 0)),
+      fd_(-1), stream_(true), inotify_fd_(-1), stop_fd_(-1), offset_(0), parsed_(0), continued_(true),
+      status_(Status::FOLLOWING), stopping_(false)
+{
+    // follower reads its own descriptor, the stream stays open for the caller
+    fd_ = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (fd_ < 0) {
+        Logger::instance().error("Cannot read " + filepath_ + ": " + std::strerror(errno));
+        return;
+    }
+    _start();
+}
+
+FileFollower::~FileFollower() {
+    if (worker_.joinable()) {
+        stopping_ = true;
+        uint64_t one = 1;
+        if (::write(stop_fd_, &one, sizeof(one)) != sizeof(one)) {
+            Logger::instance().error("Cannot stop following " + filepath_ + ": " + std::strerror(errno));
+        }
+        worker_.join();
+    }
+    for (int fd: {fd_, inotify_fd_, stop_fd_}) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+}
+
+void FileFollower::_start() {
+    stop_fd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stop_fd_ < 0) {
+        Logger::instance().error("Cannot read " + filepath_ + ": " + std::strerror(errno));
+        ::close(fd_);
+        fd_ = -1;
+        return;
+    }
+    worker_ = std::thread(stream_? &FileFollower::_run_stream: &FileFollower::_run, this);
+}
+
+FileFollower::Status FileFollower::take(std::vector<Chunk>& chunks) {
+    // status is read first: chunks read before the thread stopped are taken with it
+    Status status = status_.load();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (Chunk& chunk: chunks_) {
+        chunks.push_back(std::move(chunk));
+    }
+    chunks_.clear();
+    return status;
+}
+
+void FileFollower::_run() {
+    while (true) {
+        Status status = _read_appended();
+        if (status != Status::FOLLOWING) {
+            status_ = status;
+            return;
+        }
+        // writes which come while the thread sleeps are read at once
+        if ( !_wait(CHECK_INTERVAL_MS, true) || !_wait(interval_ms_, false) ) {
+            return;
+        }
+        _drain_events();
+    }
+}
+
+// Stream is read as soon as data arrives, read lines are handed over once per interval
+void FileFollower::_run_stream() {
+    std::vector<char> buf(READ_SIZE);
+    auto interval = std::chrono::milliseconds(interval_ms_);
+    auto deadline = std::chrono::steady_clock::now() + interval;
+    while (true) {
+        // thread sleeps until data arrives if there is nothing to hand over
+        int timeout = -1;
+        if ( !tail_.empty() ) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            timeout = static_cast<int>(std::max<long long>(left.count(), 0));
+        }
+        struct pollfd fds[2] = {{stop_fd_, POLLIN, 0}, {fd_, POLLIN, 0}};
+        if (::poll(fds, 2, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Logger::instance().error("Cannot read " + filepath_ + ": " + std::strerror(errno));
+            status_ = Status::FAILED;
+            return;
+        }
+        if (fds[0].revents & POLLIN) {
+            return;
+        }
+
+        if (fds[1].revents) {
+            ssize_t n = ::read(fd_, buf.data(), buf.size());
+            if (n == 0) {
+                _hand_over(true);
+                status_ = Status::FINISHED;
+                return;
+            }
+            if ((n < 0) && (errno != EINTR) && (errno != EAGAIN)) {
+                Logger::instance().error("Cannot read " + filepath_ + ": " + std::strerror(errno));
+                status_ = Status::FAILED;
+                return;
+            }
+            if (n > 0) {
+                tail_.insert(tail_.end(), buf.data(), buf.data() + n);
+                offset_ += static_cast<uint64_t>(n);
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if ((now >= deadline) || (tail_.size() >= MAX_STREAM_CHUNK)) {
+            _hand_over(false);
+            deadline = now + interval;
+        }
+    }
+}
+
+// Sleeps for `timeout_ms`, or until the file changes if `events` is set.
+// Returns false if the thread has to stop.
+bool FileFollower::_wait(int timeout_ms, bool events) {
+    struct pollfd fds[2] = {{stop_fd_, POLLIN, 0}, {inotify_fd_, POLLIN, 0}};
+    nfds_t count = (events && (inotify_fd_ >= 0))? 2: 1;
+    while (::poll(fds, count, timeout_ms) < 0) {
+        if (errno != EINTR) {
+            Logger::instance().error("Cannot follow " + filepath_ + ": " + std::strerror(errno));
+            return false;
+        }
+    }
+    return !(fds[0].revents & POLLIN);
+}
+
+void FileFollower::_drain_events() {
+    if (inotify_fd_ < 0) {
+        return;
+    }
+    // events only wake the thread up, what has changed is found by stat()
+    char buf[4096];
+    while (::read(inotify_fd_, buf, sizeof(buf)) > 0) {
+    }
+}
+
+FileFollower::Status FileFollower::_read_appended() {
+    struct stat st;
+    if (::fstat(fd_, &st) != 0) {
+        Logger::instance().error("Cannot follow " + filepath_ + ": " + std::strerror(errno));
+        return Status::FAILED;
+    }
+    uint64_t size = static_cast<uint64_t>(st.st_size);
+    if (size < offset_) {
+        return Status::TRUNCATED;
+    }
+
+    while ((offset_ < size) && !stopping_) {
+        size_t count = static_cast<size_t>(std::min<uint64_t>(READ_SIZE, size - offset_));
+        size_t kept = tail_.size();
+        tail_.resize(kept + count);
+        ssize_t n = ::pread(fd_, tail_.data() + kept, count, static_cast<off_t>(offset_));
+        if (n <= 0) {
+            tail_.resize(kept);
+            if ((n < 0) && (errno == EINTR)) {
+                continue;
+            }
+            if (n < 0) {
+                Logger::instance().error("Cannot read " + filepath_ + ": " + std::strerror(errno));
+                return Status::FAILED;
+            }
+            break;
+        }
+        tail_.resize(kept + static_cast<size_t>(n));
+        offset_ += static_cast<uint64_t>(n);
+        _hand_over(false);
+    }
+
+    // bytes written to the old file before rotation are read first
+    return _replaced()? Status::REPLACED: Status::FOLLOWING;
+}
+
+// Parses complete lines read so far and hands them over.
+// At the end of the stream the last line is complete even without a newline.
+void FileFollower::_hand_over(bool end) {
+    const char* start = tail_.data();
+    const char* stop = start + tail_.size();
+    size_t size = tail_.size();
+    if (end) {
+        if (tail_.empty()) {
+            return;
+        }
+        // newline at the end does not start a new line
+        if (*(stop - 1) == '\n') {
+            stop--;
+        }
+    } else {
+        stop = static_cast<const char*>(::memrchr(start, '\n', tail_.size()));
+        if (!stop) {
+            return;
+        }
+        size = static_cast<size_t>(stop - start) + 1;
+    }
+
+    Chunk chunk{parse_(start, stop), parsed_, size, continued_};
+    parsed_ += size;
+    continued_ = false;
+    tail_.erase(tail_.begin(), tail_.begin() + static_cast<std::ptrdiff_t>(size));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    chunks_.push_back(std::move(chunk));
+}
+
+bool FileFollower::_replaced() const {
+    struct stat path_st, fd_st;
+    if ((::stat(filepath_.c_str(), &path_st) != 0) || (::fstat(fd_, &fd_st) != 0)) {
+        return true;
+    }
+    return (path_st.st_ino != fd_st.st_ino) || (path_st.st_dev != fd_st.st_dev);
+}
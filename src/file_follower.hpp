@@ -0,0 +1,98 @@
+#ifndef FILE_FOLLOWER_HPP_
+#define FILE_FOLLOWER_HPP_
+
+#include "piece_table.hpp"
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+
+// Follows a file growing at the end, like a log written by a running service.
+// The background thread sleeps on inotify events of the file and reads only the bytes
+// appended since the last read. Complete lines are parsed by the `parse` callback on
+// that thread, so the owner only links parsed chunks into its text. A line which is still
+// being written is held back until its newline arrives. Writes coming in quick succession
+// are batched into one chunk per `interval_ms`, which keeps the number of pieces low.
+//
+// Follower may also read a stream, like the standard input fed by a pipe, until its end.
+// Stream is read as fast as it is written, read lines are handed over once per `interval_ms`.
+class FileFollower {
+public:
+    typedef std::function<content_t(const char* start, const char* stop)> parse_t;
+
+    enum class Status {
+        FOLLOWING,
+        TRUNCATED,      // file became shorter than the part already read
+        REPLACED,       // file was moved or deleted, e.g. by log rotation
+        FINISHED,       // end of the stream was read
+        FAILED
+    };
+
+    struct Chunk {
+        content_t lines;
+        uint64_t offset;    // byte offset of the first line in the file
+        uint64_t size;      // bytes of the lines including their newlines
+        bool continued;     // first line continues the last line read before
+    };
+
+    // `offset` is the size of the part of the file which is already shown
+    explicit FileFollower(const std::string& filepath, uint64_t offset, int interval_ms, parse_t parse);
+    // reads the stream `fd` from its current position, `fd` is not closed
+    explicit FileFollower(int fd, const std::string& name, int interval_ms, parse_t parse);
+    ~FileFollower();
+
+    explicit FileFollower(const FileFollower&) = delete;
+    void operator=(const FileFollower&) = delete;
+
+    bool is_open() const { return fd_ >= 0; }
+
+    // Moves chunks parsed so far to `chunks` in the file order. The thread stops once
+    // the status is not FOLLOWING, chunks read before are still handed over.
+    Status take(std::vector<Chunk>& chunks);
+
+    static constexpr size_t READ_SIZE = 1024 * 1024;
+    // read lines of the stream are handed over before the interval passes if there are that many bytes of them
+    static constexpr size_t MAX_STREAM_CHUNK = 4 * 1024 * 1024;
+    // files are checked this often even without events, inotify does not work on network file systems
+    static constexpr int CHECK_INTERVAL_MS = 1000;
+
+private:
+    void _start();
+    void _run();
+    void _run_stream();
+    bool _wait(int timeout_ms, bool events);
+    void _drain_events();
+    Status _read_appended();
+    void _hand_over(bool end);
+    bool _replaced() const;
+
+private:
+    std::string filepath_;
+    parse_t parse_;
+    int interval_ms_;
+
+    int fd_;
+    bool stream_;
+    int inotify_fd_;
+    int stop_fd_;           // eventfd which wakes the thread up to stop
+
+    // used only by the thread
+    uint64_t offset_;       // bytes read from the file
+    uint64_t parsed_;       // bytes of complete lines handed over
+    bool continued_;
+    std::vector<char> tail_;    // bytes of the line still being written
+
+    std::mutex mutex_;
+    std::vector<Chunk> chunks_;
+    std::atomic<Status> status_;
+    std::atomic<bool> stopping_;
+
+    std::thread worker_;
+};
+
+#endif // FILE_FOLLOWER_HPP_
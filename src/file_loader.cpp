@@ -0,0 +1,244 @@
+#include "file_loader.hpp"
+
+#include "logger.hpp"
+
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstring>
+#include <algorithm>
+
+
+static const unsigned char GZIP_MAGIC[2] = {0x1f, 0x8b};
+
+
+FileLoader::FileLoader(const std::string& filepath, size_t threads, parse_t parse)
+    : file_(filepath), parse_(parse), compressed_(false), split_(false), taken_(0), next_(0),
+      cancelled_(false), finished_(false), loaded_bytes_(0), running_(0)
+{
+    if ( !file_.is_open() ) {
+        finished_ = true;
+        return;
+    }
+
+    compressed_ = (file_.size() >= sizeof(GZIP_MAGIC)) && (std::memcmp(file_.begin(), GZIP_MAGIC, sizeof(GZIP_MAGIC)) == 0);
+    size_t count;
+    if (compressed_) {
+        count = std::max<size_t>(1, threads);
+        inflater_ = std::thread(&FileLoader::_inflate, this);
+    } else {
+        _split();
+        split_ = true;
+        count = std::max<size_t>(1, std::min(threads, chunks_.size()));
+    }
+    running_ = count;
+    for (size_t i = 0; i < count; i++) {
+        workers_.emplace_back(&FileLoader::_run, this, i);
+    }
+}
+
+FileLoader::~FileLoader() {
+    cancel();
+    for (std::thread& worker: workers_) {
+        worker.join();
+    }
+    if (inflater_.joinable()) {
+        inflater_.join();
+    }
+}
+
+void FileLoader::cancel() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cancelled_ = true;
+    }
+    added_cv_.notify_all();
+    claimed_cv_.notify_all();
+}
+
+bool FileLoader::is_gzip(const std::string& filepath) {
+    unsigned char magic[sizeof(GZIP_MAGIC)];
+    int fd = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool gzip = (::read(fd, magic, sizeof(magic)) == sizeof(magic)) && (std::memcmp(magic, GZIP_MAGIC, sizeof(magic)) == 0);
+    ::close(fd);
+    return gzip;
+}
+
+void FileLoader::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    finished_cv_.wait(lock, [this] { return running_ == 0; });
+}
+
+bool FileLoader::done() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return split_ && (taken_ == chunks_.size());
+}
+
+bool FileLoader::take(std::vector<content_t>& chunks, std::vector<size_t>& offsets) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t first = taken_;
+    while ((taken_ < chunks_.size()) && chunks_[taken_].ready) {
+        chunks.push_back(std::move(chunks_[taken_].lines));
+        offsets.push_back(chunks_[taken_].offset);
+        taken_++;
+    }
+    return taken_ != first;
+}
+
+// Chunk boundaries are found once before parsing: only a few bytes after
+// every nominal chunk end have to be scanned to find the end of the line
+void FileLoader::_split() {
+    const char* pos = file_.begin();
+
+    // newline at the end of the file does not start a new line
+    const char* stop = file_.end();
+    if ((stop != pos) && (*(stop - 1) == '\n')) {
+        stop--;
+    }
+
+    size_t chunk_size = FIRST_CHUNK_SIZE;
+    while (true) {
+        const char* chunk_end = pos + std::min(chunk_size, static_cast<size_t>(stop - pos));
+        if (chunk_end != stop) {
+            const char* eol = static_cast<const char*>(std::memchr(chunk_end, '\n', stop - chunk_end));
+            chunk_end = eol? eol: stop;
+        }
+        size_t offset = pos - file_.begin();
+        chunks_.push_back({pos, chunk_end, std::vector<char>(), offset, static_cast<size_t>(chunk_end - pos) + 1, content_t(), false});
+
+        if (chunk_end == stop) {
+            break;
+        }
+        pos = chunk_end + 1;
+        chunk_size = std::min(2 * chunk_size, MAX_CHUNK_SIZE);
+    }
+}
+
+// Decompresses the file into chunks cut at line boundaries, like _split() does for plain files.
+// Concatenated gzip members are decompressed one after another, as gzip does.
+void FileLoader::_inflate() {
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    // 32 turns on detection of the gzip header
+    int ret = inflateInit2(&stream, 15 + 32);
+
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(file_.begin());
+    size_t in_left = file_.size();
+    std::vector<char> data;         // text of the line which is cut by the end of the previous chunk
+    size_t offset = 0;
+    size_t file_pos = 0;
+    size_t chunk_size = FIRST_CHUNK_SIZE;
+    bool end = false;
+
+    while ( (ret == Z_OK) && !end && !cancelled_ ) {
+        size_t kept = data.size();
+        data.resize(kept + chunk_size);
+        stream.next_out = reinterpret_cast<unsigned char*>(data.data() + kept);
+        stream.avail_out = static_cast<uInt>(chunk_size);
+        while ( stream.avail_out && !end ) {
+            if ( !stream.avail_in ) {
+                uInt n = static_cast<uInt>(std::min<size_t>(in_left, UINT_MAX));
+                stream.next_in = const_cast<unsigned char*>(in);
+                stream.avail_in = n;
+                in += n;
+                in_left -= n;
+            }
+            ret = inflate(&stream, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                end = !stream.avail_in && !in_left;
+                ret = end? Z_OK: inflateReset(&stream);
+            }
+            if (ret != Z_OK) {
+                break;
+            }
+        }
+        if (ret != Z_OK) {
+            break;
+        }
+        data.resize(data.size() - stream.avail_out);
+
+        // newline at the end of the file does not start a new line
+        size_t stop = data.size();
+        std::vector<char> rest;
+        if (end) {
+            if (stop && (data[stop - 1] == '\n')) {
+                stop--;
+            }
+        } else {
+            const char* eol = static_cast<const char*>(::memrchr(data.data(), '\n', data.size()));
+            if (!eol) {
+                continue;
+            }
+            stop = eol - data.data();
+            rest.assign(data.begin() + stop + 1, data.end());
+        }
+        data.resize(stop);
+
+        size_t pos = file_.size() - in_left - stream.avail_in;
+        Chunk chunk{nullptr, nullptr, std::move(data), offset, pos - file_pos, content_t(), false};
+        chunk.start = chunk.data.data();
+        chunk.stop = chunk.start + stop;
+        _add_chunk(std::move(chunk));
+
+        data = std::move(rest);
+        offset += stop + 1;
+        file_pos = pos;
+        chunk_size = std::min(2 * chunk_size, MAX_CHUNK_SIZE);
+    }
+
+    if (ret != Z_OK) {
+        const char* what = stream.msg? stream.msg: (ret == Z_BUF_ERROR)? "unexpected end of file": "error";
+        Logger::instance().error(std::string("FileLoader: cannot decompress: ") + what);
+        cancel();
+    }
+    inflateEnd(&stream);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        split_ = true;
+    }
+    added_cv_.notify_all();
+}
+
+void FileLoader::_add_chunk(Chunk&& chunk) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // decompressed text waiting for the workers is kept in memory, so decompression does not run too far ahead
+    claimed_cv_.wait(lock, [this] { return cancelled_ || (chunks_.size() - next_ < MAX_WAITING_CHUNKS); });
+    chunks_.push_back(std::move(chunk));
+    added_cv_.notify_one();
+}
+
+void FileLoader::_run(size_t worker) {
+    while (true) {
+        Chunk* chunk;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            added_cv_.wait(lock, [this] { return cancelled_ || split_ || (next_ < chunks_.size()); });
+            if ( cancelled_ || (next_ == chunks_.size()) ) {
+                break;
+            }
+            chunk = &chunks_[next_++];
+        }
+        claimed_cv_.notify_one();
+
+        content_t lines = parse_(chunk->start, chunk->stop, worker);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            chunk->lines = std::move(lines);
+            chunk->data = std::vector<char>();
+            chunk->ready = true;
+        }
+        loaded_bytes_ += chunk->file_bytes;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--running_ == 0) {
+        finished_ = true;
+        finished_cv_.notify_all();
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef FILE_LOADER_HPP_
+#define FILE_LOADER_HPP_
+
+#include "mapped_file.hpp"
+#include "piece_table.hpp"
+
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+
+// Loads file on a pool of background threads.
+// File is cut into chunks at line boundaries; every chunk is parsed into lines by
+// the `parse` callback on one of the workers, and parsed chunks are handed over to
+// the owner in the file order. First chunks are small, so the beginning of the file
+// is available almost at once, following ones grow to keep the number of chunks
+// (and pieces of text) low while there is still enough of them for all workers.
+//
+// Gzip compressed files are decompressed as a stream on one more thread, which cuts
+// the decompressed text into chunks as it goes, so the first lines are parsed and shown
+// long before the whole file is decompressed.
+class FileLoader {
+public:
+    // `worker` is the index of the thread which calls the callback
+    typedef std::function<content_t(const char* start, const char* stop, size_t worker)> parse_t;
+
+    explicit FileLoader(const std::string& filepath, size_t threads, parse_t parse);
+    ~FileLoader();
+
+    explicit FileLoader(const FileLoader&) = delete;
+    void operator=(const FileLoader&) = delete;
+
+    bool is_open() const { return file_.is_open(); }
+
+    // Stops the workers, chunks parsed before are still available
+    void cancel();
+    bool cancelled() const { return cancelled_.load(); }
+
+    // Workers have finished: whole file is parsed or loading was cancelled
+    bool finished() const { return finished_.load(); }
+    void wait();
+
+    // All chunks of the file were taken
+    bool done();
+
+    size_t threads() const { return workers_.size(); }
+    bool compressed() const { return compressed_; }
+    // bytes of the file on the disk, compressed ones for gzip files
+    size_t total_bytes() const { return file_.size(); }
+    size_t loaded_bytes() const { return loaded_bytes_.load(); }
+
+    // Moves parsed chunks to `chunks` in the file order and their byte offsets in the
+    // (decompressed) text to `offsets`, returns false if there were none
+    bool take(std::vector<content_t>& chunks, std::vector<size_t>& offsets);
+
+    static bool is_gzip(const std::string& filepath);
+
+    static constexpr size_t FIRST_CHUNK_SIZE = 64 * 1024;
+    static constexpr size_t MAX_CHUNK_SIZE = 4 * 1024 * 1024;
+    // decompressed chunks waiting for the workers, decompression stops until they are taken
+    static constexpr size_t MAX_WAITING_CHUNKS = 8;
+
+private:
+    struct Chunk {
+        const char* start;
+        const char* stop;
+        std::vector<char> data;     // decompressed text, chunks of plain files point into the file
+        size_t offset;              // position of the chunk in the text
+        size_t file_bytes;          // bytes of the file on the disk the chunk is made of
+        content_t lines;
+        bool ready;
+    };
+
+    void _split();
+    void _inflate();
+    void _add_chunk(Chunk&& chunk);
+    void _run(size_t worker);
+
+private:
+    MappedFile file_;
+    parse_t parse_;
+    bool compressed_;
+
+    std::mutex mutex_;
+    std::condition_variable finished_cv_;
+    std::condition_variable added_cv_;      // chunk was added or all chunks were added
+    std::condition_variable claimed_cv_;    // chunk was claimed by a worker
+    // references to chunks stay valid while new ones are added
+    std::deque<Chunk> chunks_;
+    bool split_;                // all chunks were added
+    size_t taken_;              // chunks before this one were handed over
+    size_t next_;               // next chunk to parse
+
+    std::atomic<bool> cancelled_;
+    std::atomic<bool> finished_;
+    std::atomic<size_t> loaded_bytes_;
+    size_t running_;            // number of workers still running
+
+    std::vector<std::thread> workers_;
+    std::thread inflater_;
+};
+
+#endif // FILE_LOADER_HPP_
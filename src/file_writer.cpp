@@ -0,0 +1,263 @@
+#include "file_writer.hpp"
+
+#include "logger.hpp"
+
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+
+
+FileWriter::FileWriter(const std::string& filepath, Compression compression)
+    : path_(_resolve(filepath)), fd_(-1), failed_(false), committed_(false), mode_(0644),
+      offset_(0), flushed_(0), blocks_(MAX_BLOCKS), block_(0), pos_(nullptr), end_(nullptr)
+{
+    // new file gets permissions of the file it replaces
+    struct stat st;
+    bool exists = (::stat(path_.c_str(), &st) == 0);
+    if (exists) {
+        mode_ = st.st_mode & 07777;
+    }
+
+    // temporary file has to be on the same file system for rename() to be atomic
+    std::vector<char> temp(path_.begin(), path_.end());
+    const char* suffix = ".XXXXXX";
+    temp.insert(temp.end(), suffix, suffix + std::strlen(suffix) + 1);
+    fd_ = ::mkstemp(temp.data());
+    if (fd_ < 0) {
+        Logger::instance().error("FileWriter: cannot create temporary file for " + path_ + ": " + std::strerror(errno));
+        return;
+    }
+    temp_path_ = temp.data();
+    if ( !exists ) {
+        mode_t mask = ::umask(0);
+        ::umask(mask);
+        mode_ = 0666 & ~mask;
+    }
+    ::fchmod(fd_, mode_);
+    _init_blocks();
+
+    if (compression == Compression::GZIP) {
+        deflater_.reset(new z_stream());
+        // 16 makes zlib write the gzip header and trailer
+        if (deflateInit2(deflater_.get(), Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            deflater_.reset();
+            _fail("compress");
+            return;
+        }
+        compressed_.resize(BLOCK_SIZE);
+    }
+}
+
+FileWriter::FileWriter(const std::string& filepath, uint64_t offset)
+    : path_(_resolve(filepath)), fd_(-1), failed_(false), committed_(false), mode_(0),
+      offset_(offset), flushed_(0), blocks_(MAX_BLOCKS), block_(0), pos_(nullptr), end_(nullptr)
+{
+    fd_ = ::open(path_.c_str(), O_WRONLY);
+    if ((fd_ < 0) || (::lseek(fd_, offset_, SEEK_SET) < 0)) {
+        Logger::instance().error("FileWriter: cannot open " + path_ + ": " + std::strerror(errno));
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+        return;
+    }
+    _init_blocks();
+}
+
+FileWriter::~FileWriter() {
+    if (deflater_) {
+        deflateEnd(deflater_.get());
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+    if ( !committed_ && !temp_path_.empty() ) {
+        ::unlink(temp_path_.c_str());
+    }
+}
+
+bool FileWriter::commit() {
+    if ( !is_open() ) {
+        return false;
+    }
+
+    _flush();
+    if (deflater_) {
+        _deflate(nullptr, 0, true);
+    }
+    // file rewritten in place may become shorter
+    if ( !failed_ && in_place() && (::ftruncate(fd_, offset_ + flushed_) != 0) ) {
+        _fail("truncate");
+    }
+    if ( !failed_ && (::fsync(fd_) != 0) ) {
+        _fail("sync");
+    }
+    if ( (::close(fd_) != 0) && !failed_ ) {
+        _fail("close");
+    }
+    fd_ = -1;
+    if (failed_) {
+        return false;
+    }
+    if (in_place()) {
+        committed_ = true;
+        return true;
+    }
+
+    if (::rename(temp_path_.c_str(), path_.c_str()) != 0) {
+        _fail("rename");
+        return false;
+    }
+    committed_ = true;
+
+    // rename itself is persistent only when the directory is synced
+    std::string dir = path_.substr(0, path_.find_last_of('/') + 1);
+    int dir_fd = ::open(dir.empty()? ".": dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        ::fsync(dir_fd);
+        ::close(dir_fd);
+    }
+    return true;
+}
+
+size_t FileWriter::written() const {
+    // blocks before the current one are always full
+    return flushed_ + block_ * BLOCK_SIZE + (pos_ - blocks_[block_].data());
+}
+
+std::string FileWriter::_resolve(const std::string& filepath) {
+    // saving through a symlink replaces the file it points to, not the link
+    char resolved[PATH_MAX];
+    if (::realpath(filepath.c_str(), resolved)) {
+        return resolved;
+    }
+    return filepath;
+}
+
+void FileWriter::create_dirs(const std::string& dir) {
+    for (size_t pos = dir.find('/', 1); ; pos = dir.find('/', pos + 1)) {
+        ::mkdir(dir.substr(0, pos).c_str(), 0700);
+        if (pos == std::string::npos) {
+            break;
+        }
+    }
+}
+
+void FileWriter::_init_blocks() {
+    blocks_[0].resize(BLOCK_SIZE);
+    pos_ = blocks_[0].data();
+    end_ = pos_ + BLOCK_SIZE;
+}
+
+void FileWriter::_next_block() {
+    if (block_ + 1 == MAX_BLOCKS) {
+        _flush();
+        return;
+    }
+
+    block_++;
+    blocks_[block_].resize(BLOCK_SIZE);
+    pos_ = blocks_[block_].data();
+    end_ = pos_ + BLOCK_SIZE;
+}
+
+void FileWriter::_write_slow(const char* data, size_t size) {
+    while (size) {
+        if (pos_ == end_) {
+            _next_block();
+        }
+        size_t n = std::min(size, static_cast<size_t>(end_ - pos_));
+        std::memcpy(pos_, data, n);
+        pos_ += n;
+        data += n;
+        size -= n;
+    }
+}
+
+// Writes all filled blocks and the filled part of the current one, then starts from the first block again
+void FileWriter::_flush() {
+    struct iovec iov[MAX_BLOCKS];
+    int count = 0;
+    for (size_t i = 0; i <= block_; i++) {
+        size_t size = (i == block_)? pos_ - blocks_[i].data(): BLOCK_SIZE;
+        if (size) {
+            iov[count].iov_base = blocks_[i].data();
+            iov[count].iov_len = size;
+            count++;
+            flushed_ += size;
+        }
+    }
+    if (deflater_) {
+        _deflate(iov, count, false);
+    } else {
+        _write(iov, count);
+    }
+
+    block_ = 0;
+    pos_ = blocks_[0].data();
+    end_ = pos_ + BLOCK_SIZE;
+}
+
+void FileWriter::_write(struct iovec* iov, int count) {
+    struct iovec* next = iov;
+    while ( !failed_ && count ) {
+        ssize_t n = ::writev(fd_, next, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _fail("write");
+            break;
+        }
+
+        // partial write: skip the written part and retry with the rest
+        size_t left = static_cast<size_t>(n);
+        while (count && (left >= next->iov_len)) {
+            left -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count) {
+            next->iov_base = static_cast<char*>(next->iov_base) + left;
+            next->iov_len -= left;
+        }
+    }
+}
+
+// Compresses the blocks, compressed data is written every time its buffer is filled.
+// `finish` ends the gzip stream after the blocks.
+void FileWriter::_deflate(struct iovec* iov, int count, bool finish) {
+    z_stream* stream = deflater_.get();
+    for (int i = 0; (i < count) || ((i == count) && finish); i++) {
+        bool last = (i == count);
+        stream->next_in = last? nullptr: static_cast<unsigned char*>(iov[i].iov_base);
+        stream->avail_in = last? 0: static_cast<uInt>(iov[i].iov_len);
+        // input is consumed completely once the output buffer is not filled up
+        int ret;
+        do {
+            stream->next_out = reinterpret_cast<unsigned char*>(compressed_.data());
+            stream->avail_out = static_cast<uInt>(compressed_.size());
+            ret = deflate(stream, last? Z_FINISH: Z_NO_FLUSH);
+            struct iovec out = {compressed_.data(), compressed_.size() - stream->avail_out};
+            if (out.iov_len) {
+                _write(&out, 1);
+            }
+        } while ( !failed_ && ((stream->avail_out == 0) || (last && (ret == Z_OK))) );
+        if (ret == Z_STREAM_ERROR) {
+            _fail("compress");
+        }
+    }
+}
+
+void FileWriter::_fail(const std::string& what) {
+    if ( !failed_ ) {
+        Logger::instance().error("FileWriter: cannot " + what + " " + (in_place()? path_: temp_path_) + ": " + std::strerror(errno));
+    }
+    failed_ = true;
+}
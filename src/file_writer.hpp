@@ -0,0 +1,100 @@
+#ifndef FILE_WRITER_HPP_
+#define FILE_WRITER_HPP_
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <sys/types.h>
+
+
+struct z_stream_s;
+
+
+// Writes the whole file atomically.
+// Data is written to a temporary file next to the target, which replaces the target
+// with rename() only after it is completely written and synced to the disk, so a crash
+// in the middle of saving leaves either the old or the new file, never a truncated one.
+// Writes are collected into large blocks, filled blocks go to the disk in one writev().
+//
+// Writer may also rewrite the file in place starting from `offset`, keeping the bytes
+// before it. Such rewrite is not atomic, it is used to save the changed tail of big files.
+//
+// Written data may be compressed with gzip, filled blocks are compressed as a stream
+// before they are written.
+class FileWriter {
+public:
+    enum class Compression { NONE, GZIP };
+
+    explicit FileWriter(const std::string& filepath, Compression compression = Compression::NONE);
+    explicit FileWriter(const std::string& filepath, uint64_t offset);
+    // removes the temporary file if it was not committed
+    ~FileWriter();
+
+    explicit FileWriter(const FileWriter&) = delete;
+    void operator=(const FileWriter&) = delete;
+
+    bool is_open() const { return fd_ >= 0; }
+    bool in_place() const { return temp_path_.empty(); }
+
+    void put(char c) {
+        if (pos_ == end_) {
+            _next_block();
+        }
+        *pos_++ = c;
+    }
+
+    void write(const char* data, size_t size) {
+        if (size <= static_cast<size_t>(end_ - pos_)) {
+            std::memcpy(pos_, data, size);
+            pos_ += size;
+        } else {
+            _write_slow(data, size);
+        }
+    }
+
+    // Writes buffered data, syncs the temporary file and renames it over the target,
+    // file rewritten in place is truncated after the written data and synced
+    bool commit();
+
+    // bytes passed to the writer, both written and buffered, before compression
+    size_t written() const;
+    const std::string& path() const { return path_; }
+
+    // creates missing directories of `dir` one by one, new ones are accessible only to the user
+    static void create_dirs(const std::string& dir);
+
+    static constexpr size_t BLOCK_SIZE = 1024 * 1024;
+    static constexpr size_t MAX_BLOCKS = 8;
+
+private:
+    static std::string _resolve(const std::string& filepath);
+    void _init_blocks();
+    void _next_block();
+    void _write_slow(const char* data, size_t size);
+    void _flush();
+    void _write(struct iovec* iov, int count);
+    void _deflate(struct iovec* iov, int count, bool finish);
+    void _fail(const std::string& what);
+
+private:
+    std::string path_;          // target file, symlinks are resolved
+    std::string temp_path_;     // empty when the file is rewritten in place
+    int fd_;
+    bool failed_;
+    bool committed_;
+    mode_t mode_;
+    uint64_t offset_;           // position of the first written byte in the file
+    size_t flushed_;            // bytes passed to writev()
+
+    std::vector<std::vector<char>> blocks_;
+    size_t block_;              // block being filled
+    char* pos_;
+    char* end_;
+
+    std::unique_ptr<z_stream_s> deflater_;  // null if data is written as is
+    std::vector<char> compressed_;
+};
+
+#endif // FILE_WRITER_HPP_
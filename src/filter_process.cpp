@@ -0,0 +1,191 @@
+#include "filter_process.hpp"
+
+#include "logger.hpp"
+
+#include <spawn.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <cerrno>
+#include <thread>
+
+extern char** environ;
+
+
+FilterProcess::FilterProcess(const std::string& command, parse_t parse)
+    : command_(command), parse_(parse), pid_(-1), input_fd_(-1), output_fd_(-1),
+      block_(BLOCK_SIZE), pos_(0), written_(0), broken_(false), read_(0)
+{
+    int input[2], output[2];
+    if (::pipe2(input, O_CLOEXEC) != 0) {
+        Logger::instance().error("Cannot run filter `" + command_ + "`: " + std::strerror(errno));
+        return;
+    }
+    if (::pipe2(output, O_CLOEXEC) != 0) {
+        Logger::instance().error("Cannot run filter `" + command_ + "`: " + std::strerror(errno));
+        ::close(input[0]);
+        ::close(input[1]);
+        return;
+    }
+
+    // the command gets the read end of the input and the write end of the output as stdin and stdout,
+    // dup2() clears close-on-exec of the copies only
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, input[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, output[1], STDOUT_FILENO);
+
+    const char* argv[] = {"/bin/sh", "-c", command_.c_str(), nullptr};
+    int error = ::posix_spawn(&pid_, "/bin/sh", &actions, nullptr, const_cast<char* const*>(argv), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    ::close(input[0]);
+    ::close(output[1]);
+    if (error != 0) {
+        Logger::instance().error("Cannot run filter `" + command_ + "`: " + std::strerror(error));
+        pid_ = -1;
+        ::close(input[1]);
+        ::close(output[0]);
+        return;
+    }
+    input_fd_ = input[1];
+    output_fd_ = output[0];
+}
+
+FilterProcess::~FilterProcess() {
+    _close(input_fd_);
+    _close(output_fd_);
+    if (pid_ > 0) {
+        _wait();
+    }
+}
+
+bool FilterProcess::run(feed_t feed, std::vector<content_t>& output) {
+    if ( !is_open() ) {
+        return false;
+    }
+
+    std::thread feeder(&FilterProcess::_feed, this, feed);
+    bool success = _read(output);
+    if ( !success ) {
+        // the command may still wait for the rest of its input
+        ::kill(pid_, SIGTERM);
+    }
+    _close(output_fd_);
+    feeder.join();
+    return _wait() && success;
+}
+
+void FilterProcess::_feed(feed_t feed) {
+    // writing to a command which has exited raises SIGPIPE, the thread takes EPIPE instead
+    sigset_t pipe_signal;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, nullptr);
+
+    feed(*this);
+    _flush();
+    // end of the input for the command
+    _close(input_fd_);
+
+    if (broken_) {
+        // SIGPIPE of the failed write is pending for this thread, it is consumed before the thread exits
+        struct timespec no_wait = {0, 0};
+        ::sigtimedwait(&pipe_signal, nullptr, &no_wait);
+    }
+}
+
+void FilterProcess::_flush() {
+    _write(block_.data(), pos_);
+    pos_ = 0;
+}
+
+void FilterProcess::_write(const char* data, size_t size) {
+    while ((size > 0) && !broken_) {
+        ssize_t n = ::write(input_fd_, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EPIPE) {
+                Logger::instance().error("Cannot write to filter `" + command_ + "`: " + std::strerror(errno));
+            }
+            broken_ = true;
+            return;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+        written_ += static_cast<size_t>(n);
+    }
+}
+
+// Output is parsed once a block of it is collected, the line being written is kept for the next block
+bool FilterProcess::_read(std::vector<content_t>& output) {
+    std::vector<char> buf(READ_SIZE);
+    std::vector<char> tail;
+    while (true) {
+        ssize_t n = ::read(output_fd_, buf.data(), buf.size());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Logger::instance().error("Cannot read output of filter `" + command_ + "`: " + std::strerror(errno));
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        read_ += static_cast<size_t>(n);
+        tail.insert(tail.end(), buf.data(), buf.data() + n);
+        if (tail.size() < READ_SIZE) {
+            continue;
+        }
+
+        const char* start = tail.data();
+        const char* eol = static_cast<const char*>(::memrchr(start, '\n', tail.size()));
+        if (eol) {
+            output.push_back(parse_(start, eol));
+            tail.erase(tail.begin(), tail.begin() + (eol - start) + 1);
+        }
+    }
+
+    if ( !tail.empty() ) {
+        const char* stop = tail.data() + tail.size();
+        // newline at the end does not start a new line
+        if (*(stop - 1) == '\n') {
+            stop--;
+        }
+        output.push_back(parse_(tail.data(), stop));
+    }
+    return true;
+}
+
+bool FilterProcess::_wait() {
+    int status = 0;
+    while (::waitpid(pid_, &status, 0) < 0) {
+        if (errno != EINTR) {
+            Logger::instance().error("Cannot wait for filter `" + command_ + "`: " + std::strerror(errno));
+            pid_ = -1;
+            return false;
+        }
+    }
+    pid_ = -1;
+
+    if (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) {
+        return true;
+    }
+    if (WIFEXITED(status)) {
+        Logger::instance().error("Filter `" + command_ + "` exited with status " + std::to_string(WEXITSTATUS(status)));
+    } else {
+        Logger::instance().error("Filter `" + command_ + "` was killed by signal " + std::to_string(WTERMSIG(status)));
+    }
+    return false;
+}
+
+void FilterProcess::_close(int& fd) {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef FILTER_PROCESS_HPP_
+#define FILTER_PROCESS_HPP_
+
+#include "piece_table.hpp"
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <functional>
+#include <sys/types.h>
+
+
+// Pipes text through an external command, like `sort` or `jq .`, run by /bin/sh.
+// Input is written to the command by the `feed` callback on a separate thread while the
+// output is read on the calling thread, so neither pipe fills up and blocks the other side.
+// Both sides stream: input is encoded block by block and output is parsed chunk by chunk by
+// the `parse` callback, the whole text never exists as one string.
+class FilterProcess {
+public:
+    typedef std::function<content_t(const char* start, const char* stop)> parse_t;
+    typedef std::function<void(FilterProcess& input)> feed_t;
+
+    explicit FilterProcess(const std::string& command, parse_t parse);
+    // the command is waited for if it was not run
+    ~FilterProcess();
+
+    explicit FilterProcess(const FilterProcess&) = delete;
+    void operator=(const FilterProcess&) = delete;
+
+    bool is_open() const { return pid_ > 0; }
+
+    // Writes the input with `feed` and collects the output lines, one content_t per read block.
+    // A newline at the end of the output does not start a new line.
+    // Returns false if the command failed, `output` is incomplete then.
+    bool run(feed_t feed, std::vector<content_t>& output);
+
+    // input side, used by `feed`: writes are buffered and fail silently once the command
+    // stops reading, e.g. `head` exits before the whole input is written
+    void put(char c) {
+        if (pos_ == block_.size()) {
+            _flush();
+        }
+        block_[pos_++] = c;
+    }
+
+    void write(const char* data, size_t size) {
+        if (size > block_.size() - pos_) {
+            _flush();
+        }
+        if (size > block_.size()) {
+            _write(data, size);
+        } else {
+            std::memcpy(block_.data() + pos_, data, size);
+            pos_ += size;
+        }
+    }
+
+    size_t written() const { return written_; }
+    size_t read() const { return read_; }
+
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+    static constexpr size_t READ_SIZE = 1024 * 1024;
+
+private:
+    void _feed(feed_t feed);
+    void _flush();
+    void _write(const char* data, size_t size);
+    bool _read(std::vector<content_t>& output);
+    bool _wait();
+    static void _close(int& fd);
+
+private:
+    std::string command_;
+    parse_t parse_;
+
+    pid_t pid_;
+    int input_fd_;          // stdin of the command
+    int output_fd_;         // stdout of the command
+
+    // used only by the feeding thread
+    std::vector<char> block_;
+    size_t pos_;
+    size_t written_;
+    bool broken_;           // command closed its input
+
+    size_t read_;
+};
+
+#endif // FILTER_PROCESS_HPP_
@@ -1,29 +1,246 @@
 #include "glyph.hpp"
 
+#include "utf8.hpp"
+#include "logger.hpp"
 #include "settings.hpp"
 
+#include <map>
+#include <mutex>
+#include <deque>
+#include <atomic>
 #include <ostream>
-#include <unordered_set>
 
 
-Glyph::Glyph() {
-    set_color(Settings::const_instance().const_colors().text);
+namespace {
+
+// Append-only table of values indexed by 21-bit glyph values. Values are read without
+// locking, so they are never moved or removed; setting a value needs an external lock.
+template <typename T>
+class GlyphSlots {
+public:
+    GlyphSlots() {
+        for (auto& chunk: chunks_) {
+            chunk.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~GlyphSlots() {
+        for (auto& chunk: chunks_) {
+            delete[] chunk.load(std::memory_order_relaxed);
+        }
+    }
+
+    const T* get(uint32_t index) const {
+        const slot_t* chunk = chunks_[index >> CHUNK_BITS].load(std::memory_order_acquire);
+        return chunk? chunk[index & CHUNK_MASK].load(std::memory_order_acquire): nullptr;
+    }
+
+    const T& set(uint32_t index, T&& value) {
+        std::atomic<slot_t*>& chunk = chunks_[index >> CHUNK_BITS];
+        slot_t* slots = chunk.load(std::memory_order_relaxed);
+        if (!slots) {
+            slots = new slot_t[CHUNK_SIZE]();
+            chunk.store(slots, std::memory_order_release);
+        }
+        values_.push_back(std::move(value));
+        slots[index & CHUNK_MASK].store(&values_.back(), std::memory_order_release);
+        return values_.back();
+    }
+
+private:
+    typedef std::atomic<const T*> slot_t;
+
+    static constexpr uint32_t INDEX_LIMIT = 0x00200000;
+    static constexpr uint32_t CHUNK_BITS = 10;
+    static constexpr uint32_t CHUNK_SIZE = 1 << CHUNK_BITS;
+    static constexpr uint32_t CHUNK_MASK = CHUNK_SIZE - 1;
+
+    std::atomic<slot_t*> chunks_[INDEX_LIMIT / CHUNK_SIZE];
+    std::deque<T> values_;
+};
+
+// Shared storage for text and colors of all glyphs.
+// Glyphs keep only indices into this table, so they stay 4 bytes long.
+// Like the palette, text tables are only appended to, so glyph text is read without
+// locking and the mutex is taken only to add new entries.
+class GlyphTable {
+public:
+    static GlyphTable& instance() {
+        static GlyphTable table;
+        return table;
+    }
+
+    const std::string& codepoint_text(uint32_t codepoint) {
+        if (codepoint < ASCII_SIZE) {
+            return ascii_[codepoint];
+        }
+        const std::string* text = codepoints_.get(codepoint);
+        if (text) {
+            return *text;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        text = codepoints_.get(codepoint);
+        if (text) {
+            return *text;
+        }
+        char buf[4];
+        return codepoints_.set(codepoint, std::string(buf, encode_utf8(codepoint, buf)));
+    }
+
+    uint32_t intern_special(const std::string& real, const std::string& visible) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto key = std::make_pair(real, visible);
+        auto it = special_index_.find(key);
+        if (it != special_index_.end()) {
+            return it->second;
+        }
+        uint32_t index = static_cast<uint32_t>(special_index_.size());
+        specials_.set(index, special_t(key));
+        special_index_[key] = index;
+        return index;
+    }
+
+    const std::string& special_real(uint32_t index) const {
+        return specials_.get(index)->first;
+    }
+
+    const std::string& special_visible(uint32_t index) const {
+        return specials_.get(index)->second;
+    }
+
+    uint32_t intern_color(uint32_t color) {
+        uint32_t size = palette_size_.load(std::memory_order_acquire);
+        for (uint32_t i = 1; i < size; i++) {
+            if (palette_[i].load(std::memory_order_relaxed) == color) {
+                return i;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        size = palette_size_.load(std::memory_order_relaxed);
+        for (uint32_t i = 1; i < size; i++) {
+            if (palette_[i].load(std::memory_order_relaxed) == color) {
+                return i;
+            }
+        }
+        if (size == PALETTE_SIZE) {
+            Logger::instance().warning("Glyph color palette is full, default color is used");
+            return 0;
+        }
+        palette_[size].store(color, std::memory_order_relaxed);
+        palette_size_.store(size + 1, std::memory_order_release);
+        return size;
+    }
+
+    uint32_t color(uint32_t index) const {
+        if (index == 0) {
+            return Settings::const_instance().const_colors().text;
+        }
+        return palette_[index].load(std::memory_order_relaxed);
+    }
+
+private:
+    GlyphTable() : palette_size_(1) {
+        // codepoint 0 is used by empty glyph
+        for (uint32_t c = 1; c < ASCII_SIZE; c++) {
+            ascii_[c] = std::string(1, static_cast<char>(c));
+        }
+        palette_[0].store(0);
+    }
+
+    static constexpr uint32_t ASCII_SIZE = 128;
+    static constexpr uint32_t PALETTE_SIZE = 256;
+
+    std::mutex mutex_;
+
+    std::string ascii_[ASCII_SIZE];
+    GlyphSlots<std::string> codepoints_;
+
+    typedef std::pair<std::string, std::string> special_t;
+    GlyphSlots<special_t> specials_;
+    std::map<special_t, uint32_t> special_index_;
+
+    std::atomic<uint32_t> palette_[PALETTE_SIZE];
+    std::atomic<uint32_t> palette_size_;
+};
+
+// Decodes UTF-8 sequence consisting of exactly one codepoint.
+// Returns false if `text` is not such a sequence.
+bool decode_single_codepoint(const std::string& text, uint32_t& codepoint) {
+    size_t n = text.size();
+    if (n == 0) {
+        codepoint = 0;
+        return true;
+    }
+
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(text.data());
+    size_t len;
+    if (s[0] < 0x80) {
+        codepoint = s[0];
+        len = 1;
+    } else if ((s[0] & 0xE0) == 0xC0) {
+        codepoint = s[0] & 0x1F;
+        len = 2;
+    } else if ((s[0] & 0xF0) == 0xE0) {
+        codepoint = s[0] & 0x0F;
+        len = 3;
+    } else if ((s[0] & 0xF8) == 0xF0) {
+        codepoint = s[0] & 0x07;
+        len = 4;
+    } else {
+        return false;
+    }
+
+    if (n != len) {
+        return false;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            return false;
+        }
+        codepoint = (codepoint << 6) | (s[i] & 0x3F);
+    }
+    return (codepoint != 0) && (codepoint <= 0x10FFFF);
 }
 
-Glyph::Glyph(const char* real_text, const char* visible_text) : Glyph() {
-    real_ch_ = std::string(real_text);
+} // namespace
+
 
-    if (visible_text)
-        visible_ch_ = std::string(visible_text);
-    else
-        visible_ch_ = real_ch_;
+Glyph::Glyph(const char* real_text, const char* visible_text) : code_(0) {
+    std::string real(real_text);
+
+    uint32_t codepoint;
+    bool plain = decode_single_codepoint(real, codepoint);
+    if (plain && (!visible_text || real == visible_text)) {
+        code_ = codepoint;
+    } else {
+        std::string visible = visible_text? std::string(visible_text): real;
+        code_ = SPECIAL_FLAG | GlyphTable::instance().intern_special(real, visible);
+    }
+}
+
+const std::string& Glyph::real() const {
+    if (special()) {
+        return GlyphTable::instance().special_real(code_ & VALUE_MASK);
+    }
+    return GlyphTable::instance().codepoint_text(code_ & VALUE_MASK);
+}
+
+const std::string& Glyph::visible() const {
+    if (special()) {
+        return GlyphTable::instance().special_visible(code_ & VALUE_MASK);
+    }
+    return GlyphTable::instance().codepoint_text(code_ & VALUE_MASK);
+}
+
+void Glyph::set_color(uint32_t color) {
+    uint32_t index = GlyphTable::instance().intern_color(color);
+    code_ = (code_ & CODE_MASK) | (index << COLOR_SHIFT);
 }
 
-Glyph& Glyph::operator=(const Glyph& g) {
-    real_ch_ = g.real();
-    visible_ch_ = g.visible();
-    color_ = g.color();
-    return *this;
+uint32_t Glyph::color() const {
+    return GlyphTable::instance().color(code_ >> COLOR_SHIFT);
 }
 
 
@@ -33,14 +250,17 @@ std::ostream& operator<<(std::ostream& out, const Glyph& g) {
 
 
 bool is_word_delimiter(const Glyph& g) {
-    static const std::unordered_set<char> word_delims = {
-        ' ', '\t', '\n', '(', ')', '[', ']', '<', '>',
-        '"', '\'', '.', ',', ':', ';', '!', '?',
-        '@', '$', '%', '^', '&', '_', '|', '\\', '/', '`', '~',  '#',
-        '*', '-', '+', '='
-    };
-    const char* cstr = g.real().c_str();
-    return (word_delims.count(*cstr) > 0);
+    static const std::string word_delims = " \t\n()[]<>\"'.,:;!?@$%^&_|\\/`~#*-+=";
+    static const std::vector<bool> is_delim = [] {
+        std::vector<bool> table(128, false);
+        for (char c: word_delims) {
+            table[static_cast<unsigned char>(c)] = true;
+        }
+        return table;
+    }();
+
+    uint32_t c = g.special()? static_cast<unsigned char>(g.real()[0]): g.code();
+    return (c < is_delim.size()) && is_delim[c];
 }
 
 bool is_not_word_delimiter(const Glyph& g) {
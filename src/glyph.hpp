@@ -5,33 +5,50 @@
 
 #include <string>
 #include <vector>
+#include <cstdint>
 #include <functional>
 #include <unordered_map>
 
 
+// Glyph is packed into a single 32-bit code:
+//   bits  0..20 - unicode codepoint, or index in the glyph table for special glyphs
+//   bit  21     - special glyph flag (visible text differs from real text)
+//   bits 24..31 - index in the color palette, 0 stands for default text color
+// Text of glyphs and colors are interned in tables shared by all glyphs.
 class Glyph {
 public:
     explicit Glyph(const char* real_text, const char* visible_text);
-    explicit Glyph();
+    explicit Glyph() : code_(0) {}
 
-    Glyph& operator=(const Glyph& other);
-    ~Glyph() {}
+    static Glyph from_codepoint(uint32_t codepoint) { return Glyph(codepoint & VALUE_MASK); }
 
-    const std::string& real() const { return real_ch_; }
-    const std::string& visible() const { return visible_ch_; }
+    const std::string& real() const;
+    const std::string& visible() const;
 
-    void set_color(uint32_t color) { color_ = color; }
-    const uint32_t& color() const { return color_; }
+    void set_color(uint32_t color);
+    uint32_t color() const;
+
+    // identity of the glyph: codepoint or special glyph index, color is not included
+    uint32_t code() const { return code_ & CODE_MASK; }
+    bool special() const { return (code_ & SPECIAL_FLAG) != 0; }
+
+    bool operator==(const Glyph& glyph) const { return code() == glyph.code(); }
+    bool operator!=(const Glyph& glyph) const { return code() != glyph.code(); }
 
-    bool operator==(const Glyph& glyph) const { return real_ch_ == glyph.real(); }
 private:
-    std::string real_ch_;
+    explicit Glyph(uint32_t code) : code_(code) {}
 
-    std::string visible_ch_;
+    static constexpr uint32_t VALUE_MASK = 0x001FFFFF;
+    static constexpr uint32_t SPECIAL_FLAG = 0x00200000;
+    static constexpr uint32_t CODE_MASK = VALUE_MASK | SPECIAL_FLAG;
+    static constexpr uint32_t COLOR_SHIFT = 24;
 
-    uint32_t color_;
+private:
+    uint32_t code_;
 };
 
+static_assert(sizeof(Glyph) == 4, "Glyph should fit into 4 bytes");
+
 std::ostream& operator<<(std::ostream& out, const Glyph& g);
 
 bool is_word_delimiter(const Glyph& g);
@@ -45,7 +62,7 @@ namespace std {
     {
         std::size_t operator()(const Glyph& k) const
         {
-            return std::hash<std::string>()(k.real());
+            return std::hash<uint32_t>()(k.code());
         }
     };
 } // namespace std
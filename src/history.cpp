@@ -1,234 +1,962 @@
 #include "history.hpp"
 
 #include "logger.hpp"
+#include "settings.hpp"
 #include "document.hpp"
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <ctime>
+#include <chrono>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <sstream>
+#include <algorithm>
 
 
-// TODO: save full selection info in history item
-HistoryItem::HistoryItem(const Vec2i& pos, const Text& text, const Vec2i& cursor, SelectionShape shape)
-    : pos_(pos), text_(text), selection_shape_(shape), cursor_pos_(cursor)
-{
-    time_ = SDL_GetTicks();
+static uint32_t now_ms() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+}
+
+static int64_t epoch_ms() {
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    return static_cast<int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
 }
 
+
 History::History()
-    : null_(nullptr)
+    : first_(0), first_id_(0), count_(0), alive_(0), root_(EditKind::ADD_NEWLINE, Vec2i(0, 0), Vec2i(0, 0)),
+      root_id_(HistoryItem::NONE), current_(ROOT), bytes_(0), scan_(0), spill_fd_(-1), spill_end_(0), spilled_(0),
+      replayed_(false), replaying_(false), logged_(HistoryStore::NO_ITEM), version_({0, 0, 0}), saved_(ROOT)
 {
-    items_list_.push_back(pItem_t(new HeadItem()));
-    list_cur_ = items_list_.begin();
+    const HistorySettings& settings = Settings::const_instance().const_history();
+    max_items_ = static_cast<size_t>(std::max(settings.max_items, 1));
+    budget_ = settings.memory_budget;
+    spill_dir_ = settings.spill_dir;
+    store_days_ = settings.store_days;
 }
 
 History::~History() {
+    close_store();
+    if (spill_fd_ >= 0) {
+        ::close(spill_fd_);
+    }
+}
+
+void History::set_spill(encode_t encode, decode_t decode) {
+    encode_ = encode;
+    decode_ = decode;
+}
+
+void History::open_store(const std::string& path, const HistoryStore::Version& version) {
+    close_store();
+    clear();
+    store_.reset(new HistoryStore(path));
+    if (store_->failed()) {
+        store_.reset();
+        return;
+    }
+    version_ = version;
+    saved_ = ROOT;
+}
+
+void History::mark_saved(const HistoryStore::Version& version) {
+    if ( !store_ ) {
+        return;
+    }
+    _replay();
+    // edits after the save start a new item, so the saved state stays between two items
+    _seal_newest();
+    _log_move();
+    version_ = version;
+    saved_ = current_;
+    // without items the store is not needed yet, the version is written when it is created
+    if (store_->exists()) {
+        store_->append(HistoryStore::Type::SAVED, reinterpret_cast<const char*>(&version_), sizeof(version_));
+    }
+}
+
+void History::close_store() {
+    if ( !store_ ) {
+        return;
+    }
+    // store which was not used is left as it is
+    if (replayed_) {
+        _seal_newest();
+        _log_move();
+        if ( store_->failed() || (saved_ == HistoryItem::NONE) ) {
+            // history cannot be restored on the saved file anymore
+            store_->remove();
+        } else if (store_->exists()) {
+            _compact();
+            std::string path = store_->path();
+            HistoryStore::prune(path.substr(0, path.find_last_of('/')), store_days_);
+        }
+    }
+    // items of the store cannot be read back without it
+    clear();
+    store_.reset();
+    replayed_ = false;
 }
 
 void History::clear() {
-    items_list_.resize(1);
-    list_cur_ = items_list_.begin();
+    for (uint64_t id = first_id_; id - first_id_ < count_; id++) {
+        _release(_node(id));
+    }
+    first_ = 0;
+    first_id_ = 0;
+    count_ = 0;
+    alive_ = 0;
+    root_.first_child = HistoryItem::NONE;
+    root_.redo_child = HistoryItem::NONE;
+    root_.depth = 0;
+    root_id_ = HistoryItem::NONE;
+    current_ = ROOT;
+    saved_ = ROOT;
+    scan_ = 0;
+    logged_ = HistoryStore::NO_ITEM;
 }
 
-void History::push_back(HistoryItem* item) {
-    if (list_cur_ == items_list_.begin()) {
-        clear();
-    } else {
-        if (list_cur_ != items_list_.end()) {
-            items_list_.erase(std::next(list_cur_), items_list_.end());
+void History::push_back(HistoryItem&& item, bool squash) {
+    _replay();
+    item.time = now_ms();
+    if ( squash && _squash(item.kind, item.pos, item.text, item.time, item.joined) ) {
+        return;
+    }
+    _push(std::move(item));
+}
+
+void History::push_text(EditKind kind, const Vec2i& pos, const Text& text, const Vec2i& cursor, SelectionShape shape) {
+    _replay();
+    uint32_t time = now_ms();
+    if (_squash(kind, pos, text, time, false)) {
+        return;
+    }
+    HistoryItem item(kind, pos, text, cursor, shape);
+    item.time = time;
+    _push(std::move(item));
+}
+
+const HistoryItem* History::next_item() {
+    _replay();
+    uint64_t child = _node(current_).redo_child;
+    return (child != HistoryItem::NONE)? _load(child): nullptr;
+}
+
+// Items of a group are read before any of them is applied, so a text which cannot be read back
+// never leaves the document in the middle of the group
+bool History::load_undo_group() {
+    _replay();
+    for (uint64_t id = current_; id != ROOT; id = _node(id).parent) {
+        if ( !_load(id, false) ) {
+            return false;
+        }
+        if ( !_node(id).joined ) {
+            break;
+        }
+    }
+    return true;
+}
+
+bool History::load_redo_group() {
+    _replay();
+    for (uint64_t id = _node(current_).redo_child; id != HistoryItem::NONE; id = _node(id).redo_child) {
+        if ( !_load(id, false) ) {
+            return false;
+        }
+        uint64_t next = _node(id).redo_child;
+        if ( (next == HistoryItem::NONE) || !_node(next).joined ) {
+            break;
         }
     }
+    return true;
+}
 
-    // if history is full of states - remove first element after head
-    if (items_list_.size() == (max_size_ + 1)) {
-        items_list_.erase(std::next(items_list_.begin()));
+void History::dec() {
+    if (current_ == ROOT) {
+        return;
     }
+    _seal_newest();
+    current_ = _node(current_).parent;
+}
 
-    if (!_squash(item)) {
-        items_list_.emplace_back(item);
+void History::inc() {
+    uint64_t child = _node(current_).redo_child;
+    if (child != HistoryItem::NONE) {
+        current_ = child;
     }
-    list_cur_ = std::prev(items_list_.end());
 }
 
-const pItem_t& History::current_item() {
-    if ( (list_cur_ == items_list_.begin()) || (list_cur_ == items_list_.end())) {
-        return null_;
+void History::choose(uint64_t child) {
+    if ( _alive(child) && (child != ROOT) && (_node(child).parent == current_) ) {
+        _node(current_).redo_child = child;
     }
-    return *list_cur_;
 }
 
-const pItem_t& History::next_item() {
-    if ( (items_list_.size() == 1) || (list_cur_ == std::prev(items_list_.end()))) {
-        return null_;
+// Children are linked from the newest one, so branches are switched from newer to older ones
+bool History::switch_branch() {
+    _replay();
+    HistoryItem& node = _node(current_);
+    if ( (node.first_child == HistoryItem::NONE) || (_node(node.first_child).next_sibling == HistoryItem::NONE) ) {
+        return false;
     }
-    return *std::next(list_cur_);
+    uint64_t next = _node(node.redo_child).next_sibling;
+    node.redo_child = (next != HistoryItem::NONE)? next: node.first_child;
+
+    char made[32];
+    std::time_t seconds = static_cast<std::time_t>(_node(node.redo_child).created / 1000);
+    std::strftime(made, sizeof(made), "%Y-%m-%d %H:%M:%S", std::localtime(&seconds));
+    Logger::instance().info(std::string("History: redo goes to the branch made at ") + made);
+    return true;
+}
+
+bool History::path_to(uint64_t target, size_t& undos, std::vector<uint64_t>& redos) {
+    _replay();
+    undos = 0;
+    redos.clear();
+    if ( !_alive(target) ) {
+        return false;
+    }
+    // state in the middle of joined items is passed through
+    for (uint64_t child = _node(target).first_child; (child != HistoryItem::NONE) && _node(child).joined; child = _node(child).first_child) {
+        target = child;
+    }
+
+    uint64_t from = current_;
+    while (_node(from).depth > _node(target).depth) {
+        from = _node(from).parent;
+        undos++;
+    }
+    while (_node(target).depth > _node(from).depth) {
+        redos.push_back(target);
+        target = _node(target).parent;
+    }
+    while (from != target) {
+        from = _node(from).parent;
+        undos++;
+        redos.push_back(target);
+        target = _node(target).parent;
+    }
+    return true;
+}
+
+uint64_t History::earlier() {
+    _replay();
+    if (current_ == ROOT) {
+        return HistoryItem::NONE;
+    }
+    for (uint64_t id = current_; id > first_id_; ) {
+        id--;
+        if ( _alive(id) && !_in_group(id) ) {
+            return id;
+        }
+    }
+    return ROOT;
+}
+
+uint64_t History::later() {
+    _replay();
+    for (uint64_t id = (current_ == ROOT)? first_id_: current_ + 1; id - first_id_ < count_; id++) {
+        if ( _alive(id) && !_in_group(id) ) {
+            return id;
+        }
+    }
+    return HistoryItem::NONE;
 }
 
 void History::log_items() {
+    _replay();
     std::stringstream builder;
-    builder << "Doc history:" << std::endl;
-    size_t i = 0;
-    for (auto it=items_list_.begin(); it != items_list_.end(); ++it, i++) {
-        const pItem_t& item = *it;
-        if (it == list_cur_) {
-            builder << " -> ";
-        } else {
-            builder << "    ";
+    builder << "Doc history: " << alive_ << " items, " << bytes_ << " bytes of texts in memory";
+    if (budget_ >= 0) {
+        builder << " (budget " << budget_ << ")";
+    }
+    builder << ", " << spilled_ << " bytes spilled" << std::endl;
+    builder << ((current_ == ROOT)? " -> ": "    ") << "HeadItem[]";
+    for (uint64_t id = first_id_; id - first_id_ < count_; id++) {
+        const HistoryItem& item = _node(id);
+        if ( !item.alive ) {
+            continue;
         }
-        item->log_debug(builder);
-        if (i + 1 < items_list_.size()) {
-            builder << std::endl;
+        builder << std::endl << ((id == current_)? " -> ": "    ") << id << " <- ";
+        if (item.parent == ROOT) {
+            builder << "head ";
+        } else {
+            builder << item.parent << ' ';
         }
+        item.log_debug(builder);
     }
     Logger::instance().debug(builder.str());
 }
 
-bool History::_squash(const HistoryItem* item) {
-    if (list_cur_ == items_list_.begin()) {
+// Only the newest item may be squashed, items written to the store are not changed anymore.
+// The edit is merged into the text of the item in place, so nothing is allocated for it
+// until the line of the item outgrows its capacity.
+bool History::_squash(EditKind kind, const Vec2i& pos, const Text& text, uint32_t time, bool joined) {
+    if (count_ == 0) {
         return false;
     }
-    return (*list_cur_)->squash(item);
+    HistoryItem& last = _node(_newest());
+    if ( (current_ != last.id) || (last.place != TextPlace::MEMORY) || (last.store_offset >= 0) || !last.squash(kind, pos, text, time, joined) ) {
+        return false;
+    }
+    bytes_ -= last.bytes;
+    last.bytes = _text_bytes(last.text);
+    bytes_ += last.bytes;
+    _fit_budget();
+    return true;
 }
 
+void History::_push(HistoryItem&& item) {
+    item.created = epoch_ms();
+    item.bytes = _text_bytes(item.text);
+    _seal_newest();
+    _append(std::move(item), current_);
+    _fit_budget();
+}
 
-void HistoryItem::_log_text(std::stringstream& builder) {
-    int n_lines = text_.total_lines();
-    builder << '"';
-    for (int i=0; i < n_lines; i++) {
-        for (const Glyph& g: text_.content()[i]) {
-            builder << g;
+// state after the item is in the middle of joined items
+bool History::_in_group(uint64_t id) const {
+    uint64_t child = _node(id).first_child;
+    return (child != HistoryItem::NONE) && _node(child).joined;
+}
+
+// Text of the dropped item is released at once, its slot is reused later
+void History::_release(HistoryItem& item) {
+    if (item.alive) {
+        alive_--;
+    }
+    _free_spilled(item);
+    bytes_ -= item.bytes;
+    item.bytes = 0;
+    item.text = Text(content_t());
+    item.place = TextPlace::MEMORY;
+    item.store_offset = -1;
+    item.store_size = 0;
+    item.alive = false;
+}
+
+// Drops the item with its branch, walking the subtree through the links
+void History::_kill(uint64_t top) {
+    uint64_t id = top;
+    while (true) {
+        HistoryItem& item = _node(id);
+        if (saved_ == id) {
+            saved_ = HistoryItem::NONE;
         }
-        if (i != n_lines - 1) {
-            builder << "\\n";
+        _release(item);
+        if (item.first_child != HistoryItem::NONE) {
+            id = item.first_child;
+            continue;
+        }
+        while ( (id != top) && (_node(id).next_sibling == HistoryItem::NONE) ) {
+            id = _node(id).parent;
         }
+        if (id == top) {
+            return;
+        }
+        id = _node(id).next_sibling;
     }
-    builder << '"';
 }
 
+void History::_append(HistoryItem&& item, uint64_t parent) {
+    // if history is full of states - the oldest item is dropped
+    if ( (count_ == max_items_) && !replaying_ ) {
+        _drop_first();
+        // the parent is the state before the dropped item now
+        if ( !_alive(parent) ) {
+            parent = ROOT;
+        }
+    }
 
-void AddTextItem::log_debug(std::stringstream& builder) {
-    builder << "AddText[pos=" << pos() << ", text=";
-    _log_text(builder);
-    builder << ", sel_shape=" << selection_shape_as_str(selection_shape_);
-    builder << ", c=" << cursor();
-    builder << "]";
+    uint64_t id = first_id_ + count_;
+    item.id = id;
+    item.parent = parent;
+    item.first_child = HistoryItem::NONE;
+    item.redo_child = HistoryItem::NONE;
+    item.alive = true;
+    bytes_ += item.bytes;
+    if (count_ < items_.size()) {
+        _node(id) = std::move(item);
+    } else {
+        // the ring is still growing, so it starts at 0
+        items_.push_back(std::move(item));
+    }
+    count_++;
+    alive_++;
+
+    HistoryItem& up = _node(parent);
+    HistoryItem& added = _node(id);
+    added.depth = up.depth + 1;
+    added.next_sibling = up.first_child;
+    up.first_child = id;
+    up.redo_child = id;
+    current_ = id;
 }
 
-void RemoveTextItem::log_debug(std::stringstream& builder) {
-    builder << "RemoveText[pos=" << pos() << ", text=";
-    _log_text(builder);
-    builder << ", sel_shape=" << selection_shape_as_str(selection_shape_);
-    builder << ", c=" << cursor();
-    builder << "]";
+void History::_drop_first() {
+    // items dropped with their branches only free their slots, items joined to the dropped one
+    // cannot be undone without it
+    bool dropped = false;
+    while (count_ > 0) {
+        HistoryItem& first = _node(first_id_);
+        if (first.alive) {
+            if ( dropped && !first.joined ) {
+                return;
+            }
+            _drop_root(first);
+            dropped = true;
+        }
+        first_ = (first_ + 1) % items_.size();
+        first_id_++;
+        count_--;
+    }
 }
 
-void AddNewLineItem::log_debug(std::stringstream& builder) {
-    builder << "AddNewLine[pos=" << pos();
-    builder << ", sel_shape=" << selection_shape_as_str(selection_shape_);
-    builder << ", c=" << cursor();
-    builder << "]";
-}
+// The oldest item is a child of ROOT. Redo links lead from ROOT to the current item,
+// so whether the item is applied now is told by the link of ROOT.
+void History::_drop_root(HistoryItem& item) {
+    if ( (current_ == ROOT) || (root_.redo_child != item.id) ) {
+        // the text does not depend on the item, its branch cannot be redone without the state before it
+        uint64_t* link = &root_.first_child;
+        while (*link != item.id) {
+            link = &_node(*link).next_sibling;
+        }
+        *link = item.next_sibling;
+        if (root_.redo_child == item.id) {
+            root_.redo_child = root_.first_child;
+        }
+        _kill(item.id);
+        return;
+    }
 
-void RemoveNewLineItem::log_debug(std::stringstream& builder) {
-    builder << "RemoveNewLine[pos=" << pos();
-    builder << ", sel_shape=" << selection_shape_as_str(selection_shape_);
-    builder << ", c=" << cursor();
-    builder << "]";
+    // the state before the item is lost with the branches leading from it
+    for (uint64_t child = root_.first_child; child != HistoryItem::NONE; ) {
+        uint64_t next = _node(child).next_sibling;
+        if (child != item.id) {
+            _kill(child);
+        }
+        child = next;
+    }
+    for (uint64_t child = item.first_child; child != HistoryItem::NONE; child = _node(child).next_sibling) {
+        _node(child).parent = ROOT;
+    }
+    root_.first_child = item.first_child;
+    root_.redo_child = item.redo_child;
+    root_.depth = item.depth;
+    root_id_ = item.id;
+    if (saved_ == ROOT) {
+        saved_ = HistoryItem::NONE;
+    } else if (saved_ == item.id) {
+        saved_ = ROOT;
+    }
+    if (current_ == item.id) {
+        current_ = ROOT;
+    }
+    _release(item);
 }
 
+// Moves to the state without applying the items, redo links are set along the way
+void History::_go(uint64_t target) {
+    size_t undos = 0;
+    std::vector<uint64_t> redos;
+    if ( !path_to(target, undos, redos) ) {
+        return;
+    }
+    for (size_t i = 0; i < undos; i++) {
+        current_ = _node(current_).parent;
+    }
+    for (auto it = redos.rbegin(); it != redos.rend(); ++it) {
+        _node(current_).redo_child = *it;
+        current_ = *it;
+    }
+}
 
-void AddTextItem::undo(Document& doc) const {
-    Vec2i to(text_.content().back().size(), pos_.y + text_.content().size() - 1);
-    if (text_.total_lines() == 1) {
-        to.x += pos_.x;
+const HistoryItem* History::_load(uint64_t id, bool fit) {
+    HistoryItem& item = _node(id);
+    if (item.place == TextPlace::MEMORY) {
+        return &item;
+    }
+    if ( !_restore(item) ) {
+        return nullptr;
     }
-    doc.remove_text(pos_, to, cursor_pos_, selection_shape_, false);
+    scan_ = std::min(scan_, id);
+    if (fit) {
+        _fit_budget();
+    }
+    return &item;
 }
 
-void AddTextItem::redo(Document& doc) const {
-    doc.insert_text(pos_, text_, cursor_pos_, selection_shape_, false);
+// Spills texts of the oldest items until the rest fits the budget. Items undone and redone
+// next and the newest item, which may be squashed, stay in memory.
+void History::_fit_budget() {
+    if ( (budget_ < 0) || !encode_ ) {
+        return;
+    }
+    scan_ = std::max(scan_, first_id_);
+    uint64_t next = _node(current_).redo_child;
+    for (uint64_t id = scan_; (id - first_id_ < count_) && (bytes_ > static_cast<size_t>(budget_)); id++) {
+        if ( (id == current_) || (id == next) || (id == _newest()) ) {
+            continue;
+        }
+        // texts become shared or stop being shared while the document is edited
+        HistoryItem& item = _node(id);
+        if (item.place == TextPlace::MEMORY) {
+            bytes_ -= item.bytes;
+            item.bytes = _text_bytes(item.text);
+            bytes_ += item.bytes;
+        }
+        if ( (item.bytes > 0) && (item.store_offset >= 0) ) {
+            // text of the item is in the store already
+            bytes_ -= item.bytes;
+            item.bytes = 0;
+            item.text = Text(content_t());
+            item.place = TextPlace::STORE;
+        } else if ( (item.bytes > 0) && !_spill(item) ) {
+            return;
+        }
+        if (id == scan_) {
+            scan_++;
+        }
+    }
 }
 
-bool AddTextItem::squash(const HistoryItem* other) {
-    if (other->created() - created() > HistoryItem::max_time_delta_ms) {
+bool History::_spill(HistoryItem& item) {
+    if ( (spill_fd_ < 0) && !_open_spill() ) {
+        // texts stay in memory, the spill file is not tried again
+        budget_ = -1;
         return false;
     }
-    const AddTextItem* p = dynamic_cast<const AddTextItem*>(other);
-    if (!p) {
+
+    uint64_t offset = spill_end_;
+    if ( !_encode(item.text, [this](const std::string& block) { return _write_spill(block); }) ) {
+        spill_end_ = offset;
         return false;
     }
 
-    const Text& p_text = p->text();
+    item.spill_offset = static_cast<int64_t>(offset);
+    item.spill_size = spill_end_ - offset;
+    spilled_ += item.spill_size;
+    bytes_ -= item.bytes;
+    item.bytes = 0;
+    item.text = Text(content_t());
+    item.place = TextPlace::SPILL;
+    Logger::instance().debug("History: text of " + std::to_string(item.spill_size) + " bytes is spilled, " +
+                             std::to_string(bytes_) + " bytes of texts stay in memory");
+    return true;
+}
 
-    // do not squash items if other item contains only space character
-    if ((p_text.total_lines() == 1) && (p_text.line_width(0) == 1) && (p_text.line_at({0, 0}).front().real() == " ")) {
-        return false;
+bool History::_restore(HistoryItem& item) {
+    std::vector<char> data;
+    if (item.place == TextPlace::STORE) {
+        size_t size = 0;
+        const char* payload = store_? store_->payload(static_cast<uint64_t>(item.store_offset), size, data): nullptr;
+        if ( !payload ) {
+            Logger::instance().error("History: text of the edit is not in the store, the edit cannot be undone");
+            return false;
+        }
+        item.text = decode_(payload, payload + size);
+    } else {
+        data.resize(item.spill_size);
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = ::pread(spill_fd_, data.data() + done, data.size() - done, static_cast<off_t>(item.spill_offset + done));
+            if ((n < 0) && (errno == EINTR)) {
+                continue;
+            }
+            if (n <= 0) {
+                Logger::instance().error(std::string("History: cannot read spilled text back: ") +
+                                         ((n < 0)? std::strerror(errno): "file is truncated") + ", the edit cannot be undone");
+                return false;
+            }
+            done += static_cast<size_t>(n);
+        }
+        item.text = decode_(data.data(), data.data() + data.size());
+        _free_spilled(item);
     }
 
-    Vec2i to(pos_.x + text_.content().back().size(), pos_.y + text_.content().size() - 1);
-    if (to == p->pos()) {
-        text_ += p->text();
-        return true;
-    } else {
+    item.place = TextPlace::MEMORY;
+    item.bytes = _text_bytes(item.text);
+    bytes_ += item.bytes;
+    return true;
+}
+
+// Lines are encoded block by block, the text is never encoded as a whole
+bool History::_encode(const Text& text, const std::function<bool(const std::string& block)>& write) const {
+    std::string block;
+    bool first = true;
+    bool success = true;
+    text.for_each_line([&](const line_t& line) {
+        if ( !first ) {
+            block += '\n';
+        }
+        first = false;
+        encode_(line, block);
+        if (block.size() >= SPILL_BLOCK_SIZE) {
+            success = success && write(block);
+            block.clear();
+        }
+    });
+    return success && write(block);
+}
+
+// Space of the spilled text is given back to the file system, the file is emptied with the last text
+void History::_free_spilled(HistoryItem& item) {
+    if (item.place != TextPlace::SPILL) {
+        return;
+    }
+    ::fallocate(spill_fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                static_cast<off_t>(item.spill_offset), static_cast<off_t>(item.spill_size));
+    spilled_ -= item.spill_size;
+    if (spilled_ == 0) {
+        spill_end_ = 0;
+        if (::ftruncate(spill_fd_, 0) != 0) {
+            Logger::instance().warning(std::string("History: cannot truncate the spill file: ") + std::strerror(errno));
+        }
+    }
+    item.spill_offset = -1;
+    item.spill_size = 0;
+}
+
+bool History::_open_spill() {
+    std::string dir = spill_dir_;
+    if (dir.empty()) {
+        const char* tmp = std::getenv("TMPDIR");
+        dir = (tmp && *tmp)? tmp: "/tmp";
+    }
+    std::string path = dir + "/editor-history-XXXXXX";
+    spill_fd_ = ::mkostemp(&path[0], O_CLOEXEC);
+    if (spill_fd_ < 0) {
+        Logger::instance().error("History: cannot create spill file in " + dir + ": " + std::strerror(errno) +
+                                 ", texts of edits are kept in memory");
         return false;
     }
+    // the file is removed at once, so it is gone with the editor even after a crash
+    ::unlink(path.c_str());
+    Logger::instance().info("History: texts of edits take more than " + std::to_string(budget_) +
+                            " bytes, older ones are spilled to an unlinked file in " + dir);
+    return true;
 }
 
-void RemoveTextItem::undo(Document& doc) const {
-    doc.insert_text(pos_, text_, cursor_pos_, selection_shape_, false);
+bool History::_write_spill(const std::string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::pwrite(spill_fd_, data.data() + done, data.size() - done, static_cast<off_t>(spill_end_ + done));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Logger::instance().error(std::string("History: cannot write spill file: ") + std::strerror(errno));
+            return false;
+        }
+        done += static_cast<size_t>(n);
+    }
+    spill_end_ += data.size();
+    return true;
 }
 
-void RemoveTextItem::redo(Document& doc) const {
-    Vec2i to(text_.content().back().size(), pos_.y + text_.total_lines() - 1);
-    if (text_.total_lines() == 1) {
-        to.x += pos_.x;
+// Items of the store are replayed until the state saved as the version of the file shown now.
+// Nothing is dropped during the replay, so the numbers of the store always name items of the
+// tree; the oldest items over `history.max_items` are dropped after it.
+void History::_replay() {
+    if ( !store_ || replayed_ ) {
+        return;
     }
-    doc.remove_text(pos_, to, cursor_pos_, selection_shape_, false);
+    replayed_ = true;
+    if ( !store_->exists() ) {
+        // the store is created with the first item
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool found = false;
+    bool damaged = false;
+    saved_ = HistoryItem::NONE;
+    replaying_ = true;
+    auto item_of = [this](uint64_t number) {
+        return (number == HistoryStore::NO_ITEM)? ROOT: number;
+    };
+    store_->read([&](const HistoryStore::Record& record, uint64_t offset, const char* payload) {
+        switch (static_cast<HistoryStore::Type>(record.type)) {
+            case HistoryStore::Type::ITEM: {
+                uint64_t parent = item_of(record.parent);
+                if ( !_alive(parent) ) {
+                    damaged = true;
+                    break;
+                }
+                HistoryItem item(static_cast<EditKind>(record.kind), {record.pos_x, record.pos_y}, {record.cursor_x, record.cursor_y});
+                item.shape = static_cast<SelectionShape>(record.shape);
+                item.joined = (record.joined != 0);
+                item.created = record.time;
+                // texts stay in the store until the items are used
+                if ( (item.kind == EditKind::ADD_TEXT) || (item.kind == EditKind::REMOVE_TEXT) ) {
+                    item.place = TextPlace::STORE;
+                }
+                item.store_offset = static_cast<int64_t>(offset);
+                item.store_size = sizeof(record) + record.size;
+                // redo links lead to the item, as they did when it was pushed
+                _go(parent);
+                _append(std::move(item), parent);
+                break;
+            }
+            case HistoryStore::Type::MOVE: {
+                uint64_t target = HistoryStore::NO_ITEM;
+                std::memcpy(&target, payload, std::min(sizeof(target), static_cast<size_t>(record.size)));
+                if ( (record.size != sizeof(target)) || !_alive(item_of(target)) ) {
+                    damaged = true;
+                    break;
+                }
+                _go(item_of(target));
+                break;
+            }
+            case HistoryStore::Type::SAVED: {
+                HistoryStore::Version version;
+                std::memcpy(&version, payload, std::min(sizeof(version), static_cast<size_t>(record.size)));
+                found = (record.size == sizeof(version)) && (version == version_);
+                saved_ = current_;
+                break;
+            }
+        }
+    });
+    replaying_ = false;
+    logged_ = (current_ == ROOT)? HistoryStore::NO_ITEM: current_;
+
+    if ( damaged || !found || (saved_ == HistoryItem::NONE) ) {
+        if (count_ > 0) {
+            Logger::instance().info("History: " + store_->path() + " does not have the state of the file, "
+                                    "the history is started anew");
+        }
+        clear();
+        store_->remove();
+        return;
+    }
+
+    // edits made after the last save can be redone
+    _go(saved_);
+    while ( (count_ > max_items_) && (alive_ > 0) ) {
+        _drop_first();
+    }
+    size_t redos = 0;
+    for (uint64_t id = _node(current_).redo_child; id != HistoryItem::NONE; id = _node(id).redo_child) {
+        redos++;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    Logger::instance().info("History: restored " + std::to_string(alive_) + " edits (" + std::to_string(redos) +
+                            " can be redone) from " + store_->path() + " in " +
+                            std::to_string(static_cast<int>(seconds * 1000)) + " ms");
 }
 
-bool RemoveTextItem::squash(const HistoryItem* other) {
-    if (other->created() - created() > HistoryItem::max_time_delta_ms) {
-        return false;
+// Writes the item to the store once it cannot be squashed anymore
+void History::_seal(HistoryItem& item) {
+    if ( !store_ || store_->failed() || !item.alive || (item.store_offset >= 0) || (item.place != TextPlace::MEMORY) ) {
+        return;
     }
-    const RemoveTextItem* p = dynamic_cast<const RemoveTextItem*>(other);
-    if (!p) {
-        return false;
+    HistoryStore::Record record = {};
+    record.parent = (item.parent == ROOT)? root_id_: item.parent;
+    record.time = item.created;
+    record.kind = static_cast<uint8_t>(item.kind);
+    record.shape = static_cast<uint8_t>(item.shape);
+    record.joined = item.joined? 1: 0;
+    record.pos_x = item.pos.x;
+    record.pos_y = item.pos.y;
+    record.cursor_x = item.cursor.x;
+    record.cursor_y = item.cursor.y;
+
+    // replay starts in the saved state the store is created in
+    if ( !store_->exists() && (saved_ == ROOT) ) {
+        store_->append(HistoryStore::Type::SAVED, reinterpret_cast<const char*>(&version_), sizeof(version_));
+    }
+    int64_t offset = store_->begin_item(record);
+    if (offset < 0) {
+        return;
+    }
+    HistoryStore& store = *store_;
+    if ( !_encode(item.text, [&store](const std::string& block) { return store.write(block); }) || !store_->end_item() ) {
+        return;
     }
+    item.store_offset = offset;
+    item.store_size = store_->size() - static_cast<uint64_t>(offset);
+    logged_ = item.id;
+}
 
-    // deleting text was like pressing delete several times
-    if (pos_ == p->pos()) {
-        text_ += p->text();;
-        pos_ = p->pos();
-        return true;
+// Only the newest item may be not written yet: items are written in the order of their ids,
+// which are their numbers in the store then
+void History::_seal_newest() {
+    if (count_ > 0) {
+        _seal(_node(_newest()));
     }
+}
 
-    // deleting text was like pressing backspace several times
-    Vec2i to(p->pos().x + p->text().content().back().size(), p->pos().y + p->text().content().size() - 1);
-    if (to == pos_) {
-        Text current;
-        current += p->text();
-        current += text_;
+// Moves between states are written only when the state matters: before a save and on close
+void History::_log_move() {
+    uint64_t state = _store_id(current_);
+    if ( !store_ || !store_->exists() || (state == logged_) ) {
+        return;
+    }
+    if (store_->append(HistoryStore::Type::MOVE, reinterpret_cast<const char*>(&state), sizeof(state)) >= 0) {
+        logged_ = state;
+    }
+}
 
-        text_ = current;
-        pos_ = p->pos();
-        return true;
+// Store is written anew when records of dropped items take most of it. Items of the tree are
+// written in the order of their ids, so a parent is always written before its children.
+void History::_compact() {
+    uint64_t live = HistoryStore::HEADER_SIZE;
+    std::vector<HistoryStore::Step> steps;
+    std::vector<uint64_t> ids;
+    steps.reserve(alive_ + 2);
+    ids.reserve(alive_);
+    auto number = [&ids](uint64_t id) {
+        return (id == ROOT)? HistoryStore::NO_ITEM: static_cast<uint64_t>(std::lower_bound(ids.begin(), ids.end(), id) - ids.begin());
+    };
+    for (uint64_t id = first_id_; id - first_id_ < count_; id++) {
+        const HistoryItem& item = _node(id);
+        if ( !item.alive ) {
+            continue;
+        }
+        if (item.store_offset < 0) {
+            // the item could not be written, the history cannot be restored
+            store_->remove();
+            return;
+        }
+        steps.push_back({HistoryStore::Type::ITEM, static_cast<uint64_t>(item.store_offset), number(item.parent)});
+        ids.push_back(id);
+        live += item.store_size;
+    }
+    if (store_->size() <= 2 * live + COMPACT_MIN_SIZE) {
+        return;
+    }
+    // redo links lead to the last state, then to the saved one the file is opened in
+    steps.push_back({HistoryStore::Type::MOVE, 0, number(current_)});
+    steps.push_back({HistoryStore::Type::MOVE, 0, number(saved_)});
+    if ( !store_->compact(steps, version_) ) {
+        store_->remove();
     }
+}
 
-    return false;
+// Lines shared with the document or other items stay in memory when the text is dropped,
+// so only lines held by the text alone count against the budget
+size_t History::_text_bytes(const Text& text) {
+    return text.lines().exclusive_memory();
 }
 
 
-void AddNewLineItem::undo(Document &doc) const {
-    doc.remove_newline(pos_, cursor_pos_, false);
+void HistoryItem::_log_text(std::stringstream& builder) const {
+    int n_lines = text.total_lines();
+    builder << '"';
+    for (int i=0; i < n_lines; i++) {
+        for (const Glyph& g: text.line_at({0, i})) {
+            builder << g;
+        }
+        if (i != n_lines - 1) {
+            builder << "\\n";
+        }
+    }
+    builder << '"';
 }
 
-void AddNewLineItem::redo(Document &doc) const {
-    doc.add_newline(pos_, cursor_pos_, false);
+void HistoryItem::log_debug(std::stringstream& builder) const {
+    switch (kind) {
+        case EditKind::ADD_TEXT:
+            builder << "AddText[pos=" << pos << ", text=";
+            _log_text(builder);
+            break;
+        case EditKind::REMOVE_TEXT:
+            builder << "RemoveText[pos=" << pos << ", text=";
+            _log_text(builder);
+            break;
+        case EditKind::ADD_NEWLINE:
+            builder << "AddNewLine[pos=" << pos;
+            break;
+        case EditKind::REMOVE_NEWLINE:
+            builder << "RemoveNewLine[pos=" << pos;
+            break;
+    }
+    builder << ", sel_shape=" << selection_shape_as_str(shape);
+    builder << ", c=" << cursor;
+    if (joined) {
+        builder << ", joined";
+    }
+    builder << "]";
 }
 
 
-void RemoveNewLineItem::undo(Document &doc) const {
-    doc.add_newline(pos_, cursor_pos_, false);
+void HistoryItem::undo(Document& doc) const {
+    switch (kind) {
+        case EditKind::ADD_TEXT:
+            doc.remove_text(pos, end(), cursor, shape, false);
+            break;
+        case EditKind::REMOVE_TEXT:
+            doc.insert_text(pos, text, cursor, shape, false);
+            break;
+        case EditKind::ADD_NEWLINE:
+            doc.remove_newline(pos, cursor, false);
+            break;
+        case EditKind::REMOVE_NEWLINE:
+            doc.add_newline(pos, cursor, false);
+            break;
+    }
 }
 
-void RemoveNewLineItem::redo(Document &doc) const {
-    doc.remove_newline(pos_, cursor_pos_, false);
+void HistoryItem::redo(Document& doc) const {
+    switch (kind) {
+        case EditKind::ADD_TEXT:
+            doc.insert_text(pos, text, cursor, shape, false);
+            break;
+        case EditKind::REMOVE_TEXT:
+            doc.remove_text(pos, end(), cursor, shape, false);
+            break;
+        case EditKind::ADD_NEWLINE:
+            doc.add_newline(pos, cursor, false);
+            break;
+        case EditKind::REMOVE_NEWLINE:
+            doc.remove_newline(pos, cursor, false);
+            break;
+    }
+}
+
+bool HistoryItem::squash(EditKind other_kind, const Vec2i& other_pos, const Text& other_text, uint32_t other_time, bool other_joined) {
+    // joined items are undone as a whole, nothing is merged into them
+    if ( (other_kind != kind) || joined || other_joined || (other_time - time > max_time_delta_ms) ) {
+        return false;
+    }
+
+    switch (kind) {
+        case EditKind::ADD_TEXT: {
+            // do not squash items if other item contains only space character
+            if ((other_text.total_lines() == 1) && (other_text.line_width(0) == 1) && (other_text.line_at({0, 0}).front().real() == " ")) {
+                return false;
+            }
+
+            Vec2i to(pos.x + text.line_width(-1), pos.y + text.total_lines() - 1);
+            if (to == other_pos) {
+                text += other_text;
+                return true;
+            }
+            return false;
+        }
+        case EditKind::REMOVE_TEXT: {
+            // deleting text was like pressing delete several times
+            if (pos == other_pos) {
+                text += other_text;
+                return true;
+            }
+
+            // Deleting text was like pressing backspace several times. Removed text is prepended
+            // in place: the line is the last one of the item's own buffer, so its gap stays at
+            // the front and each key costs the removed glyphs only, not the whole burst.
+            Vec2i to(other_pos.x + other_text.line_width(-1), other_pos.y + other_text.total_lines() - 1);
+            if (to == pos) {
+                text.insert_at({0, 0}, other_text, SelectionShape::TEXT_LIKE);
+                pos = other_pos;
+                return true;
+            }
+            return false;
+        }
+        default:
+            return false;
+    }
 }
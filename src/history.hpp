@@ -4,148 +4,253 @@
 #include "la.hpp"
 #include "text.hpp"
 #include "common.hpp"
+#include "history_store.hpp"
 
-#include <list>
-#include <vector>
 #include <memory>
-
-#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
 #include <sstream>
+#include <functional>
 
 class Document;
 
-class HistoryItem;
-typedef std::unique_ptr<HistoryItem> pItem_t;
-
-
-// TODO: we need to save both beginning and ending cursor position for every HistoryItem
-class HistoryItem {
-public:
-    HistoryItem(const Vec2i& pos, const Text& text, const Vec2i& cursor, SelectionShape shape);
-    virtual ~HistoryItem() {}
-
-    virtual void log_debug(std::stringstream& builder) = 0;
-    virtual bool squash(const HistoryItem* other) = 0;
-
-    virtual void undo(Document& doc) const { UNUSED(doc); std::cerr << "Not implemented!" << std::endl; };
-    virtual void redo(Document& doc) const { UNUSED(doc); std::cerr << "Not implemented!" << std::endl; }
-
-    uint32_t created() const {return time_;}
-
-    const Vec2i& pos() const { return pos_; }
-    const Vec2i& cursor() const { return cursor_pos_; }
-    const Vec2i end() const { return text_.get_end(pos_, selection_shape_); }
-    const Text& text() const { return text_; }
-
-    virtual SelectionShape selection_shape() const { return selection_shape_; }
-protected:
-    void _log_text(std::stringstream& builder);
-protected:
-    Vec2i pos_;
-    Text text_;
-    uint32_t time_;
-    SelectionShape selection_shape_;
-    Vec2i cursor_pos_;
 
-    static const uint32_t max_time_delta_ms = 1000;
-};
-
-class HeadItem: public HistoryItem {
-public:
-    HeadItem() : HistoryItem(Vec2i(0, 0), Text(), Vec2i(0, 0), SelectionShape::NONE) {}
-    virtual void log_debug(std::stringstream& builder) { builder << "HeadItem[]"; }
-    virtual bool squash(const HistoryItem*) { return false; }
+enum class EditKind : uint8_t {
+    ADD_TEXT,
+    REMOVE_TEXT,
+    ADD_NEWLINE,
+    REMOVE_NEWLINE,
 };
 
-class AddTextItem: public HistoryItem {
-public:
-    AddTextItem(const Vec2i& pos, const Text& text, const Vec2i& cursor, SelectionShape shape) : HistoryItem(pos, text, cursor, shape) {}
-    virtual ~AddTextItem() {}
-
-    virtual void undo(Document& doc) const;
-    virtual void redo(Document& doc) const;
-
-    virtual bool squash(const HistoryItem* other);
-
-    virtual void log_debug(std::stringstream& builder);
-
-    // Added text cannot be aslo selected, so we will return NONE to outside,
-    // but we will use selection_shape_ (it always should be equal to TEXT_LIKE!)
-    // for Document::insert_text and Document::remove_text to remove text_ properly
-    // Maybe just replace selection_shape_ in undo() and redo() with TEXT_LIKE
-    // and create AddTextItem with shape=NONE?
-    virtual SelectionShape selection_shape() const override { return SelectionShape::NONE; }
-private:
-
+// Where the text of an item is kept
+enum class TextPlace : uint8_t {
+    MEMORY,
+    SPILL,      // spill file of the history
+    STORE,      // record of the item in the history store
 };
 
-class AddNewLineItem: public HistoryItem {
-public:
-    AddNewLineItem(const Vec2i& pos, const Vec2i& cursor) : HistoryItem(pos, Text(), cursor, SelectionShape::NONE) {}
-    virtual ~AddNewLineItem() {}
-
-    virtual void undo(Document& doc) const;
-    virtual void redo(Document& doc) const;
-
-    virtual void log_debug(std::stringstream& builder);
-    virtual bool squash(const HistoryItem*) { return false; }
-private:
-};
-
-class RemoveNewLineItem: public HistoryItem {
-public:
-    RemoveNewLineItem(const Vec2i& pos, const Vec2i& cursor) : HistoryItem(pos, Text(), cursor, SelectionShape::NONE) {}
-    virtual ~RemoveNewLineItem() {}
-
-    virtual void undo(Document& doc) const;
-    virtual void redo(Document& doc) const;
-
-    virtual void log_debug(std::stringstream& builder);
-    virtual bool squash(const HistoryItem*) { return false; }
-private:
-
-};
-
-class RemoveTextItem: public HistoryItem {
-public:
-    RemoveTextItem(const Vec2i& pos, const Text& text, const Vec2i& cursor, SelectionShape shape) : HistoryItem(pos, text, cursor, shape) {}
-    virtual ~RemoveTextItem() {}
-
-    virtual void undo(Document& doc) const;
-    virtual void redo(Document& doc) const;
+// Single edit of the document, stored by value in the history. The kind selects how the
+// edit is undone, redone and squashed, so items need no virtual calls. The text is a piece
+// table sharing lines with the document: an empty one holds nothing, copying a text allocates
+// its tree nodes. The first squash stores the last line in the item's own buffer, later ones
+// edit it there in place.
+// TODO: we need to save both beginning and ending cursor position for every HistoryItem
+struct HistoryItem {
+    // text is taken by value: callers move removed text in, so its lines are not even shared
+    HistoryItem(EditKind kind, const Vec2i& pos, Text text, const Vec2i& cursor, SelectionShape shape, bool joined = false)
+        : kind(kind), shape(shape), joined(joined), place(TextPlace::MEMORY), time(0), pos(pos), cursor(cursor),
+          text(std::move(text)), bytes(0), spill_offset(-1), spill_size(0), store_offset(-1), store_size(0),
+          created(0), id(NONE), parent(NONE), first_child(NONE), next_sibling(NONE), redo_child(NONE), depth(0), alive(false) {}
+    // newline edits carry no text
+    HistoryItem(EditKind kind, const Vec2i& pos, const Vec2i& cursor)
+        : kind(kind), shape(SelectionShape::NONE), joined(false), place(TextPlace::MEMORY), time(0), pos(pos), cursor(cursor),
+          text(content_t()), bytes(0), spill_offset(-1), spill_size(0), store_offset(-1), store_size(0),
+          created(0), id(NONE), parent(NONE), first_child(NONE), next_sibling(NONE), redo_child(NONE), depth(0), alive(false) {}
+
+    void undo(Document& doc) const;
+    void redo(Document& doc) const;
+    // merges an edit pushed right after this item into its text, e.g. typed characters into a word
+    bool squash(EditKind other_kind, const Vec2i& other_pos, const Text& other_text, uint32_t other_time, bool other_joined);
+
+    // Added text cannot be also selected, so NONE is returned to outside for it,
+    // `shape` is still used to remove the added text on undo
+    SelectionShape selection_shape() const { return (kind == EditKind::ADD_TEXT)? SelectionShape::NONE: shape; }
+    const Vec2i end() const { return text.get_end(pos, shape); }
+
+    void log_debug(std::stringstream& builder) const;
+
+    EditKind kind;
+    SelectionShape shape;
+    bool joined;        // undone and redone together with the item before it
+    TextPlace place;
+    uint32_t time;      // milliseconds, set when the item is pushed
+    Vec2i pos;
+    Vec2i cursor;
+    Text text;          // added or removed text, empty while it is not in memory
+
+    size_t bytes;           // memory taken by the text
+    int64_t spill_offset;   // position of the spilled text in the spill file, -1 if it is not there
+    uint64_t spill_size;
+    int64_t store_offset;   // position of the record of the item in the history store, -1 if it is not written
+    uint64_t store_size;    // bytes of the record with the text
+
+    // Node of the undo tree: the item is applied to the state after its parent, children are
+    // edits made in that state after undos. Links are ids, set when the item is pushed.
+    int64_t created;        // milliseconds since the epoch
+    uint64_t id;            // items get increasing ids in the order they are pushed
+    uint64_t parent;
+    uint64_t first_child;   // the newest child, older ones follow it as siblings
+    uint64_t next_sibling;
+    uint64_t redo_child;    // child redone next: the one made or visited last
+    uint64_t depth;
+    bool alive;             // false once the item is dropped from the tree, its slot is reused later
 
-    virtual void log_debug(std::stringstream& builder);
+    static const uint32_t max_time_delta_ms = 1000;
+    static constexpr uint64_t NONE = ~0ull;
 
-    virtual bool squash(const HistoryItem*); /*{ return false; }*/
 private:
-
+    void _log_text(std::stringstream& builder) const;
 };
 
 
+// Items make an undo tree: an edit made after undos is a new branch next to the items which
+// could be redone, nothing is truncated. Undo moves to the parent and redo to the child chosen
+// last, both O(1); choosing another branch to redo only changes a link. Any state can be reached
+// through the common ancestor with the current one, undoing and redoing only the items between.
+// Branches share the items of their common part, texts are never copied between them.
+//
+// Items are kept in a ring buffer which grows to `history.max_items` once and is reused after that,
+// so the ring itself does not allocate per item, only the text of a new item is copied. Edits
+// squashed into the newest item, like typed characters, are appended to its line in place and
+// allocate only when the line outgrows its capacity; moving between items in memory allocates
+// nothing. Slots are taken in the order of the item ids; when the ring is full the oldest item is
+// dropped. If it is applied now, the state before it is lost and so are the branches leading from
+// that state; otherwise it is dropped with its branch. Slots of items dropped with a branch are
+// reused once they are the oldest.
+//
+// Memory of the texts is limited by `history.memory_budget`. Over the budget, texts of items
+// far from the current one are encoded to an unlinked temporary file and read back only when
+// these items are undone or redone. Only lines held by a text alone count: lines it shares with
+// the document or with other items would stay in memory after spilling.
+//
+// History of a file may be kept in a HistoryStore between sessions. Every item is written there
+// once it cannot be squashed anymore: when the next item is pushed, on undo and on save, so
+// the texts of such items are dropped from memory instead of being spilled. Items of the store
+// are read on first use of the history, opening a file does not depend on the history size.
 class History {
 public:
+    typedef std::function<void(const line_t& line, std::string& out)> encode_t;
+    typedef std::function<Text(const char* start, const char* stop)> decode_t;
+
     History();
     ~History();
 
-    void push_back(HistoryItem* item);
-    const pItem_t& current_item();
-    const pItem_t& next_item();
-
-    void dec() { list_cur_ = (list_cur_ == items_list_.begin())? list_cur_: std::prev(list_cur_); }
-    void inc() { list_cur_ = (list_cur_ == std::prev(items_list_.end())? list_cur_: std::next(list_cur_)); }
-
-    int size() const { return static_cast<int>(items_list_.size());}
+    explicit History(const History&) = delete;
+    void operator=(const History&) = delete;
+
+    // texts are spilled only once the owner tells how to encode them and decode them back
+    void set_spill(encode_t encode, decode_t decode);
+
+    // Keeps the history in the store at `path`, the text is the `version` of the file now.
+    // Items of the store are restored on first use up to the state saved as that version,
+    // later items can be redone; the history starts anew if the store has no such state.
+    void open_store(const std::string& path, const HistoryStore::Version& version);
+    // the text was saved as `version` of the file
+    void mark_saved(const HistoryStore::Version& version);
+    // Writes the rest of the history and closes the store, the history is cleared.
+    // Stores of other files not written for `history.store_days` are removed then.
+    void close_store();
+    bool is_stored() const { return store_ != nullptr; }
+
+    // Pushes `item` as a child of the current one, items which could be redone stay in their branch.
+    // The item is merged into the current one if `squash` is set and they make a single edit.
+    void push_back(HistoryItem&& item, bool squash = true);
+    // Pushes an edit of `text` as push_back() does, but `text` is copied into a new item only
+    // if the edit is not squashed into the current one
+    void push_text(EditKind kind, const Vec2i& pos, const Text& text, const Vec2i& cursor, SelectionShape shape);
+    // item undone next, nullptr if there is none or its text cannot be read back
+    const HistoryItem* current_item() { _replay(); return (current_ != ROOT)? _load(current_): nullptr; }
+    // item redone next, nullptr if there is none or its text cannot be read back
+    const HistoryItem* next_item();
+    // Reads back texts of the items the next undo or redo applies: the item and the items joined
+    // with it. False if a text cannot be read, none of them may be applied then. The texts are
+    // not spilled again until the next item is read back.
+    bool load_undo_group();
+    bool load_redo_group();
+
+    // moves to the parent of the current item
+    void dec();
+    // moves to the child redone next
+    void inc();
+    // Makes `child` of the current item the one redone next
+    void choose(uint64_t child);
+    // Makes the next branch of the current state the one redone next, false if there is one branch only
+    bool switch_branch();
+
+    // Items to get from the current state to the state after item `target` through their common
+    // ancestor: `undos` items are undone, then `redos` are redone from the last one.
+    // False if there is no such item.
+    bool path_to(uint64_t target, size_t& undos, std::vector<uint64_t>& redos);
+    // State made right before or right after the current one in time, whichever branch it is on:
+    // the item it is after, ROOT or NONE if there is no such state.
+    // States in the middle of joined items are skipped.
+    uint64_t earlier();
+    uint64_t later();
+
+    int size() const { return static_cast<int>(alive_); }
     void clear();
 
+    // bytes of texts kept in memory and spilled to the disk
+    size_t memory_used() const { return bytes_; }
+    uint64_t spilled() const { return spilled_; }
+
     void log_items();
+
+    static constexpr size_t SPILL_BLOCK_SIZE = 1024 * 1024;
+    // store is written anew when it is closed if most of it is taken by dropped items
+    static constexpr uint64_t COMPACT_MIN_SIZE = 1024 * 1024;
+    // state before the oldest item, the parent of the oldest items
+    static constexpr uint64_t ROOT = HistoryItem::NONE - 1;
 private:
-    bool _squash(const HistoryItem* item);
+    const HistoryItem& _node(uint64_t id) const { return (id == ROOT)? root_: items_[(first_ + (id - first_id_)) % items_.size()]; }
+    HistoryItem& _node(uint64_t id) { return (id == ROOT)? root_: items_[(first_ + (id - first_id_)) % items_.size()]; }
+    bool _alive(uint64_t id) const { return (id == ROOT) || ((id >= first_id_) && (id - first_id_ < count_) && _node(id).alive); }
+    bool _in_group(uint64_t id) const;
+    bool _squash(EditKind kind, const Vec2i& pos, const Text& text, uint32_t time, bool joined);
+    void _push(HistoryItem&& item);
+    uint64_t _newest() const { return first_id_ + count_ - 1; }
+    void _release(HistoryItem& item);
+    void _kill(uint64_t top);
+    void _append(HistoryItem&& item, uint64_t parent);
+    void _drop_first();
+    void _drop_root(HistoryItem& item);
+    void _go(uint64_t target);
+
+    const HistoryItem* _load(uint64_t id, bool fit = true);
+    void _fit_budget();
+    bool _spill(HistoryItem& item);
+    bool _restore(HistoryItem& item);
+    bool _encode(const Text& text, const std::function<bool(const std::string& block)>& write) const;
+    void _free_spilled(HistoryItem& item);
+    bool _open_spill();
+    bool _write_spill(const std::string& data);
+
+    void _replay();
+    void _seal(HistoryItem& item);
+    void _seal_newest();
+    void _log_move();
+    uint64_t _store_id(uint64_t id) const { return (id == ROOT)? root_id_: id; }
+    void _compact();
+    static size_t _text_bytes(const Text& text);
 private:
-    std::list<pItem_t> items_list_;
-    std::list<pItem_t>::iterator list_cur_;
-
-    const pItem_t null_;
-    const size_t max_size_ = 1024;  // should always be >= 0
+    std::vector<HistoryItem> items_;
+    size_t max_items_;
+    size_t first_;      // position of the oldest item in the ring
+    uint64_t first_id_; // id of the oldest item
+    size_t count_;      // slots taken, by items dropped with their branches too
+    size_t alive_;      // items in the tree
+    HistoryItem root_;  // links of ROOT, its depth is the one of the oldest items' parent
+    uint64_t root_id_;  // item the state of ROOT is after, NONE if no applied item was dropped
+    uint64_t current_;  // the text is in the state after this item
+
+    long long budget_;
+    std::string spill_dir_;
+    encode_t encode_;
+    decode_t decode_;
+    size_t bytes_;
+    uint64_t scan_;         // items before it are spilled or have no text
+    int spill_fd_;
+    uint64_t spill_end_;    // texts are appended to the spill file
+    uint64_t spilled_;
+
+    std::unique_ptr<HistoryStore> store_;
+    int store_days_;        // stores not written for longer are removed
+    bool replayed_;         // items of the store were restored
+    bool replaying_;        // items are not dropped while the store is replayed
+    uint64_t logged_;       // state the replay of the store ends in, numbered as in the store
+    HistoryStore::Version version_;     // version of the file the text was last loaded from or saved as
+    uint64_t saved_;        // state saved as `version_`, NONE if that state is lost
 };
 
 #endif // HISTORY_HPP_
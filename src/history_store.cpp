@@ -0,0 +1,382 @@
+#include "history_store.hpp"
+
+#include "logger.hpp"
+#include "file_writer.hpp"
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <climits>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+
+
+static const char MAGIC[4] = {'E', 'D', 'H', '1'};
+
+
+HistoryStore::Version HistoryStore::Version::of(const std::string& filepath) {
+    FileStamp stamp = FileStamp::of(filepath);
+    if (stamp.mtime_ns == 0) {
+        return {0, 0, 0};
+    }
+    MappedFile file(filepath);
+    return {stamp.size, stamp.mtime_ns, file.is_open()? file.sample_hash(): 0};
+}
+
+
+HistoryStore::HistoryStore(const std::string& path)
+    : path_(path), fd_(-1), failed_(false), end_(0), mapped_(0), item_(0), record_()
+{
+    _open(0);
+}
+
+HistoryStore::~HistoryStore() {
+    _close();
+}
+
+bool HistoryStore::_open(int flags) {
+    fd_ = ::open(path_.c_str(), O_RDWR | O_CLOEXEC | flags, 0600);
+    if (fd_ < 0) {
+        if ( (errno == ENOENT) && !(flags & O_CREAT) ) {
+            // nothing was written for the file yet
+            return true;
+        }
+        return _fail(std::string("cannot open: ") + std::strerror(errno));
+    }
+
+    struct stat st;
+    char header[HEADER_SIZE];
+    uint32_t record_size = sizeof(Record);
+    bool valid = (::fstat(fd_, &st) == 0) && (static_cast<uint64_t>(st.st_size) >= HEADER_SIZE) &&
+                 _read_at(0, header, HEADER_SIZE) && (std::memcmp(header, MAGIC, sizeof(MAGIC)) == 0) &&
+                 (std::memcmp(header + sizeof(MAGIC), &record_size, sizeof(record_size)) == 0);
+    if ( !valid ) {
+        reset();
+        return !failed_;
+    }
+
+    // existing records are only mapped, they are read when the history is used
+    end_ = static_cast<uint64_t>(st.st_size);
+    map_.reset(new MappedFile(path_));
+    mapped_ = map_->is_open()? std::min(end_, static_cast<uint64_t>(map_->size())): 0;
+    return true;
+}
+
+bool HistoryStore::_create() {
+    size_t slash = path_.find_last_of('/');
+    if ((slash != std::string::npos) && (slash > 0)) {
+        // only the user may read the stores
+        FileWriter::create_dirs(path_.substr(0, slash));
+    }
+    // empty store is reset to the header
+    return _open(O_CREAT | O_TRUNC);
+}
+
+void HistoryStore::_close() {
+    map_.reset();
+    mapped_ = 0;
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+void HistoryStore::read(visit_t visit) {
+    uint64_t pos = HEADER_SIZE;
+    while (pos + sizeof(Record) <= mapped_) {
+        Record record;
+        std::memcpy(&record, map_->begin() + pos, sizeof(record));
+        const char* data = map_->begin() + pos + sizeof(record);
+        bool valid = (record.checksum == _checksum(record)) &&
+                     (record.type >= static_cast<uint8_t>(Type::ITEM)) && (record.type <= static_cast<uint8_t>(Type::SAVED)) &&
+                     (record.size <= mapped_ - pos - sizeof(record));
+        // payloads of items are checked when they are used, the rest are small
+        if ( valid && (record.type != static_cast<uint8_t>(Type::ITEM)) ) {
+            valid = (fnv1a(data, record.size) == record.payload_hash);
+        }
+        if ( !valid ) {
+            break;
+        }
+        visit(record, pos, data);
+        pos += sizeof(record) + record.size;
+    }
+
+    if (pos < end_) {
+        Logger::instance().warning("History store " + path_ + ": " + std::to_string(end_ - pos) +
+                                   " bytes of torn records are dropped");
+        if (::ftruncate(fd_, static_cast<off_t>(pos)) != 0) {
+            _fail("cannot truncate torn records");
+        }
+        end_ = pos;
+        mapped_ = std::min(mapped_, pos);
+    }
+}
+
+bool HistoryStore::_read_record(uint64_t offset, Record& record) const {
+    if (offset + sizeof(record) <= mapped_) {
+        std::memcpy(&record, map_->begin() + offset, sizeof(record));
+    } else if ( !_read_at(offset, reinterpret_cast<char*>(&record), sizeof(record)) ) {
+        return false;
+    }
+    return (record.checksum == _checksum(record)) && (offset + sizeof(record) + record.size <= end_);
+}
+
+const char* HistoryStore::payload(uint64_t offset, size_t& size, std::vector<char>& buffer) const {
+    Record record;
+    if ( !_read_record(offset, record) ) {
+        Logger::instance().error("History store " + path_ + ": record at " + std::to_string(offset) + " is damaged");
+        return nullptr;
+    }
+
+    uint64_t start = offset + sizeof(record);
+    size = static_cast<size_t>(record.size);
+    const char* data = nullptr;
+    if (start + size <= mapped_) {
+        data = map_->begin() + start;
+    } else {
+        buffer.resize(size);
+        if ( !_read_at(start, buffer.data(), size) ) {
+            Logger::instance().error("History store " + path_ + ": cannot read text at " + std::to_string(start) +
+                                     ": " + std::strerror(errno));
+            return nullptr;
+        }
+        data = buffer.data();
+    }
+    if (fnv1a(data, size) != record.payload_hash) {
+        Logger::instance().error("History store " + path_ + ": text at " + std::to_string(start) + " is damaged");
+        return nullptr;
+    }
+    return data;
+}
+
+int64_t HistoryStore::append(Type type, const char* data, size_t size) {
+    if ( failed_ || ((fd_ < 0) && !_create()) ) {
+        return -1;
+    }
+    Record record = {};
+    record.size = size;
+    record.payload_hash = fnv1a(data, size);
+    record.type = static_cast<uint8_t>(type);
+    record.checksum = _checksum(record);
+
+    std::string out(reinterpret_cast<const char*>(&record), sizeof(record));
+    if (size > 0) {
+        out.append(data, size);
+    }
+    uint64_t offset = end_;
+    if ( !_write_at(offset, out.data(), out.size()) ) {
+        return -1;
+    }
+    end_ += out.size();
+    return static_cast<int64_t>(offset);
+}
+
+int64_t HistoryStore::begin_item(Record record) {
+    if ( failed_ || ((fd_ < 0) && !_create()) ) {
+        return -1;
+    }
+    // the header is written last, so an incomplete record fails the checksum
+    record_ = record;
+    record_.size = 0;
+    record_.payload_hash = fnv1a(nullptr, 0);
+    record_.type = static_cast<uint8_t>(Type::ITEM);
+    item_ = end_;
+    end_ += sizeof(Record);
+    return static_cast<int64_t>(item_);
+}
+
+bool HistoryStore::write(const std::string& data) {
+    if ( failed_ || !_write_at(end_, data.data(), data.size()) ) {
+        return false;
+    }
+    record_.size += data.size();
+    record_.payload_hash = fnv1a(data.data(), data.size(), record_.payload_hash);
+    end_ += data.size();
+    return true;
+}
+
+bool HistoryStore::end_item() {
+    record_.checksum = _checksum(record_);
+    return !failed_ && _write_at(item_, reinterpret_cast<const char*>(&record_), sizeof(record_));
+}
+
+bool HistoryStore::compact(const std::vector<Step>& steps, const Version& saved) {
+    if (failed_) {
+        return false;
+    }
+    uint64_t before = end_;
+    {
+        FileWriter out(path_);
+        if ( !out.is_open() ) {
+            return false;
+        }
+        uint32_t record_size = sizeof(Record);
+        out.write(MAGIC, sizeof(MAGIC));
+        out.write(reinterpret_cast<const char*>(&record_size), sizeof(record_size));
+
+        // texts of the items are copied as they are, they are not decoded
+        std::vector<char> buffer;
+        for (const Step& step: steps) {
+            Record record = {};
+            if (step.type == Type::ITEM) {
+                if ( !_read_record(step.offset, record) ) {
+                    Logger::instance().error("History store " + path_ + ": record at " + std::to_string(step.offset) + " is damaged");
+                    return false;
+                }
+                buffer.resize(record.size);
+                if ( !_read_at(step.offset + sizeof(record), buffer.data(), buffer.size()) ) {
+                    Logger::instance().error("History store " + path_ + ": cannot read: " + std::strerror(errno));
+                    return false;
+                }
+                // items are numbered anew, so the parent is changed
+                record.parent = step.node;
+            } else {
+                buffer.assign(reinterpret_cast<const char*>(&step.node), reinterpret_cast<const char*>(&step.node) + sizeof(step.node));
+                record.size = buffer.size();
+                record.payload_hash = fnv1a(buffer.data(), buffer.size());
+                record.type = static_cast<uint8_t>(Type::MOVE);
+            }
+            record.checksum = _checksum(record);
+            out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+            if ( !buffer.empty() ) {
+                out.write(buffer.data(), buffer.size());
+            }
+        }
+
+        Record record = {};
+        record.size = sizeof(saved);
+        record.payload_hash = fnv1a(reinterpret_cast<const char*>(&saved), sizeof(saved));
+        record.type = static_cast<uint8_t>(Type::SAVED);
+        record.checksum = _checksum(record);
+        out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        out.write(reinterpret_cast<const char*>(&saved), sizeof(saved));
+        if ( !out.commit() ) {
+            return false;
+        }
+    }
+
+    // the store was replaced, the new one is mapped
+    _close();
+    if ( !_open(0) || (fd_ < 0) ) {
+        failed_ = true;
+        return false;
+    }
+    Logger::instance().info("History store " + path_ + " is compacted from " + std::to_string(before) +
+                            " to " + std::to_string(end_) + " bytes");
+    return true;
+}
+
+void HistoryStore::reset() {
+    if (fd_ < 0) {
+        failed_ = false;
+        _create();
+        return;
+    }
+    map_.reset();
+    mapped_ = 0;
+    end_ = 0;
+    failed_ = false;
+    uint32_t record_size = sizeof(Record);
+    char header[HEADER_SIZE];
+    std::memcpy(header, MAGIC, sizeof(MAGIC));
+    std::memcpy(header + sizeof(MAGIC), &record_size, sizeof(record_size));
+    if (::ftruncate(fd_, 0) != 0) {
+        _fail("cannot truncate");
+        return;
+    }
+    if (_write_at(0, header, HEADER_SIZE)) {
+        end_ = HEADER_SIZE;
+    }
+}
+
+void HistoryStore::remove() {
+    _close();
+    ::unlink(path_.c_str());
+}
+
+void HistoryStore::prune(const std::string& dir, int max_days) {
+    DIR* entries = (max_days > 0)? ::opendir(dir.c_str()): nullptr;
+    if ( !entries ) {
+        return;
+    }
+    time_t oldest = std::time(nullptr) - static_cast<time_t>(max_days) * 24 * 60 * 60;
+    size_t removed = 0;
+    const std::string suffix = ".hist";
+    while (const dirent* entry = ::readdir(entries)) {
+        std::string name = entry->d_name;
+        if ( (name.size() <= suffix.size()) || (name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) ) {
+            continue;
+        }
+        std::string path = dir + "/" + name;
+        struct stat st;
+        if ( (::stat(path.c_str(), &st) == 0) && S_ISREG(st.st_mode) && (st.st_mtime < oldest) &&
+             (::unlink(path.c_str()) == 0) ) {
+            removed++;
+        }
+    }
+    ::closedir(entries);
+    if (removed > 0) {
+        Logger::instance().info("History stores: " + std::to_string(removed) + " not written for " +
+                                std::to_string(max_days) + " days are removed from " + dir);
+    }
+}
+
+std::string HistoryStore::path_for(const std::string& dir, const std::string& filepath) {
+    char resolved[PATH_MAX];
+    std::string path = ::realpath(filepath.c_str(), resolved)? resolved: filepath;
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.hist", static_cast<unsigned long long>(fnv1a(path.data(), path.size())));
+    return dir + "/" + name;
+}
+
+bool HistoryStore::_write_at(uint64_t offset, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::pwrite(fd_, data, size, static_cast<off_t>(offset));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return _fail(std::string("cannot write: ") + std::strerror(errno));
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+bool HistoryStore::_read_at(uint64_t offset, char* data, size_t size) const {
+    while (size > 0) {
+        ssize_t n = ::pread(fd_, data, size, static_cast<off_t>(offset));
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+bool HistoryStore::_fail(const std::string& what) {
+    if ( !failed_ ) {
+        Logger::instance().error("History store " + path_ + ": " + what + ", the history is not kept anymore");
+    }
+    failed_ = true;
+    return false;
+}
+
+uint32_t HistoryStore::_checksum(const Record& record) {
+    return static_cast<uint32_t>(fnv1a(reinterpret_cast<const char*>(&record), offsetof(Record, checksum)));
+}
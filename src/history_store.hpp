@@ -0,0 +1,143 @@
+#ifndef HISTORY_STORE_HPP_
+#define HISTORY_STORE_HPP_
+
+#include "journal.hpp"
+#include "mapped_file.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+
+// Undo history of a file kept between sessions, one store per file in the cache directory.
+// The store is a log appended as the history changes: items which cannot be squashed anymore
+// with their parents in the undo tree, moves to other states of the tree, and marks of the file
+// version saved at that point. Items are numbered by the order of their records. History is
+// rebuilt by replaying the log, which only reads fixed-size records through a mapping of the
+// store: texts of the items are decoded from the mapping when the items are undone.
+//
+// The store is created when the first item is written, so files which are only viewed have none.
+//
+// Layout: magic, size of Record, followed by records
+//   Record | payload, i.e. UTF-8 text of the item with lines joined by '\n', the number of the
+//            item moved to or the saved Version
+// A record torn by a crash fails the checksum, it and everything after it are dropped.
+// Texts are checked against their hashes only when they are read back.
+class HistoryStore {
+public:
+    enum class Type : uint8_t {
+        ITEM = 1,
+        MOVE,
+        SAVED,
+    };
+
+    struct Record {
+        uint64_t size;          // bytes of the payload
+        uint64_t payload_hash;  // FNV-1a of the payload, checked when the payload is read
+        uint64_t parent;        // number of the item this one follows, NO_ITEM for the state before the first one
+        int64_t time;           // milliseconds since the epoch the item was made at
+        uint8_t type;
+        uint8_t kind;           // EditKind of the item
+        uint8_t shape;
+        uint8_t joined;
+        int32_t pos_x;
+        int32_t pos_y;
+        int32_t cursor_x;
+        int32_t cursor_y;
+        uint32_t checksum;      // of the fields above
+    };
+    static_assert(sizeof(Record) == 56, "record should have no padding");
+
+    // Version of the file on the disk: its stamp and the hash of its sampled contents
+    struct Version {
+        uint64_t size;
+        int64_t mtime_ns;
+        uint64_t sample_hash;
+
+        static Version of(const std::string& filepath);
+        bool operator==(const Version& other) const {
+            return (size == other.size) && (mtime_ns == other.mtime_ns) && (sample_hash == other.sample_hash);
+        }
+    };
+    static_assert(sizeof(Version) == 24, "version should have no padding");
+
+    // Record of the compacted store: ITEM copied from `offset` with the new `node` as its parent,
+    // or MOVE to `node`
+    struct Step {
+        Type type;
+        uint64_t offset;
+        uint64_t node;
+    };
+
+    typedef std::function<void(const Record& record, uint64_t offset, const char* payload)> visit_t;
+
+    // Opens the store at `path` if it exists, existing records are mapped.
+    // A missing store is created by the first write.
+    explicit HistoryStore(const std::string& path);
+    ~HistoryStore();
+
+    explicit HistoryStore(const HistoryStore&) = delete;
+    void operator=(const HistoryStore&) = delete;
+
+    bool exists() const { return fd_ >= 0; }
+    // the store cannot be opened or a write has failed, records after it are missing
+    bool failed() const { return failed_; }
+    const std::string& path() const { return path_; }
+    uint64_t size() const { return end_; }
+
+    // Visits records mapped when the store was opened with the offsets of the records,
+    // a torn tail is cut off the store
+    void read(visit_t visit);
+    // Payload of the record at `offset` and its `size`, it is read into `buffer` unless it is mapped.
+    // Returns nullptr if the record cannot be read or the payload does not match its hash.
+    const char* payload(uint64_t offset, size_t& size, std::vector<char>& buffer) const;
+
+    // Appends a record with a small payload, returns its offset or -1
+    int64_t append(Type type, const char* data = nullptr, size_t size = 0);
+    // Item records are appended in parts: begin_item() with the fields of the item, write() of
+    // the encoded text block by block and end_item() which completes the record header
+    int64_t begin_item(Record record);
+    bool write(const std::string& data);
+    bool end_item();
+
+    // Writes the store anew with records of `steps` followed by the mark of `saved` version
+    bool compact(const std::vector<Step>& steps, const Version& saved);
+    // Drops all records, the store is created if it does not exist
+    void reset();
+    // Closes and removes the store, it is created again by the next write
+    void remove();
+
+    // Removes stores in `dir` not written for `max_days` days, none if it is not positive
+    static void prune(const std::string& dir, int max_days);
+
+    // store of `filepath` is named after the hash of its absolute path
+    static std::string path_for(const std::string& dir, const std::string& filepath);
+
+    static constexpr size_t HEADER_SIZE = 8;
+    static constexpr uint64_t NO_ITEM = ~0ull;
+
+private:
+    bool _open(int flags);
+    bool _create();
+    void _close();
+    bool _read_record(uint64_t offset, Record& record) const;
+    bool _write_at(uint64_t offset, const char* data, size_t size);
+    bool _read_at(uint64_t offset, char* data, size_t size) const;
+    bool _fail(const std::string& what);
+    static uint32_t _checksum(const Record& record);
+
+private:
+    std::string path_;
+    int fd_;
+    bool failed_;
+    uint64_t end_;
+    std::unique_ptr<MappedFile> map_;   // records written before the store was opened
+    uint64_t mapped_;       // valid bytes of the mapping, records after them are read with pread()
+
+    uint64_t item_;         // offset of the item record being written
+    Record record_;
+};
+
+#endif // HISTORY_STORE_HPP_
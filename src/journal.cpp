@@ -0,0 +1,265 @@
+#include "journal.hpp"
+
+#include "logger.hpp"
+#include "mapped_file.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <cerrno>
+#include <cstring>
+
+
+static const char MAGIC[4] = {'E', 'D', 'J', '1'};
+
+template<typename T>
+static void put(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template<typename T>
+static T get(const char*& pos) {
+    T value;
+    std::memcpy(&value, pos, sizeof(value));
+    pos += sizeof(value);
+    return value;
+}
+
+
+FileStamp FileStamp::of(const std::string& filepath) {
+    struct stat st;
+    if (::stat(filepath.c_str(), &st) != 0) {
+        return {0, 0};
+    }
+    int64_t mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return {static_cast<uint64_t>(st.st_size), mtime_ns};
+}
+
+
+Journal::Journal(const std::string& path, const FileStamp& stamp, size_t valid_size, int sync_interval_ms)
+    : path_(path), stamp_(stamp), sync_interval_(sync_interval_ms), stopping_(false), generation_(0),
+      fd_(-1), failed_(false), dirty_(false), last_sync_(std::chrono::steady_clock::now())
+{
+    // existing journal is continued after its last complete record,
+    // new one is created on the first edit
+    if (valid_size) {
+        fd_ = ::open(path_.c_str(), O_WRONLY | O_APPEND);
+        if ((fd_ < 0) || (::ftruncate(fd_, valid_size) != 0)) {
+            Logger::instance().error("Journal: cannot continue " + path_ + ": " + std::strerror(errno));
+            failed_ = true;
+        }
+    }
+    worker_ = std::thread(&Journal::_run, this);
+}
+
+Journal::~Journal() {
+    _stop();
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+void Journal::append(const Record& record) {
+    std::string data;
+    data.reserve(RECORD_HEADER_SIZE + record.text.size());
+    put<uint32_t>(data, static_cast<uint32_t>(record.text.size()));
+    put<uint32_t>(data, 0);
+    put<uint8_t>(data, static_cast<uint8_t>(record.op));
+    put<uint8_t>(data, static_cast<uint8_t>(record.shape));
+    put<int32_t>(data, record.from.x);
+    put<int32_t>(data, record.from.y);
+    put<int32_t>(data, record.to.x);
+    put<int32_t>(data, record.to.y);
+    data += record.text;
+
+    uint32_t checksum = _checksum(data.data() + 8, data.size() - 8);
+    std::memcpy(&data[4], &checksum, sizeof(checksum));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_ += data;
+    cv_.notify_one();
+}
+
+void Journal::reset(const FileStamp& stamp) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::lock_guard<std::mutex> file_lock(file_mutex_);
+    pending_.clear();
+    generation_++;
+    stamp_ = stamp;
+    if (fd_ < 0) {
+        return;
+    }
+
+    std::string header = _header();
+    if ((::ftruncate(fd_, 0) != 0) || (::write(fd_, header.data(), header.size()) != static_cast<ssize_t>(header.size()))) {
+        Logger::instance().error("Journal: cannot reset " + path_ + ": " + std::strerror(errno));
+        failed_ = true;
+    }
+    dirty_ = true;
+}
+
+void Journal::remove() {
+    _stop();
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+        ::unlink(path_.c_str());
+    }
+}
+
+Journal::Status Journal::read(const std::string& path, const FileStamp& stamp, std::vector<Record>& records, size_t& valid_size) {
+    valid_size = 0;
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) {
+        return Status::MISSING;
+    }
+
+    MappedFile file(path);
+    if ( !file.is_open() || (file.size() < HEADER_SIZE) || std::memcmp(file.begin(), MAGIC, sizeof(MAGIC)) ) {
+        return Status::MISMATCH;
+    }
+    const char* pos = file.begin() + sizeof(MAGIC);
+    FileStamp written;
+    written.size = get<uint64_t>(pos);
+    written.mtime_ns = get<int64_t>(pos);
+    if ( !(written == stamp) ) {
+        return Status::MISMATCH;
+    }
+
+    while (static_cast<size_t>(file.end() - pos) >= RECORD_HEADER_SIZE) {
+        const char* start = pos;
+        uint32_t size = get<uint32_t>(pos);
+        uint32_t checksum = get<uint32_t>(pos);
+        if ( (static_cast<size_t>(file.end() - start) < RECORD_HEADER_SIZE + size) ||
+             (_checksum(pos, RECORD_HEADER_SIZE - 8 + size) != checksum) ) {
+            pos = start;
+            break;
+        }
+
+        Record record;
+        record.op = static_cast<Op>(get<uint8_t>(pos));
+        record.shape = static_cast<SelectionShape>(get<uint8_t>(pos));
+        record.from.x = get<int32_t>(pos);
+        record.from.y = get<int32_t>(pos);
+        record.to.x = get<int32_t>(pos);
+        record.to.y = get<int32_t>(pos);
+        record.text.assign(pos, size);
+        pos += size;
+        records.push_back(std::move(record));
+    }
+    valid_size = pos - file.begin();
+    return Status::OK;
+}
+
+std::string Journal::path_for(const std::string& filepath) {
+    size_t slash = filepath.find_last_of('/');
+    size_t name = (slash == std::string::npos)? 0: slash + 1;
+    return filepath.substr(0, name) + "." + filepath.substr(name) + ".swp";
+}
+
+void Journal::_run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        auto has_work = [this] { return stopping_ || !pending_.empty(); };
+        if (dirty_) {
+            // written data is synced when the interval passes, new records are written meanwhile
+            cv_.wait_until(lock, last_sync_ + sync_interval_, has_work);
+        } else {
+            cv_.wait(lock, has_work);
+        }
+
+        std::string batch;
+        batch.swap(pending_);
+        uint64_t generation = generation_;
+        bool stopping = stopping_;
+        lock.unlock();
+
+        {
+            std::lock_guard<std::mutex> file_lock(file_mutex_);
+            // reset() which ran after the batch was taken drops it: its edits are in the saved file
+            if ( !batch.empty() && (generation == generation_) ) {
+                _write(batch);
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (dirty_ && (stopping || (now - last_sync_ >= sync_interval_))) {
+                ::fdatasync(fd_);
+                dirty_ = false;
+                last_sync_ = now;
+            }
+        }
+
+        lock.lock();
+        if (stopping && pending_.empty()) {
+            break;
+        }
+    }
+}
+
+void Journal::_stop() {
+    if ( !worker_.joinable() ) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        cv_.notify_one();
+    }
+    worker_.join();
+}
+
+bool Journal::_open() {
+    if (fd_ >= 0) {
+        return true;
+    }
+    fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (fd_ < 0) {
+        return false;
+    }
+    std::string header = _header();
+    return ::write(fd_, header.data(), header.size()) == static_cast<ssize_t>(header.size());
+}
+
+void Journal::_write(const std::string& data) {
+    if (failed_) {
+        return;
+    }
+    if ( !_open() ) {
+        Logger::instance().error("Journal: cannot create " + path_ + ": " + std::strerror(errno));
+        failed_ = true;
+        return;
+    }
+
+    const char* pos = data.data();
+    size_t left = data.size();
+    while (left) {
+        ssize_t n = ::write(fd_, pos, left);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Logger::instance().error("Journal: cannot write " + path_ + ": " + std::strerror(errno));
+            failed_ = true;
+            return;
+        }
+        pos += n;
+        left -= n;
+    }
+    dirty_ = true;
+}
+
+std::string Journal::_header() const {
+    std::string header(MAGIC, sizeof(MAGIC));
+    put<uint64_t>(header, stamp_.size);
+    put<int64_t>(header, stamp_.mtime_ns);
+    return header;
+}
+
+// FNV-1a, enough to tell a record torn by a crash from a complete one
+uint32_t Journal::_checksum(const char* data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,120 @@
+#ifndef JOURNAL_HPP_
+#define JOURNAL_HPP_
+
+#include "la.hpp"
+#include "common.hpp"
+
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <condition_variable>
+
+
+// Size and modification time of a file, identify the version of the file on the disk
+struct FileStamp {
+    uint64_t size;
+    int64_t mtime_ns;
+
+    static FileStamp of(const std::string& filepath);
+    bool operator==(const FileStamp& other) const { return (size == other.size) && (mtime_ns == other.mtime_ns); }
+};
+
+
+// Append-only journal of document edits (swap file), kept next to the edited file.
+// Edits are encoded by the caller and written in batches by a background thread,
+// the journal is synced to the disk at most once per `sync_interval_ms`. After a crash
+// the edits are read back and replayed on the file version recorded in the header.
+// Saving the file starts the journal anew.
+//
+// The journal is reset only after the saved file is complete, but a crash while a big file
+// is rewritten in place leaves the file torn after the first changed line. Such a file
+// matches no journal: edits cannot be replayed on it, so the journal is moved aside as
+// ".<name>.swp.orphaned" to keep unsaved edits for manual recovery.
+//
+// Layout: header (magic, FileStamp) followed by records
+//   u32 payload size | u32 checksum | u8 op | u8 shape | i32 x1, y1, x2, y2 | payload
+// A record torn by a crash fails the checksum, it and everything after it are dropped.
+class Journal {
+public:
+    enum class Op : uint8_t {
+        INSERT_TEXT = 1,
+        REMOVE_TEXT,
+        ADD_NEWLINE,
+        REMOVE_NEWLINE,
+    };
+
+    struct Record {
+        Op op;
+        SelectionShape shape;
+        Vec2i from;
+        Vec2i to;
+        std::string text;   // UTF-8 text of inserted lines joined by '\n'
+    };
+
+    enum class Status {
+        MISSING,
+        MISMATCH,       // journal was written for another version of the file
+        OK,
+    };
+
+    // Continues journal at `path` from `valid_size` bytes, creates a new one if it is 0
+    explicit Journal(const std::string& path, const FileStamp& stamp, size_t valid_size, int sync_interval_ms);
+    // writes pending records, the journal file is kept
+    ~Journal();
+
+    explicit Journal(const Journal&) = delete;
+    void operator=(const Journal&) = delete;
+
+    const std::string& path() const { return path_; }
+
+    void append(const Record& record);
+    // Drops all records, journal now describes edits of the file version `stamp`
+    void reset(const FileStamp& stamp);
+    // Stops writing and removes the journal file
+    void remove();
+
+    // Reads records of the journal written for the file version `stamp`,
+    // `valid_size` is set to the size of the journal without a torn tail
+    static Status read(const std::string& path, const FileStamp& stamp, std::vector<Record>& records, size_t& valid_size);
+
+    // Journal of `filepath` is the hidden file ".<name>.swp" in the same directory
+    static std::string path_for(const std::string& filepath);
+
+private:
+    void _run();
+    void _stop();
+    bool _open();
+    void _write(const std::string& data);
+    std::string _header() const;
+
+    static uint32_t _checksum(const char* data, size_t size);
+
+    static constexpr size_t HEADER_SIZE = 4 + 8 + 8;
+    static constexpr size_t RECORD_HEADER_SIZE = 4 + 4 + 1 + 1 + 4 * 4;
+
+private:
+    std::string path_;
+    FileStamp stamp_;
+    std::chrono::milliseconds sync_interval_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::string pending_;
+    bool stopping_;
+    // bumped by reset() under both mutexes: a batch taken before the reset is not written after it
+    uint64_t generation_;
+
+    // file is used by the worker and by reset(), guarded by file_mutex_
+    std::mutex file_mutex_;
+    int fd_;
+    bool failed_;
+    bool dirty_;        // written, but not synced yet
+    std::chrono::steady_clock::time_point last_sync_;
+
+    std::thread worker_;
+};
+
+#endif // JOURNAL_HPP_
@@ -0,0 +1,238 @@
+#include "line.hpp"
+
+#include "settings.hpp"
+#include "line_arena.hpp"
+
+#include <new>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+
+static constexpr size_t MIN_CAPACITY = 8;
+
+size_t Line::gap_threshold_ = static_cast<size_t>(TextSettings().gap_buffer_threshold);
+
+
+void Line::init() {
+    gap_threshold_ = static_cast<size_t>(Settings::const_instance().const_text().gap_buffer_threshold);
+}
+
+
+Line::Line()
+    : data_(nullptr), capacity_(0), gap_start_(0), gap_end_(0), in_arena_(false)
+{}
+
+Line::Line(size_t count, const Glyph& glyph) : Line() {
+    _reallocate(count);
+    std::fill(data_, data_ + count, glyph);
+    gap_start_ = static_cast<uint32_t>(count);
+}
+
+Line::Line(const_iterator first, const_iterator last) : Line() {
+    size_t count = last.index() - first.index();
+    _reallocate(count);
+    first.line()->_copy_range(data_, first.index(), last.index());
+    gap_start_ = static_cast<uint32_t>(count);
+}
+
+Line::Line(const Line& other) : Line(other.begin(), other.end()) {}
+
+Line::Line(Line&& other) noexcept
+    : data_(other.data_), capacity_(other.capacity_), gap_start_(other.gap_start_), gap_end_(other.gap_end_),
+      in_arena_(other.in_arena_)
+{
+    other.data_ = nullptr;
+    other.capacity_ = other.gap_start_ = other.gap_end_ = 0;
+    other.in_arena_ = false;
+}
+
+Line::~Line() {
+    _deallocate(data_, in_arena_);
+}
+
+Line& Line::operator=(const Line& other) {
+    if (this != &other) {
+        Line copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+Line& Line::operator=(Line&& other) noexcept {
+    if (this != &other) {
+        _deallocate(data_, in_arena_);
+        data_ = other.data_;
+        capacity_ = other.capacity_;
+        gap_start_ = other.gap_start_;
+        gap_end_ = other.gap_end_;
+        in_arena_ = other.in_arena_;
+        other.data_ = nullptr;
+        other.capacity_ = other.gap_start_ = other.gap_end_ = 0;
+        other.in_arena_ = false;
+    }
+    return *this;
+}
+
+const Glyph& Line::at(size_t i) const {
+    if (i >= size()) {
+        throw std::out_of_range("Line::at: index " + std::to_string(i) + " is out of range");
+    }
+    return (*this)[i];
+}
+
+void Line::reserve(size_t capacity) {
+    if (capacity > capacity_) {
+        _reallocate(capacity);
+    }
+}
+
+void Line::clear() {
+    gap_start_ = 0;
+    gap_end_ = capacity_;
+}
+
+void Line::resize(size_t count) {
+    size_t current = size();
+    if (count < current) {
+        erase(begin() + count, end());
+    } else if (count > current) {
+        Glyph* dst = _open_gap(current, count - current);
+        std::fill(dst, dst + count - current, Glyph());
+    }
+}
+
+void Line::push_back(const Glyph& glyph) {
+    *_open_gap(size(), 1) = glyph;
+}
+
+Line::iterator Line::insert(const_iterator pos, const Glyph& glyph) {
+    *_open_gap(pos.index(), 1) = glyph;
+    return iterator(this, pos.index());
+}
+
+Line::iterator Line::insert(const_iterator pos, const_iterator first, const_iterator last) {
+    size_t count = last.index() - first.index();
+    Glyph* dst = _open_gap(pos.index(), count);
+    first.line()->_copy_range(dst, first.index(), last.index());
+    return iterator(this, pos.index());
+}
+
+Line::iterator Line::erase(const_iterator first, const_iterator last) {
+    size_t from = first.index();
+    size_t to = last.index();
+    size_t current = size();
+    if (from == to) {
+        return iterator(this, from);
+    }
+
+    if (_is_long(current)) {
+        // removed glyphs just become a part of the gap
+        _move_gap(from);
+        gap_end_ += static_cast<uint32_t>(to - from);
+    } else {
+        _move_gap(current);
+        std::memmove(data_ + from, data_ + to, (current - to) * sizeof(Glyph));
+        gap_start_ -= static_cast<uint32_t>(to - from);
+    }
+    return iterator(this, from);
+}
+
+
+// Makes room for `count` glyphs at position `pos` and returns pointer to it
+Glyph* Line::_open_gap(size_t pos, size_t count) {
+    if (!count) {
+        return data_ + pos;
+    }
+    size_t current = size();
+    if (_gap() < count) {
+        _reallocate(std::max({MIN_CAPACITY, current + count, 2 * static_cast<size_t>(capacity_)}));
+    }
+
+    if (_is_long(current + count)) {
+        _move_gap(pos);
+        Glyph* dst = data_ + gap_start_;
+        gap_start_ += static_cast<uint32_t>(count);
+        return dst;
+    }
+
+    _move_gap(current);
+    std::memmove(data_ + pos + count, data_ + pos, (current - pos) * sizeof(Glyph));
+    gap_start_ += static_cast<uint32_t>(count);
+    return data_ + pos;
+}
+
+void Line::_move_gap(size_t pos) {
+    if (pos < gap_start_) {
+        size_t count = gap_start_ - pos;
+        std::memmove(data_ + gap_end_ - count, data_ + pos, count * sizeof(Glyph));
+        gap_start_ -= static_cast<uint32_t>(count);
+        gap_end_ -= static_cast<uint32_t>(count);
+    } else if (pos > gap_start_) {
+        size_t count = pos - gap_start_;
+        std::memmove(data_ + gap_start_, data_ + gap_end_, count * sizeof(Glyph));
+        gap_start_ += static_cast<uint32_t>(count);
+        gap_end_ += static_cast<uint32_t>(count);
+    }
+}
+
+void Line::_reallocate(size_t capacity) {
+    size_t tail = capacity_ - gap_end_;
+    bool in_arena = false;
+    Glyph* data = _allocate(capacity, in_arena);
+    if (data_) {
+        std::memcpy(data, data_, gap_start_ * sizeof(Glyph));
+        std::memcpy(data + capacity - tail, data_ + gap_end_, tail * sizeof(Glyph));
+    }
+    _deallocate(data_, in_arena_);
+
+    data_ = data;
+    in_arena_ = in_arena;
+    capacity_ = static_cast<uint32_t>(capacity);
+    gap_end_ = static_cast<uint32_t>(capacity - tail);
+}
+
+// Copies glyphs [from, to) into contiguous memory at `dst`
+void Line::_copy_range(Glyph* dst, size_t from, size_t to) const {
+    if (from >= to) {
+        return;
+    }
+    if (from < gap_start_) {
+        size_t head_end = std::min<size_t>(to, gap_start_);
+        std::memcpy(dst, data_ + from, (head_end - from) * sizeof(Glyph));
+        dst += head_end - from;
+        from = head_end;
+    }
+    if (from < to) {
+        std::memcpy(dst, data_ + from + _gap(), (to - from) * sizeof(Glyph));
+    }
+}
+
+// Size classes of the arena may round `capacity` up
+Glyph* Line::_allocate(size_t& capacity, bool& in_arena) {
+    in_arena = false;
+    if (!capacity) {
+        return nullptr;
+    }
+    LineArena* arena = LineArena::current();
+    if (arena) {
+        Glyph* data = arena->allocate(capacity);
+        if (data) {
+            in_arena = true;
+            return data;
+        }
+    }
+    return static_cast<Glyph*>(::operator new(capacity * sizeof(Glyph)));
+}
+
+void Line::_deallocate(Glyph* data, bool in_arena) {
+    if (!data) {
+        return;
+    }
+    if (in_arena) {
+        LineArena::deallocate(data);
+    } else {
+        ::operator delete(data);
+    }
+}
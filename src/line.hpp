@@ -0,0 +1,144 @@
+#ifndef LINE_HPP_
+#define LINE_HPP_
+
+#include "glyph.hpp"
+
+#include <iterator>
+#include <type_traits>
+
+
+// Line of glyphs stored as a gap buffer.
+// Lines shorter than `text.gap_buffer_threshold` glyphs keep the gap at the end,
+// so they are laid out like a plain array. Longer lines move the gap to the place
+// of editing, so series of inserts and removes around the cursor cost O(1) amortized
+// instead of moving the whole tail of the line on every keystroke.
+// Glyphs are stored in the LineArena active in the current thread, if there is one.
+class Line {
+public:
+    template<typename G, typename L>
+    class Iterator {
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef Glyph value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef G* pointer;
+        typedef G& reference;
+
+        Iterator() : line_(nullptr), index_(0) {}
+        Iterator(L* line, size_t index) : line_(line), index_(index) {}
+        operator Iterator<const Glyph, const Line>() const { return {line_, index_}; }
+
+        reference operator*() const { return (*line_)[index_]; }
+        pointer operator->() const { return &(*line_)[index_]; }
+        reference operator[](difference_type n) const { return (*line_)[index_ + n]; }
+
+        Iterator& operator++() { index_++; return *this; }
+        Iterator& operator--() { index_--; return *this; }
+        Iterator operator++(int) { Iterator it = *this; index_++; return it; }
+        Iterator operator--(int) { Iterator it = *this; index_--; return it; }
+        Iterator& operator+=(difference_type n) { index_ += n; return *this; }
+        Iterator& operator-=(difference_type n) { index_ -= n; return *this; }
+        Iterator operator+(difference_type n) const { return Iterator(line_, index_ + n); }
+        Iterator operator-(difference_type n) const { return Iterator(line_, index_ - n); }
+        friend Iterator operator+(difference_type n, const Iterator& it) { return it + n; }
+        difference_type operator-(const Iterator& it) const { return static_cast<difference_type>(index_) - static_cast<difference_type>(it.index_); }
+
+        bool operator==(const Iterator& it) const { return index_ == it.index_; }
+        bool operator!=(const Iterator& it) const { return index_ != it.index_; }
+        bool operator<(const Iterator& it) const { return index_ < it.index_; }
+        bool operator>(const Iterator& it) const { return index_ > it.index_; }
+        bool operator<=(const Iterator& it) const { return index_ <= it.index_; }
+        bool operator>=(const Iterator& it) const { return index_ >= it.index_; }
+
+        L* line() const { return line_; }
+        size_t index() const { return index_; }
+    private:
+        L* line_;
+        size_t index_;
+    };
+
+    typedef Glyph value_type;
+    typedef Iterator<Glyph, Line> iterator;
+    typedef Iterator<const Glyph, const Line> const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    // reads settings of lines, called whenever settings change
+    static void init();
+
+    Line();
+    explicit Line(size_t count, const Glyph& glyph = Glyph());
+    Line(const_iterator first, const_iterator last);
+    template<typename It, typename = typename std::iterator_traits<It>::iterator_category>
+    Line(It first, It last) : Line() { insert(end(), first, last); }
+    Line(iterator first, iterator last) : Line(const_iterator(first), const_iterator(last)) {}
+    Line(const Line& other);
+    Line(Line&& other) noexcept;
+    ~Line();
+
+    Line& operator=(const Line& other);
+    Line& operator=(Line&& other) noexcept;
+
+    size_t size() const { return capacity_ - _gap(); }
+    bool empty() const { return size() == 0; }
+    size_t capacity() const { return capacity_; }
+
+    const Glyph& operator[](size_t i) const { return data_[(i < gap_start_)? i: i + _gap()]; }
+    Glyph& operator[](size_t i) { return data_[(i < gap_start_)? i: i + _gap()]; }
+    const Glyph& at(size_t i) const;
+    const Glyph& front() const { return (*this)[0]; }
+    const Glyph& back() const { return (*this)[size() - 1]; }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, size()); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, size()); }
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+    void reserve(size_t capacity);
+    void clear();
+    void resize(size_t count);
+    void push_back(const Glyph& glyph);
+    // appends `count` uninitialized glyphs and returns pointer to the first of them
+    Glyph* extend(size_t count) { return _open_gap(size(), count); }
+
+    iterator insert(const_iterator pos, const Glyph& glyph);
+    iterator insert(const_iterator pos, const_iterator first, const_iterator last);
+    iterator insert(const_iterator pos, iterator first, iterator last) { return insert(pos, const_iterator(first), const_iterator(last)); }
+    template<typename It, typename = typename std::iterator_traits<It>::iterator_category>
+    iterator insert(const_iterator pos, It first, It last) {
+        size_t count = static_cast<size_t>(std::distance(first, last));
+        Glyph* dst = _open_gap(pos.index(), count);
+        std::copy(first, last, dst);
+        return iterator(this, pos.index());
+    }
+
+    iterator erase(const_iterator first, const_iterator last);
+
+private:
+    size_t _gap() const { return gap_end_ - gap_start_; }
+    static bool _is_long(size_t size) { return size >= gap_threshold_; }
+
+    Glyph* _open_gap(size_t pos, size_t count);
+    void _move_gap(size_t pos);
+    void _reallocate(size_t capacity);
+    void _copy_range(Glyph* dst, size_t from, size_t to) const;
+
+    static Glyph* _allocate(size_t& capacity, bool& in_arena);
+    static void _deallocate(Glyph* data, bool in_arena);
+
+private:
+    Glyph* data_;
+    uint32_t capacity_;
+    uint32_t gap_start_;
+    uint32_t gap_end_;
+    bool in_arena_;     // data_ is a block of LineArena, not of the heap
+
+    // copy of `text.gap_buffer_threshold`, lines check it on every edit
+    static size_t gap_threshold_;
+};
+
+#endif // LINE_HPP_
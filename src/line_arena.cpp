@@ -0,0 +1,170 @@
+#include "line_arena.hpp"
+
+#include "logger.hpp"
+
+#include <cstddef>
+#include <cstdlib>
+#include <cassert>
+
+
+// capacities of size classes in glyphs: 4, 6, 8, 12, 16, 24, ... 768, 1024
+static const std::vector<size_t> class_capacities = [] {
+    std::vector<size_t> capacities;
+    for (size_t c = 4; c <= LineArena::MAX_CLASS_GLYPHS; c *= 2) {
+        capacities.push_back(c);
+        if (c + c / 2 < LineArena::MAX_CLASS_GLYPHS) {
+            capacities.push_back(c + c / 2);
+        }
+    }
+    return capacities;
+}();
+
+static thread_local LineArena* current_arena = nullptr;
+
+
+// Header placed at the beginning of every slab
+struct LineArena::Slab {
+    size_t size_class;
+    size_t offset;                      // blocks before this offset were already cut
+    std::atomic<FreeBlock*> freed;      // blocks freed since they were last collected
+    std::atomic<size_t> refs;           // number of allocated blocks, plus one while the arena lives
+};
+
+static constexpr size_t HEADER_SIZE = 64;
+static_assert(HEADER_SIZE >= sizeof(std::max_align_t), "Slab header should keep blocks aligned");
+
+
+LineArena::LineArena()
+    : current_(class_capacities.size(), nullptr),
+      free_(class_capacities.size(), nullptr),
+      reserved_(0)
+{}
+
+LineArena::~LineArena() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (Slab* slab: slabs_) {
+        _release(slab);
+    }
+}
+
+Glyph* LineArena::allocate(size_t& capacity) {
+    static_assert(HEADER_SIZE >= sizeof(Slab), "Slab header does not fit");
+
+    if (capacity > MAX_CLASS_GLYPHS) {
+        return nullptr;
+    }
+    size_t size_class = _size_class(capacity);
+    size_t block_size = class_capacities[size_class] * sizeof(Glyph);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // blocks of the current slab are reused first, blocks of other slabs once it is full
+    Slab* slab = current_[size_class];
+    if (!free_[size_class]) {
+        _collect(size_class, false);
+    }
+    if (!free_[size_class] && (!slab || (slab->offset + block_size > SLAB_SIZE))) {
+        _collect(size_class, true);
+    }
+
+    Glyph* data = nullptr;
+    if (free_[size_class]) {
+        FreeBlock* block = free_[size_class];
+        free_[size_class] = block->next;
+        data = reinterpret_cast<Glyph*>(block);
+        slab = reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(data) & ~(SLAB_SIZE - 1));
+    } else {
+        if (!slab || (slab->offset + block_size > SLAB_SIZE)) {
+            void* memory = std::aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+            if (!memory) {
+                Logger::instance().error("LineArena: cannot allocate slab");
+                return nullptr;
+            }
+            slab = new (memory) Slab{size_class, HEADER_SIZE, {nullptr}, {1}};
+            slabs_.push_back(slab);
+            current_[size_class] = slab;
+            reserved_.fetch_add(SLAB_SIZE, std::memory_order_relaxed);
+        }
+        data = reinterpret_cast<Glyph*>(reinterpret_cast<char*>(slab) + slab->offset);
+        slab->offset += block_size;
+    }
+
+    slab->refs.fetch_add(1, std::memory_order_relaxed);
+    capacity = class_capacities[size_class];
+    return data;
+}
+
+void LineArena::deallocate(Glyph* data) {
+    Slab* slab = reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(data) & ~(SLAB_SIZE - 1));
+    FreeBlock* block = reinterpret_cast<FreeBlock*>(data);
+    block->next = slab->freed.load(std::memory_order_relaxed);
+    while (!slab->freed.compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    _release(slab);
+}
+
+size_t LineArena::used() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t used = 0;
+    for (const Slab* slab: slabs_) {
+        used += (slab->refs.load(std::memory_order_relaxed) - 1) * class_capacities[slab->size_class] * sizeof(Glyph);
+    }
+    return used;
+}
+
+LineArena* LineArena::current() {
+    return current_arena;
+}
+
+// Drops one reference to the slab, the last one releases its memory
+void LineArena::_release(Slab* slab) {
+    if (slab->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        slab->~Slab();
+        std::free(slab);
+    }
+}
+
+// Moves blocks freed by lines to the free list of the size class, either from the current
+// slab only or from all slabs of the class. Called under the lock.
+void LineArena::_collect(size_t size_class, bool all_slabs) {
+    auto collect = [this, size_class](Slab* slab) {
+        FreeBlock* block = slab->freed.exchange(nullptr, std::memory_order_acquire);
+        while (block) {
+            FreeBlock* next = block->next;
+            block->next = free_[size_class];
+            free_[size_class] = block;
+            block = next;
+        }
+    };
+
+    if (!all_slabs) {
+        if (current_[size_class]) {
+            collect(current_[size_class]);
+        }
+        return;
+    }
+    for (Slab* slab: slabs_) {
+        if (slab->size_class == size_class) {
+            collect(slab);
+        }
+    }
+}
+
+size_t LineArena::_size_class(size_t capacity) {
+    size_t size_class = 0;
+    while (class_capacities[size_class] < capacity) {
+        size_class++;
+    }
+    return size_class;
+}
+
+
+LineArena::Scope::Scope(LineArena& arena)
+    : previous_(current_arena)
+{
+    current_arena = &arena;
+}
+
+LineArena::Scope::~Scope() {
+    current_arena = previous_;
+}
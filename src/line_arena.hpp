@@ -0,0 +1,74 @@
+#ifndef LINE_ARENA_HPP_
+#define LINE_ARENA_HPP_
+
+#include "glyph.hpp"
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+
+// Slab allocator for glyph storage of lines.
+// Memory is taken from the system in big aligned slabs, every slab is cut into
+// blocks of one size class. All slabs are released at once when the arena is destroyed,
+// so closing a document does not return millions of small blocks to the heap.
+//
+// Lines allocate from the arena which is active in the current thread (see Scope).
+// Freeing a block neither locks nor touches the arena: the block is pushed to a lock-free
+// list of its slab, found by the block address, and the allocating thread takes such lists
+// back in bulk. Every slab counts its live blocks plus one reference held by the arena,
+// so lines may outlive their arena: a slab is released by whoever drops the last reference.
+class LineArena {
+public:
+    explicit LineArena();
+    ~LineArena();
+
+    explicit LineArena(const LineArena&) = delete;
+    void operator=(const LineArena&) = delete;
+
+    // Returns block for at least `capacity` glyphs and updates `capacity` to the real
+    // block capacity, or nullptr if the requested capacity is too big for size classes
+    Glyph* allocate(size_t& capacity);
+    static void deallocate(Glyph* data);
+
+    size_t reserved() const { return reserved_.load(std::memory_order_relaxed); }
+    size_t used() const;
+
+    // Arena used by lines allocated in this thread
+    static LineArena* current();
+
+    // Makes `arena` current in this thread until the scope is left
+    class Scope {
+    public:
+        explicit Scope(LineArena& arena);
+        ~Scope();
+
+        explicit Scope(const Scope&) = delete;
+        void operator=(const Scope&) = delete;
+    private:
+        LineArena* previous_;
+    };
+
+    static constexpr size_t SLAB_SIZE = 256 * 1024;
+    static constexpr size_t MAX_CLASS_GLYPHS = 1024;
+
+private:
+    struct Slab;
+    struct FreeBlock { FreeBlock* next; };
+
+    static size_t _size_class(size_t capacity);
+    static void _release(Slab* slab);
+    void _collect(size_t size_class, bool all_slabs);
+
+private:
+    mutable std::mutex mutex_;
+
+    std::vector<Slab*> slabs_;
+    std::vector<Slab*> current_;        // slab blocks are cut from, per size class
+    std::vector<FreeBlock*> free_;      // free lists, per size class
+
+    std::atomic<size_t> reserved_;
+};
+
+#endif // LINE_ARENA_HPP_
@@ -1,9 +1,11 @@
 #include "mainwindow.hpp"
 
+#include "line.hpp"
 #include "settings.hpp"
 
 #include <SDL2/SDL.h>
 
+#include <string>
 #include <iostream>
 
 
@@ -14,6 +16,7 @@ const int SCREEN_HEIGHT = 480;
 int main(int argc, const char* argv[]) {
     Settings::instance().init("editor.conf");
     Logger::instance().init();
+    Line::init();
 
     init_sdl();
     init_libconfig();
@@ -24,10 +27,16 @@ int main(int argc, const char* argv[]) {
         Logger::instance().critical("Cannot initialize main window");
     }
 
+    // `cmd | editor - [save path]` shows the output of the command while it runs
     const char* filepath = nullptr;
+    const char* save_path = nullptr;
     if (argc == 2)
         filepath = argv[1];
+    if ((argc == 3) && (std::string(argv[1]) == "-")) {
+        filepath = argv[1];
+        save_path = argv[2];
+    }
 
-    window.open_file(filepath);
+    window.open_file(filepath, save_path);
     window.show();
 }
@@ -146,16 +146,35 @@ void MainWindow::show() {
                                 editor_.log_debug_history();
                             break;
                         }
-                        case SDLK_z: {
+                        case SDLK_t: {
+                            if (control_down)
+                                editor_.toggle_following();
+                            break;
+                        }
+                        case SDLK_r: {
                             if (control_down)
+                                editor_.filter_selection();
+                            break;
+                        }
+                        case SDLK_z: {
+                            if (control_down && Keyboard::shift_pressed())
+                                editor_.handle_time_travel(false);
+                            else if (control_down)
                                 editor_.handle_undo();
                             break;
                         }
                         case SDLK_y: {
-                            if (control_down)
+                            if (control_down && Keyboard::shift_pressed())
+                                editor_.handle_time_travel(true);
+                            else if (control_down)
                                 editor_.handle_redo();
                             break;
                         }
+                        case SDLK_b: {
+                            if (control_down)
+                                editor_.handle_switch_branch();
+                            break;
+                        }
                         case SDLK_RIGHT: case SDLK_LEFT: case SDLK_UP: case SDLK_DOWN: {
                             editor_.handle_keyboard_move_pressed();
                             break;
@@ -192,6 +211,10 @@ void MainWindow::show() {
                             editor_.handle_pagedown_pressed();
                             break;
                         }
+                        case SDLK_ESCAPE: {
+                            editor_.cancel_loading();
+                            break;
+                        }
                     }
                     break;
                 }
@@ -238,9 +261,12 @@ void MainWindow::show() {
 }
 
 
-void MainWindow::open_file(const char* filepath) {
+void MainWindow::open_file(const char* filepath, const char* save_path) {
     std::string title = "Editor";
-    if ( filepath ) {
+    if ( filepath && (std::string(filepath) == "-") ) {
+        editor_.read_stdin(save_path);
+        title += " | stdin > " + editor_.filepath();
+    } else if ( filepath ) {
         editor_.load_from_file(filepath);
         title += " | " + editor_.filepath();
     }
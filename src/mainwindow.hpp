@@ -19,7 +19,8 @@ public:
     bool init();
     void show();
 
-    void open_file(const char* filepath);
+    // "-" reads the standard input, which is saved to `save_path`
+    void open_file(const char* filepath, const char* save_path = nullptr);
     void save_file();
 
     void set_title(const std::string& title);
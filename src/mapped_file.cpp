@@ -0,0 +1,82 @@
+#include "mapped_file.hpp"
+
+#include "logger.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+
+MappedFile::MappedFile(const std::string& filepath)
+    : data_(nullptr), size_(0), mapped_(false), opened_(false)
+{
+    int fd = ::open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        Logger::instance().error("MappedFile: cannot open " + filepath + ": " + std::strerror(errno));
+        return;
+    }
+
+    struct stat st;
+    if ((::fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+        void* data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            // lines are parsed front to back exactly once
+            ::madvise(data, st.st_size, MADV_SEQUENTIAL);
+            data_ = static_cast<const char*>(data);
+            size_ = static_cast<size_t>(st.st_size);
+            mapped_ = true;
+            opened_ = true;
+        }
+    }
+
+    if (!mapped_) {
+        opened_ = _read(fd);
+        if (!opened_) {
+            Logger::instance().error("MappedFile: cannot read " + filepath + ": " + std::strerror(errno));
+        }
+    }
+    ::close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (mapped_) {
+        ::munmap(const_cast<char*>(data_), size_);
+    }
+}
+
+uint64_t MappedFile::sample_hash() const {
+    uint64_t hash = fnv1a(nullptr, 0);
+    size_t block = std::min(SAMPLE_SIZE, size_);
+    for (size_t i = 0; i < SAMPLE_BLOCKS; i++) {
+        hash = fnv1a(data_ + (size_ - block) / (SAMPLE_BLOCKS - 1) * i, block, hash);
+    }
+    return hash;
+}
+
+bool MappedFile::_read(int fd) {
+    const size_t chunk = 1 << 20;
+    size_t total = 0;
+    while (true) {
+        buffer_.resize(total + chunk);
+        ssize_t n = ::read(fd, buffer_.data() + total, chunk);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += static_cast<size_t>(n);
+    }
+    buffer_.resize(total);
+    data_ = buffer_.data();
+    size_ = total;
+    return true;
+}
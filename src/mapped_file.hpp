@@ -0,0 +1,55 @@
+#ifndef MAPPED_FILE_HPP_
+#define MAPPED_FILE_HPP_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+
+// FNV-1a hash of `size` bytes, `hash` continues the hash of the data before them
+inline uint64_t fnv1a(const char* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+    }
+    return hash;
+}
+
+
+// Read-only view of the whole file contents.
+// Regular files are mapped into memory, files which cannot be mapped (pipes,
+// character devices) are read into a buffer instead.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filepath);
+    ~MappedFile();
+
+    explicit MappedFile(const MappedFile&) = delete;
+    void operator=(const MappedFile&) = delete;
+
+    bool is_open() const { return opened_; }
+    bool is_mapped() const { return mapped_; }
+
+    const char* begin() const { return data_; }
+    const char* end() const { return data_ + size_; }
+    size_t size() const { return size_; }
+
+    // Hash of SAMPLE_BLOCKS blocks spread evenly over the file, the first and the last ones
+    // included. It tells apart versions of the file which have the same size and modification time.
+    uint64_t sample_hash() const;
+
+    static constexpr size_t SAMPLE_BLOCKS = 16;
+    static constexpr size_t SAMPLE_SIZE = 4096;
+
+private:
+    bool _read(int fd);
+
+private:
+    const char* data_;
+    size_t size_;
+    bool mapped_;
+    bool opened_;
+    std::vector<char> buffer_;
+};
+
+#endif // MAPPED_FILE_HPP_
@@ -0,0 +1,296 @@
+#include "paged_file.hpp"
+
+#include "file_writer.hpp"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+
+static const char INDEX_MAGIC[4] = {'E', 'D', 'X', '1'};
+
+
+PagedFile::PagedFile(const std::string& filepath, size_t cache_size, const std::string& index_dir, parse_t parse)
+    : filepath_(filepath), file_(filepath), stamp_(FileStamp::of(filepath)), parse_(parse), cache_size_(cache_size),
+      total_lines_(0), index_loaded_(false), cached_bytes_(0), stopping_(false)
+{
+    if ( !file_.is_open() ) {
+        return;
+    }
+
+    // file changed while it was being opened has no valid index to save or load
+    std::string index_path = (index_dir.empty() || (stamp_.size != file_.size()))? std::string(): _index_path(index_dir);
+    index_loaded_ = !index_path.empty() && _load_index(index_path);
+    if ( !index_loaded_ ) {
+        _build_index();
+        if ( !index_path.empty() ) {
+            _save_index(index_dir, index_path);
+        }
+    }
+    worker_ = std::thread(&PagedFile::_run, this);
+}
+
+PagedFile::~PagedFile() {
+    stop();
+}
+
+void PagedFile::stop() {
+    if (worker_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+            cv_.notify_one();
+        }
+        worker_.join();
+    }
+}
+
+const line_t& PagedFile::line(size_t row) {
+    return _page(row / PAGE_LINES).lines[row % PAGE_LINES];
+}
+
+size_t PagedFile::glyphs(size_t start, size_t count) const {
+    size_t glyphs = 0;
+    for (size_t row = start; row < start + count; ) {
+        size_t page = row / PAGE_LINES;
+        size_t page_end = std::min((page + 1) * PAGE_LINES, start + count);
+        size_t page_lines = std::min(PAGE_LINES, total_lines_ - page * PAGE_LINES);
+        glyphs += pages_[page].bytes * (page_end - row) / page_lines;
+        row = page_end;
+    }
+    return glyphs;
+}
+
+size_t PagedFile::max_width(size_t start, size_t count) const {
+    if (count == 0) {
+        return 0;
+    }
+    size_t width = 0;
+    for (size_t page = start / PAGE_LINES; page <= (start + count - 1) / PAGE_LINES; page++) {
+        width = std::max<size_t>(width, pages_[page].max_line_bytes);
+    }
+    return width;
+}
+
+void PagedFile::prefetch(size_t start, size_t count) {
+    if ( (count == 0) || !worker_.joinable() ) {
+        return;
+    }
+
+    size_t first = start / PAGE_LINES;
+    size_t last = std::min({(start + count - 1) / PAGE_LINES, first + MAX_PREFETCH_PAGES - 1, pages_.size() - 1});
+
+    // earlier requests are outdated by the new one
+    std::lock_guard<std::mutex> lock(mutex_);
+    requested_.clear();
+    for (auto it = prefetched_.begin(); it != prefetched_.end(); ) {
+        if ((it->first < first) || (it->first > last)) {
+            it = prefetched_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (size_t page = first; page <= last; page++) {
+        if ( !cache_.count(page) && !prefetched_.count(page) ) {
+            requested_.push_back(page);
+        }
+    }
+    cv_.notify_one();
+}
+
+// Single pass over the file: lines are found with memchr, nothing is decoded
+void PagedFile::_build_index() {
+    const char* begin = file_.begin();
+    const char* stop = file_.end();
+    // newline at the end of the file does not start a new line
+    if ((stop != begin) && (*(stop - 1) == '\n')) {
+        stop--;
+    }
+
+    const char* pos = begin;
+    PageInfo page = {0, 0, 0};
+    size_t page_lines = 0;
+    while (true) {
+        const char* eol = static_cast<const char*>(std::memchr(pos, '\n', stop - pos));
+        const char* line_end = eol? eol: stop;
+        page.max_line_bytes = std::max<uint32_t>(page.max_line_bytes, static_cast<uint32_t>(line_end - pos));
+        page_lines++;
+        total_lines_++;
+
+        if ((page_lines == PAGE_LINES) || !eol) {
+            page.bytes = line_end - (begin + page.offset);
+            pages_.push_back(page);
+            page = {static_cast<uint64_t>(line_end + 1 - begin), 0, 0};
+            page_lines = 0;
+        }
+        if (!eol) {
+            break;
+        }
+        pos = eol + 1;
+    }
+}
+
+std::string PagedFile::default_index_dir() {
+    const char* cache = std::getenv("XDG_CACHE_HOME");
+    if (cache && *cache) {
+        return std::string(cache) + "/editor";
+    }
+    const char* home = std::getenv("HOME");
+    if (home && *home) {
+        return std::string(home) + "/.cache/editor";
+    }
+    return std::string();
+}
+
+// Index of a file is named after the hash of its absolute path
+std::string PagedFile::_index_path(const std::string& index_dir) const {
+    char resolved[PATH_MAX];
+    std::string path = ::realpath(filepath_.c_str(), resolved)? resolved: filepath_;
+
+    uint64_t hash = fnv1a(path.data(), path.size());
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.idx", static_cast<unsigned long long>(hash));
+    return index_dir + "/" + name;
+}
+
+PagedFile::IndexHeader PagedFile::_index_header() const {
+    IndexHeader header;
+    std::memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.page_lines = static_cast<uint32_t>(PAGE_LINES);
+    header.file_size = file_.size();
+    header.mtime_ns = stamp_.mtime_ns;
+
+    // catches files rewritten within the same second and with the same size
+    header.sample_hash = file_.sample_hash();
+    header.total_lines = total_lines_;
+    header.pages = pages_.size();
+    return header;
+}
+
+bool PagedFile::_load_index(const std::string& path) {
+    if (::access(path.c_str(), R_OK) != 0) {
+        return false;
+    }
+    MappedFile index(path);
+    if ( !index.is_open() || (index.size() < sizeof(IndexHeader)) ) {
+        return false;
+    }
+
+    IndexHeader expected = _index_header();
+    IndexHeader header;
+    std::memcpy(&header, index.begin(), sizeof(header));
+    if ( (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0) ||
+         (header.page_lines != expected.page_lines) || (header.file_size != expected.file_size) ||
+         (header.mtime_ns != expected.mtime_ns) || (header.sample_hash != expected.sample_hash) ) {
+        return false;
+    }
+    if ( (header.pages == 0) || (index.size() != sizeof(header) + header.pages * sizeof(PageInfo)) ||
+         (header.total_lines > header.pages * PAGE_LINES) || (header.total_lines <= (header.pages - 1) * PAGE_LINES) ) {
+        return false;
+    }
+
+    pages_.resize(header.pages);
+    std::memcpy(pages_.data(), index.begin() + sizeof(header), header.pages * sizeof(PageInfo));
+    // pages follow each other separated by a newline, every one of them lies within the file
+    uint64_t offset = 0;
+    for (const PageInfo& page: pages_) {
+        if ( (page.offset != offset) || (page.offset > file_.size()) || (page.bytes > file_.size() - page.offset) ||
+             (page.max_line_bytes > page.bytes) ) {
+            pages_.clear();
+            return false;
+        }
+        offset = page.offset + page.bytes + 1;
+    }
+    total_lines_ = header.total_lines;
+    return true;
+}
+
+void PagedFile::_save_index(const std::string& index_dir, const std::string& path) const {
+    // only the user may read the indices
+    FileWriter::create_dirs(index_dir);
+
+    IndexHeader header = _index_header();
+    FileWriter out(path);
+    if ( !out.is_open() ) {
+        return;
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(pages_.data()), pages_.size() * sizeof(PageInfo));
+    out.commit();
+}
+
+content_t PagedFile::_decode(size_t page) const {
+    const char* start = file_.begin() + pages_[page].offset;
+    return parse_(start, start + pages_[page].bytes);
+}
+
+PagedFile::Page& PagedFile::_page(size_t page) {
+    auto it = cache_.find(page);
+    if (it != cache_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second.lru);
+        return it->second;
+    }
+
+    content_t lines;
+    bool prefetched = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto ready = prefetched_.find(page);
+        if (ready != prefetched_.end()) {
+            lines = std::move(ready->second);
+            prefetched_.erase(ready);
+            prefetched = true;
+        } else {
+            requested_.erase(std::remove(requested_.begin(), requested_.end(), page), requested_.end());
+        }
+    }
+    if (!prefetched) {
+        lines = _decode(page);
+    }
+
+    size_t memory = lines.capacity() * sizeof(line_t);
+    for (const line_t& line: lines) {
+        memory += line.capacity() * sizeof(Glyph);
+    }
+    lru_.push_front(page);
+    Page& cached = cache_[page];
+    cached.lines = std::move(lines);
+    cached.memory = memory;
+    cached.lru = lru_.begin();
+    cached_bytes_ += memory;
+
+    _evict();
+    return cached;
+}
+
+// Least recently used pages are dropped while the cache is over the budget
+void PagedFile::_evict() {
+    while ((cached_bytes_ > cache_size_) && (cache_.size() > MIN_PAGES)) {
+        size_t page = lru_.back();
+        lru_.pop_back();
+        auto it = cache_.find(page);
+        cached_bytes_ -= it->second.memory;
+        cache_.erase(it);
+    }
+}
+
+void PagedFile::_run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this] { return stopping_ || !requested_.empty(); });
+        if (stopping_) {
+            break;
+        }
+        size_t page = requested_.front();
+        requested_.pop_front();
+
+        lock.unlock();
+        content_t lines = _decode(page);
+        lock.lock();
+        prefetched_[page] = std::move(lines);
+    }
+}
@@ -0,0 +1,135 @@
+#ifndef PAGED_FILE_HPP_
+#define PAGED_FILE_HPP_
+
+#include "journal.hpp"
+#include "mapped_file.hpp"
+#include "piece_table.hpp"
+
+#include <list>
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <condition_variable>
+
+
+// Read-mostly view of a big file, lines are decoded page by page on demand.
+// For the whole file only a sparse index is kept: byte offset, size and the longest
+// line of every page of PAGE_LINES lines. Decoded pages are kept in an LRU cache limited
+// by `cache_size` bytes, so memory use does not depend on the file size. Pages which are
+// going to be shown soon are decoded ahead on a background thread, see prefetch();
+// at most MAX_PREFETCH_PAGES such pages wait to be used besides the cache.
+//
+// Reference returned by line() stays valid until its page is evicted. The cache always
+// keeps at least MIN_PAGES pages used last, so lines taken one after another may be used
+// together, but references must not be kept for long.
+//
+// Building the index reads the whole file, so the index is saved to `index_dir` and
+// loaded from there when the same file is opened again. Saved index is used only if size,
+// modification time and MappedFile::sample_hash() of the file are the same.
+class PagedFile {
+public:
+    typedef std::function<content_t(const char* start, const char* stop)> parse_t;
+
+    // index is not saved if `index_dir` is empty
+    explicit PagedFile(const std::string& filepath, size_t cache_size, const std::string& index_dir, parse_t parse);
+    ~PagedFile();
+
+    explicit PagedFile(const PagedFile&) = delete;
+    void operator=(const PagedFile&) = delete;
+
+    bool is_open() const { return file_.is_open(); }
+
+    size_t size() const { return total_lines_; }
+    uint64_t file_size() const { return file_.size(); }
+    const line_t& line(size_t row);
+
+    // Widths are not known until lines are decoded, these are estimates based on byte
+    // sizes of the lines; max_width() never underestimates
+    size_t glyphs(size_t start, size_t count) const;
+    size_t max_width(size_t start, size_t count) const;
+
+    // Decodes pages of lines [start, start + count) on the background thread
+    void prefetch(size_t start, size_t count);
+    // Stops the background thread, pages are decoded only on demand after that
+    void stop();
+
+    size_t pages() const { return pages_.size(); }
+    // index was loaded from the index directory, not built
+    bool index_loaded() const { return index_loaded_; }
+    uint64_t page_offset(size_t page) const { return pages_[page].offset; }
+    size_t cached_pages() const { return cache_.size(); }
+    size_t cached_bytes() const { return cached_bytes_; }
+
+    static constexpr size_t PAGE_LINES = 4096;
+    static constexpr size_t MIN_PAGES = 4;
+    static constexpr size_t MAX_PREFETCH_PAGES = 8;
+
+    // $XDG_CACHE_HOME/editor or ~/.cache/editor
+    static std::string default_index_dir();
+
+private:
+    struct PageInfo {
+        uint64_t offset;
+        uint64_t bytes;             // size of the lines without the last newline
+        uint32_t max_line_bytes;
+    };
+
+    // Saved index is this header followed by the array of PageInfo as they are laid out
+    // in memory, so the file may be used mapped as it is
+    struct IndexHeader {
+        char magic[4];
+        uint32_t page_lines;
+        uint64_t file_size;
+        int64_t mtime_ns;
+        uint64_t sample_hash;
+        uint64_t total_lines;
+        uint64_t pages;
+    };
+    static_assert(sizeof(IndexHeader) == 48, "index header should have no padding");
+    static_assert(sizeof(PageInfo) == 24, "page info should be 8-byte aligned");
+
+    struct Page {
+        content_t lines;
+        size_t memory;
+        std::list<size_t>::iterator lru;
+    };
+
+    void _build_index();
+    std::string _index_path(const std::string& index_dir) const;
+    IndexHeader _index_header() const;
+    bool _load_index(const std::string& path);
+    void _save_index(const std::string& index_dir, const std::string& path) const;
+    content_t _decode(size_t page) const;
+    Page& _page(size_t page);
+    void _evict();
+    void _run();
+
+private:
+    std::string filepath_;
+    MappedFile file_;
+    FileStamp stamp_;
+    parse_t parse_;
+    size_t cache_size_;
+
+    std::vector<PageInfo> pages_;
+    size_t total_lines_;
+    bool index_loaded_;
+
+    // used only by the owner thread
+    std::unordered_map<size_t, Page> cache_;
+    std::list<size_t> lru_;         // most recently used page first
+    size_t cached_bytes_;
+
+    // pages requested for prefetching and decoded by the worker
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<size_t> requested_;
+    std::unordered_map<size_t, content_t> prefetched_;
+    bool stopping_;
+    std::thread worker_;
+};
+
+#endif // PAGED_FILE_HPP_
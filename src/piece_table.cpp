@@ -0,0 +1,597 @@
+#include "piece_table.hpp"
+
+#include "paged_file.hpp"
+
+#include <array>
+#include <cassert>
+#include <unordered_map>
+
+
+struct PieceTable::Node {
+    Piece piece;
+    size_t piece_glyphs;    // number of glyphs in lines of this piece
+    size_t piece_width;     // maximal width of lines of this piece
+
+    size_t lines;       // total number of lines in subtree
+    size_t pieces;      // total number of pieces in subtree
+    size_t glyphs;      // total number of glyphs in subtree
+    size_t width;       // maximal line width in subtree
+    uint32_t priority;
+    pNode_t left;
+    pNode_t right;
+};
+
+// xorshift32 is enough to keep treap balanced
+static uint32_t random_priority() {
+    static thread_local uint32_t state = 2463534242u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+
+LineBuffer::LineBuffer()
+    : sealed_(false), shared_(0), dead_(0), glyph_prefix_(1, 0)
+{}
+
+LineBuffer::LineBuffer(content_t&& content)
+    : lines_(std::make_move_iterator(content.begin()), std::make_move_iterator(content.end())),
+      sealed_(true), shared_(lines_.size()), dead_(0)
+{
+    _build_index();
+}
+
+LineBuffer::LineBuffer(std::shared_ptr<PagedFile> paged)
+    : sealed_(true), shared_(0), dead_(0), paged_(paged), glyph_prefix_(1, 0)
+{}
+
+void LineBuffer::prefetch(size_t start, size_t count) const {
+    if (paged_) {
+        paged_->prefetch(start, count);
+    }
+}
+
+size_t LineBuffer::_paged_size() const {
+    return paged_->size();
+}
+
+const line_t& LineBuffer::_paged_line(size_t index) const {
+    return paged_->line(index);
+}
+
+size_t LineBuffer::append(line_t&& line) {
+    lines_.push_back(std::move(line));
+    _index_last_line();
+    sealed_ = false;
+    return lines_.size() - 1;
+}
+
+void LineBuffer::update_tail() {
+    assert(tail_editable());
+    glyph_prefix_.back() = glyph_prefix_[lines_.size() - 1] + lines_.back().size();
+    _index_last_block();
+}
+
+size_t LineBuffer::glyphs(size_t start, size_t count) const {
+    if (paged_) {
+        return paged_->glyphs(start, count);
+    }
+    return glyph_prefix_[start + count] - glyph_prefix_[start];
+}
+
+size_t LineBuffer::max_width(size_t start, size_t count) const {
+    if (!count) {
+        return 0;
+    }
+    if (paged_) {
+        return paged_->max_width(start, count);
+    }
+
+    size_t last = start + count - 1;
+    size_t first_block = start / BLOCK_SIZE;
+    size_t last_block = last / BLOCK_SIZE;
+
+    size_t width = 0;
+    if (last_block - first_block < 2) {
+        for (size_t i = start; i <= last; i++) {
+            width = std::max(width, _width(i));
+        }
+        return width;
+    }
+
+    // partial blocks at both ends are scanned, full blocks in between are taken from the table
+    for (size_t i = start; i < (first_block + 1) * BLOCK_SIZE; i++) {
+        width = std::max(width, _width(i));
+    }
+    for (size_t i = last_block * BLOCK_SIZE; i <= last; i++) {
+        width = std::max(width, _width(i));
+    }
+    return std::max(width, _blocks_max(first_block + 1, last_block - 1));
+}
+
+size_t LineBuffer::_blocks_max(size_t first, size_t last) const {
+    size_t level = 0;
+    while ((size_t(2) << level) <= last - first + 1) {
+        level++;
+    }
+    const std::vector<uint32_t>& row = block_max_[level];
+    return std::max(row[first], row[last + 1 - (size_t(1) << level)]);
+}
+
+void LineBuffer::_build_index() {
+    glyph_prefix_.assign(1, 0);
+    glyph_prefix_.reserve(lines_.size() + 1);
+    for (const line_t& line: lines_) {
+        glyph_prefix_.push_back(glyph_prefix_.back() + line.size());
+    }
+
+    size_t blocks = (lines_.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    block_max_.assign(1, std::vector<uint32_t>(blocks, 0));
+    for (size_t i = 0; i < lines_.size(); i++) {
+        uint32_t& block = block_max_[0][i / BLOCK_SIZE];
+        block = std::max(block, static_cast<uint32_t>(_width(i)));
+    }
+    for (size_t level = 1; (size_t(1) << level) <= blocks; level++) {
+        const std::vector<uint32_t>& prev = block_max_[level - 1];
+        size_t half = size_t(1) << (level - 1);
+        std::vector<uint32_t> row(blocks - 2 * half + 1);
+        for (size_t b = 0; b < row.size(); b++) {
+            row[b] = std::max(prev[b], prev[b + half]);
+        }
+        block_max_.push_back(std::move(row));
+    }
+}
+
+void LineBuffer::_index_last_line() {
+    glyph_prefix_.push_back(glyph_prefix_.back() + lines_.back().size());
+    _index_last_block();
+}
+
+// Only the last block changes when the last line is appended or edited, so exactly
+// one entry on every level of the sparse table has to be updated.
+void LineBuffer::_index_last_block() {
+    size_t block = (lines_.size() - 1) / BLOCK_SIZE;
+
+    // width of the edited line may decrease, so the whole block is scanned
+    uint32_t width = 0;
+    for (size_t i = block * BLOCK_SIZE; i < lines_.size(); i++) {
+        width = std::max(width, static_cast<uint32_t>(_width(i)));
+    }
+    if (block_max_.empty()) {
+        block_max_.emplace_back();
+    }
+    if (block == block_max_[0].size()) {
+        block_max_[0].push_back(width);
+    } else {
+        block_max_[0][block] = width;
+    }
+
+    for (size_t level = 1; (size_t(1) << level) <= block + 1; level++) {
+        if (level == block_max_.size()) {
+            block_max_.emplace_back();
+        }
+        const std::vector<uint32_t>& prev = block_max_[level - 1];
+        std::vector<uint32_t>& row = block_max_[level];
+        size_t half = size_t(1) << (level - 1);
+        size_t b = block + 1 - 2 * half;
+        uint32_t value = std::max(prev[b], prev[b + half]);
+        if (b == row.size()) {
+            row.push_back(value);
+        } else {
+            row[b] = value;
+        }
+    }
+}
+
+
+PieceTable::PieceTable() {}
+
+PieceTable::PieceTable(content_t&& content) {
+    if (content.empty()) {
+        return;
+    }
+    size_t count = content.size();
+    pLineBuffer_t original = std::make_shared<LineBuffer>(std::move(content));
+    root_ = _make_node({original, 0, count}, random_priority());
+}
+
+PieceTable::PieceTable(pLineBuffer_t buffer) {
+    size_t count = buffer->size();
+    if (count) {
+        root_ = _make_node({buffer, 0, count}, random_priority());
+    }
+}
+
+PieceTable::PieceTable(const PieceTable& other)
+    : root_(_copy(other.root_))
+{
+    other._seal();
+}
+
+PieceTable::PieceTable(PieceTable&& other) noexcept
+    : root_(std::move(other.root_)), add_(std::move(other.add_))
+{}
+
+PieceTable::~PieceTable() {}
+
+PieceTable& PieceTable::operator=(const PieceTable& other) {
+    if (this != &other) {
+        other._seal();
+        root_ = _copy(other.root_);
+    }
+    return *this;
+}
+
+PieceTable& PieceTable::operator=(PieceTable&& other) noexcept {
+    root_ = std::move(other.root_);
+    add_ = std::move(other.add_);
+    return *this;
+}
+
+size_t PieceTable::total_lines() const {
+    return _lines(root_);
+}
+
+size_t PieceTable::total_pieces() const {
+    return _pieces(root_);
+}
+
+size_t PieceTable::total_glyphs() const {
+    return _glyphs(root_);
+}
+
+size_t PieceTable::max_line_width() const {
+    return _width(root_);
+}
+
+const line_t& PieceTable::line_at(size_t row) const {
+    assert(row < total_lines());
+
+    const Node* node = root_.get();
+    while (true) {
+        size_t left_lines = _lines(node->left);
+        if (row < left_lines) {
+            node = node->left.get();
+        } else if (row < left_lines + node->piece.count) {
+            const Piece& piece = node->piece;
+            return piece.buffer->line(piece.start + row - left_lines);
+        } else {
+            row -= left_lines + node->piece.count;
+            node = node->right.get();
+        }
+    }
+}
+
+PieceTable PieceTable::slice(size_t row, size_t count) const {
+    assert(row + count <= total_lines());
+    _seal();
+
+    PieceTable result;
+    for_each_piece(row, count, [&result](const Piece& piece) {
+        Piece part = piece;
+        result.root_ = _merge(std::move(result.root_), _make_node(std::move(part), random_priority()));
+    });
+    return result;
+}
+
+void PieceTable::insert(size_t row, PieceTable&& other) {
+    assert(row <= total_lines());
+
+    pNode_t left, right;
+    _split(std::move(root_), row, left, right);
+    root_ = _merge(_merge(std::move(left), std::move(other.root_)), std::move(right));
+}
+
+PieceTable PieceTable::erase(size_t row, size_t count) {
+    assert(row + count <= total_lines());
+
+    pNode_t left, middle, right;
+    _split(std::move(root_), row, left, right);
+    _split(std::move(right), count, middle, right);
+    root_ = _merge(std::move(left), std::move(right));
+    _seal();
+
+    PieceTable erased;
+    erased.root_ = std::move(middle);
+    return erased;
+}
+
+void PieceTable::insert_line(size_t row, line_t&& line) {
+    assert(row <= total_lines());
+
+    pNode_t left, right;
+    _split(std::move(root_), row, left, right);
+    root_ = _merge(_merge(std::move(left), _make_node(_store(std::move(line)), random_priority())), std::move(right));
+}
+
+void PieceTable::replace_line(size_t row, line_t&& line) {
+    assert(row < total_lines());
+
+    pNode_t left, middle, right;
+    _split(std::move(root_), row, left, right);
+    _split(std::move(right), 1, middle, right);
+    root_ = _merge(_merge(std::move(left), _make_node(_store(std::move(line)), random_priority())), std::move(right));
+}
+
+void PieceTable::edit_line(size_t row, const std::function<void(line_t&)>& edit) {
+    assert(row < total_lines());
+
+    size_t target = row;
+    Node* node = root_.get();
+    size_t index;
+    while (true) {
+        size_t left_lines = _lines(node->left);
+        if (row < left_lines) {
+            node = node->left.get();
+        } else if (row < left_lines + node->piece.count) {
+            index = node->piece.start + row - left_lines;
+            break;
+        } else {
+            row -= left_lines + node->piece.count;
+            node = node->right.get();
+        }
+    }
+
+    const Piece& piece = node->piece;
+    if (piece.buffer != add_ || !add_->tail_editable() || index != add_->size() - 1) {
+        // nothing else references an owned line, so it is not copied and its glyphs are not left behind
+        bool owned = (piece.buffer == add_) && add_->owned(index);
+        line_t line = owned? add_->take(index): line_t(piece.buffer->line(index));
+        edit(line);
+        replace_line(target, std::move(line));
+        if ( owned && (add_->dead() >= COMPACT_MIN_DEAD) && (add_->dead() * 2 > add_->size()) ) {
+            _compact_add();
+        }
+        return;
+    }
+
+    // line edited in place is not moved, so typing into it allocates only when it grows
+    edit(add_->tail());
+    add_->update_tail();
+    _remeasure(root_.get(), target);
+}
+
+size_t PieceTable::exclusive_memory() const {
+    struct Refs {
+        long held;      // references of the table: its pieces and its add buffer
+        long total;
+        size_t memory;
+    };
+    // texts of edits hold pieces of a few buffers, these are counted without allocating
+    struct Buffers {
+        std::array<std::pair<const LineBuffer*, Refs>, 8> few;
+        size_t used = 0;
+        std::unordered_map<const LineBuffer*, Refs> more;
+
+        Refs* find(const LineBuffer* buffer) {
+            for (size_t i = 0; i < used; i++) {
+                if (few[i].first == buffer) {
+                    return &few[i].second;
+                }
+            }
+            auto it = more.find(buffer);
+            return (it != more.end())? &it->second: nullptr;
+        }
+        Refs& add(const LineBuffer* buffer, long total) {
+            if (Refs* refs = find(buffer)) {
+                return *refs;
+            }
+            if (used < few.size()) {
+                few[used] = {buffer, Refs{0, total, 0}};
+                return few[used++].second;
+            }
+            return more.emplace(buffer, Refs{0, total, 0}).first->second;
+        }
+    } buffers;
+
+    for_each_piece([&buffers](const Piece& piece) {
+        Refs& refs = buffers.add(piece.buffer.get(), piece.buffer.use_count());
+        refs.held++;
+        // lines of paged buffers are decoded into the page cache, not held by pieces
+        if ( !piece.buffer->paged() ) {
+            refs.memory += piece.buffer->glyphs(piece.start, piece.count) * sizeof(Glyph) + piece.count * sizeof(line_t);
+        }
+    });
+    if (Refs* add = add_? buffers.find(add_.get()): nullptr) {
+        add->held++;
+    }
+
+    size_t memory = 0;
+    auto count = [&memory](const Refs& refs) {
+        if (refs.held == refs.total) {
+            memory += refs.memory;
+        }
+    };
+    for (size_t i = 0; i < buffers.used; i++) {
+        count(buffers.few[i].second);
+    }
+    for (const auto& buffer: buffers.more) {
+        count(buffer.second);
+    }
+    return memory;
+}
+
+void PieceTable::for_each_piece(const std::function<void(const Piece&)>& callback) const {
+    _for_each(root_.get(), callback);
+}
+
+void PieceTable::for_each_piece(size_t row, size_t count, const std::function<void(const Piece&)>& callback) const {
+    size_t first = row;
+    size_t last = row + count;
+    size_t offset = 0;
+    for_each_piece([&](const Piece& piece) {
+        size_t piece_first = offset;
+        size_t piece_last = offset + piece.count;
+        offset = piece_last;
+
+        size_t from = std::max(first, piece_first);
+        size_t to = std::min(last, piece_last);
+        if (from < to) {
+            callback({piece.buffer, piece.start + from - piece_first, to - from});
+        }
+    });
+}
+
+Piece PieceTable::_store(line_t&& line) {
+    if (!add_) {
+        add_ = std::make_shared<LineBuffer>();
+    }
+    size_t index = add_->append(std::move(line));
+    return {add_, index, 1};
+}
+
+// Owned lines are moved to a new add buffer, lines shared with other tables stay in the old one
+void PieceTable::_compact_add() {
+    pLineBuffer_t old = add_;
+    add_ = std::make_shared<LineBuffer>();
+    _rebase(root_.get(), *old, add_);
+}
+
+void PieceTable::_rebase(Node* node, LineBuffer& from, const pLineBuffer_t& to) {
+    if (!node) {
+        return;
+    }
+    _rebase(node->left.get(), from, to);
+    Piece& piece = node->piece;
+    if ( (piece.buffer.get() == &from) && from.owned(piece.start) ) {
+        size_t start = to->size();
+        for (size_t i = 0; i < piece.count; i++) {
+            to->append(from.take(piece.start + i));
+        }
+        // lines are the same, so metadata of the node does not change
+        piece = {to, start, piece.count};
+    }
+    _rebase(node->right.get(), from, to);
+}
+
+// Lines of the table are going to be referenced by another table,
+// so the last line of the add buffer must not be changed in place anymore
+void PieceTable::_seal() const {
+    if (add_) {
+        add_->seal();
+    }
+}
+
+
+size_t PieceTable::_lines(const pNode_t& node) {
+    return node? node->lines: 0;
+}
+
+size_t PieceTable::_pieces(const pNode_t& node) {
+    return node? node->pieces: 0;
+}
+
+size_t PieceTable::_glyphs(const pNode_t& node) {
+    return node? node->glyphs: 0;
+}
+
+size_t PieceTable::_width(const pNode_t& node) {
+    return node? node->width: 0;
+}
+
+void PieceTable::_measure(Node* node) {
+    const Piece& piece = node->piece;
+    node->piece_glyphs = piece.buffer->glyphs(piece.start, piece.count);
+    node->piece_width = piece.buffer->max_width(piece.start, piece.count);
+}
+
+void PieceTable::_update(Node* node) {
+    node->lines = _lines(node->left) + node->piece.count + _lines(node->right);
+    node->pieces = _pieces(node->left) + 1 + _pieces(node->right);
+    node->glyphs = _glyphs(node->left) + node->piece_glyphs + _glyphs(node->right);
+    node->width = std::max({_width(node->left), node->piece_width, _width(node->right)});
+}
+
+// Measures the node with line `row` again and updates the nodes above it on the way back
+void PieceTable::_remeasure(Node* node, size_t row) {
+    size_t left_lines = _lines(node->left);
+    if (row < left_lines) {
+        _remeasure(node->left.get(), row);
+    } else if (row >= left_lines + node->piece.count) {
+        _remeasure(node->right.get(), row - left_lines - node->piece.count);
+    } else {
+        _measure(node);
+    }
+    _update(node);
+}
+
+PieceTable::pNode_t PieceTable::_make_node(Piece&& piece, uint32_t priority) {
+    pNode_t node(new Node{std::move(piece), 0, 0, 0, 0, 0, 0, priority, nullptr, nullptr});
+    _measure(node.get());
+    _update(node.get());
+    return node;
+}
+
+PieceTable::pNode_t PieceTable::_copy(const pNode_t& node) {
+    if (!node) {
+        return nullptr;
+    }
+    pNode_t copy(new Node{
+        node->piece, node->piece_glyphs, node->piece_width,
+        node->lines, node->pieces, node->glyphs, node->width,
+        node->priority, _copy(node->left), _copy(node->right)
+    });
+    return copy;
+}
+
+PieceTable::pNode_t PieceTable::_merge(pNode_t left, pNode_t right) {
+    if (!left) {
+        return right;
+    }
+    if (!right) {
+        return left;
+    }
+    if (left->priority > right->priority) {
+        left->right = _merge(std::move(left->right), std::move(right));
+        _update(left.get());
+        return left;
+    } else {
+        right->left = _merge(std::move(left), std::move(right->left));
+        _update(right.get());
+        return right;
+    }
+}
+
+// Splits tree so that `left` contains first `row` lines and `right` contains the rest.
+// The piece containing the split point is cut in two.
+void PieceTable::_split(pNode_t node, size_t row, pNode_t& left, pNode_t& right) {
+    if (!node) {
+        left = nullptr;
+        right = nullptr;
+        return;
+    }
+
+    size_t left_lines = _lines(node->left);
+    size_t count = node->piece.count;
+
+    if (row <= left_lines) {
+        _split(std::move(node->left), row, left, node->left);
+        _update(node.get());
+        right = std::move(node);
+    } else if (row >= left_lines + count) {
+        _split(std::move(node->right), row - left_lines - count, node->right, right);
+        _update(node.get());
+        left = std::move(node);
+    } else {
+        size_t offset = row - left_lines;
+        Piece tail = {node->piece.buffer, node->piece.start + offset, count - offset};
+        node->piece.count = offset;
+        _measure(node.get());
+
+        // tail inherits priority of the cut node, so heap order of the treap is kept
+        pNode_t tail_node = _make_node(std::move(tail), node->priority);
+        pNode_t rest = std::move(node->right);
+        _update(node.get());
+        left = std::move(node);
+        right = _merge(std::move(tail_node), std::move(rest));
+    }
+}
+
+void PieceTable::_for_each(const Node* node, const std::function<void(const Piece&)>& callback) {
+    while (node) {
+        _for_each(node->left.get(), callback);
+        callback(node->piece);
+        node = node->right.get();
+    }
+}
@@ -0,0 +1,168 @@
+#ifndef PIECE_TABLE_HPP_
+#define PIECE_TABLE_HPP_
+
+#include "glyph.hpp"
+#include "line.hpp"
+
+#include <deque>
+#include <memory>
+#include <vector>
+#include <functional>
+
+
+typedef Line line_t;
+typedef std::vector<line_t> content_t;
+
+class PagedFile;
+
+
+// Storage for lines referenced by pieces. The original buffer is filled once when text
+// is loaded, the add buffer only grows at the end while text is edited. The only line
+// that may change is the last one of the add buffer, and only until the buffer is sealed,
+// i.e. until the line might become referenced by more than one piece. Lines added after
+// the last seal are referenced by the owning table only, such a line is moved out when
+// the table replaces it, and its slot stays empty until the table compacts the buffer.
+// std::deque keeps references to stored lines valid while new lines are appended.
+//
+// Buffer also keeps an index of line widths, so number of glyphs and maximal
+// line width of any range of lines are found in O(1) whatever the range length is:
+// prefix sums of widths for the former and a sparse table of per-block maximums
+// for the latter.
+//
+// Buffer may also show lines of a big file which are decoded page by page on demand
+// (see PagedFile), such buffer is sealed and its line widths are estimated.
+class LineBuffer {
+public:
+    explicit LineBuffer();
+    explicit LineBuffer(content_t&& content);
+    explicit LineBuffer(std::shared_ptr<PagedFile> paged);
+
+    size_t size() const { return paged_? _paged_size(): lines_.size(); }
+    const line_t& line(size_t index) const { return paged_? _paged_line(index): lines_[index]; }
+    bool paged() const { return paged_ != nullptr; }
+    // lines of paged buffer are going to be used soon
+    void prefetch(size_t start, size_t count) const;
+
+    size_t append(line_t&& line);
+
+    bool tail_editable() const { return !sealed_ && !lines_.empty(); }
+    void seal() { sealed_ = true; shared_ = lines_.size(); }
+    // line is referenced by a single piece of the table owning the buffer
+    bool owned(size_t index) const { return !paged_ && (index >= shared_); }
+    // moves out an owned line which is not referenced anymore
+    line_t take(size_t index) { dead_++; return std::move(lines_[index]); }
+    // slots of lines moved out
+    size_t dead() const { return dead_; }
+    line_t& tail() { return lines_.back(); }
+    void update_tail();
+
+    size_t glyphs(size_t start, size_t count) const;
+    size_t max_width(size_t start, size_t count) const;
+
+private:
+    size_t _paged_size() const;
+    const line_t& _paged_line(size_t index) const;
+    size_t _width(size_t index) const { return glyph_prefix_[index + 1] - glyph_prefix_[index]; }
+    size_t _blocks_max(size_t first, size_t last) const;
+    void _build_index();
+    void _index_last_line();
+    void _index_last_block();
+
+    static constexpr size_t BLOCK_SIZE = 64;
+
+private:
+    std::deque<line_t> lines_;
+    bool sealed_;
+    size_t shared_;     // lines before it may be referenced by other tables
+    size_t dead_;
+    std::shared_ptr<PagedFile> paged_;
+
+    std::vector<size_t> glyph_prefix_;
+    // block_max_[k][b] is the maximal line width in blocks [b, b + 2^k)
+    std::vector<std::vector<uint32_t>> block_max_;
+};
+typedef std::shared_ptr<LineBuffer> pLineBuffer_t;
+
+
+// Continuous range of lines [start, start + count) stored in some buffer
+struct Piece {
+    pLineBuffer_t buffer;
+    size_t start;
+    size_t count;
+};
+
+
+// Sequence of lines stored as a balanced tree (treap with implicit keys) of pieces.
+// Inserting and erasing lines costs O(log pieces) and never moves stored lines.
+// Every node keeps number of lines, number of glyphs and maximal line width
+// of its subtree, so these values for the whole table are available in O(1).
+class PieceTable {
+public:
+    // add buffer is compacted when most of its slots are empty
+    static constexpr size_t COMPACT_MIN_DEAD = 4096;
+
+    explicit PieceTable();
+    explicit PieceTable(content_t&& content);
+    explicit PieceTable(pLineBuffer_t buffer);
+    PieceTable(const PieceTable& other);
+    PieceTable(PieceTable&& other) noexcept;
+    ~PieceTable();
+
+    PieceTable& operator=(const PieceTable& other);
+    PieceTable& operator=(PieceTable&& other) noexcept;
+
+    size_t total_lines() const;
+    size_t total_pieces() const;
+    size_t total_glyphs() const;
+    size_t max_line_width() const;
+    // Memory of lines freed together with the table: lines of buffers no other table refers to
+    size_t exclusive_memory() const;
+    const line_t& line_at(size_t row) const;
+
+    // copy of lines [row, row + count), stored lines are shared, not copied
+    PieceTable slice(size_t row, size_t count) const;
+
+    void insert(size_t row, PieceTable&& other);
+    PieceTable erase(size_t row, size_t count);
+
+    void insert_line(size_t row, line_t&& line);
+    void replace_line(size_t row, line_t&& line);
+    void append_line(line_t&& line) { insert_line(total_lines(), std::move(line)); }
+
+    // Changes line `row` with `edit`. The line is changed in place when it is the last line
+    // of own add buffer that is not shared with other tables. Other lines of the add buffer
+    // not shared with other tables are moved to the end of it, the rest are copied there.
+    void edit_line(size_t row, const std::function<void(line_t&)>& edit);
+
+    void for_each_piece(const std::function<void(const Piece&)>& callback) const;
+    // calls `callback` for parts of pieces covering lines [row, row + count)
+    void for_each_piece(size_t row, size_t count, const std::function<void(const Piece&)>& callback) const;
+
+private:
+    struct Node;
+    typedef std::unique_ptr<Node> pNode_t;
+
+    static size_t _lines(const pNode_t& node);
+    static size_t _pieces(const pNode_t& node);
+    static size_t _glyphs(const pNode_t& node);
+    static size_t _width(const pNode_t& node);
+    static void _measure(Node* node);
+    static void _update(Node* node);
+    static void _remeasure(Node* node, size_t row);
+    static pNode_t _make_node(Piece&& piece, uint32_t priority);
+    static pNode_t _copy(const pNode_t& node);
+    static pNode_t _merge(pNode_t left, pNode_t right);
+    static void _split(pNode_t node, size_t row, pNode_t& left, pNode_t& right);
+    static void _for_each(const Node* node, const std::function<void(const Piece&)>& callback);
+
+    Piece _store(line_t&& line);
+    void _seal() const;
+    void _compact_add();
+    static void _rebase(Node* node, LineBuffer& from, const pLineBuffer_t& to);
+
+private:
+    pNode_t root_;
+    pLineBuffer_t add_;
+};
+
+#endif // PIECE_TABLE_HPP_
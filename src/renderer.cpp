@@ -162,10 +162,13 @@ void EditorRenderer::render_line_numbers(const Text& text, Vec2i camera_pos) {
     sdli(SDL_RenderDrawLine(renderer_impl_, line_no_viewport_.w-1, 0, line_no_viewport_.w-1, line_no_viewport_.h));
 }
 
-void EditorRenderer::render_info_panel(const Cursor& cursor) {
+void EditorRenderer::render_info_panel(const Cursor& cursor, int loading_percent) {
     const uint32_t text_color = Settings::const_instance().const_colors().ui;
 
     std::stringstream info_stream;
+    if (loading_percent >= 0) {
+        info_stream << "Loading: " << loading_percent << "% (Esc to cancel) ";
+    }
     info_stream << "Row: " << cursor.row() + 1 << " Column: " << cursor.col() + 1;
 
     char buf[2] = {0};
@@ -243,7 +246,7 @@ void EditorRenderer::render_selection(const Selection& selection, const Text& te
     }
 }
 
-void EditorRenderer::render_editor_area(const Cursor& cursor, const Text& text, const Selection& selection, Vec2i camera_pos) {
+void EditorRenderer::render_editor_area(const Cursor& cursor, const Text& text, const Selection& selection, Vec2i camera_pos, int loading_percent) {
     // TODO: Scaling does not work properly with PageUp / PageDown
     // sdli(SDL_RenderSetScale(renderer_impl_, 2., 2.));
 
@@ -261,7 +264,7 @@ void EditorRenderer::render_editor_area(const Cursor& cursor, const Text& text,
     render_line_numbers(text, camera_pos);
 
     sdli(SDL_RenderSetViewport(renderer_impl_, &info_viewport_));
-    render_info_panel(cursor);
+    render_info_panel(cursor, loading_percent);
 
     SDL_RenderPresent(renderer_impl_);
 }
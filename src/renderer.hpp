@@ -26,11 +26,12 @@ public:
     void render_cursor(const Cursor& cursor, const Text& text, Vec2i camera_pos);
     void render_rulers(Vec2i camera_pos);
     void render_line_numbers(const Text& text, Vec2i camera_pos);
-    void render_info_panel(const Cursor& cursor);
+    void render_info_panel(const Cursor& cursor, int loading_percent);
 
     void render_selection(const Selection& selection, const Text& text, Vec2i camera_pos);
 
-    void render_editor_area(const Cursor& cursor, const Text& lines, const Selection& selection, Vec2i camera_pos);
+    // loading_percent is negative if no file is being loaded
+    void render_editor_area(const Cursor& cursor, const Text& lines, const Selection& selection, Vec2i camera_pos, int loading_percent);
 
     const SDL_Rect& line_no_viewport() const { return line_no_viewport_; }
     const SDL_Rect& text_viewport() const { return text_viewport_; }
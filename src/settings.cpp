@@ -31,6 +31,49 @@ CursorSettings::CursorSettings()
     blinkrate_ms(1000)
 {}
 
+TextSettings::TextSettings()
+    :
+    gap_buffer_threshold(4096),
+    load_threads(0),
+    incremental_save_min_size(16 * 1024 * 1024)
+{}
+
+PagedSettings::PagedSettings()
+    :
+    min_file_size(1024LL * 1024 * 1024),
+    cache_size(256LL * 1024 * 1024),
+    index_cache(true),
+    index_dir("")
+{}
+
+JournalSettings::JournalSettings()
+    :
+    enabled(true),
+    sync_interval_ms(1000)
+{}
+
+HistorySettings::HistorySettings()
+    :
+    max_items(100000),
+    memory_budget(256LL * 1024 * 1024),
+    spill_dir(""),
+    persistent(true),
+    store_dir(""),
+    store_days(90)
+{}
+
+FollowSettings::FollowSettings()
+    :
+    enabled(false),
+    pin_to_end(true),
+    interval_ms(100)
+{}
+
+FilterSettings::FilterSettings()
+    :
+    command("sort")
+{}
+
 
 Settings::Settings() {}
 
@@ -75,6 +118,43 @@ void Settings::init(const std::string& config_path) {
         rulers_.push_back(rulers[n]);
     }
 
+    // load text settings
+    const libconfig::Setting& text = editor.lookup("text");
+    text.lookupValue("gap_buffer_threshold", text_.gap_buffer_threshold);
+    text.lookupValue("load_threads", text_.load_threads);
+    text.lookupValue("incremental_save_min_size", text_.incremental_save_min_size);
+
+    // load paged mode settings
+    const libconfig::Setting& paged = editor.lookup("paged");
+    paged.lookupValue("min_file_size", paged_.min_file_size);
+    paged.lookupValue("cache_size", paged_.cache_size);
+    paged.lookupValue("index_cache", paged_.index_cache);
+    paged.lookupValue("index_dir", paged_.index_dir);
+
+    // load journal settings
+    const libconfig::Setting& journal = editor.lookup("journal");
+    journal.lookupValue("enabled", journal_.enabled);
+    journal.lookupValue("sync_interval_ms", journal_.sync_interval_ms);
+
+    // load history settings
+    const libconfig::Setting& history = editor.lookup("history");
+    history.lookupValue("max_items", history_.max_items);
+    history.lookupValue("memory_budget", history_.memory_budget);
+    history.lookupValue("spill_dir", history_.spill_dir);
+    history.lookupValue("persistent", history_.persistent);
+    history.lookupValue("store_dir", history_.store_dir);
+    history.lookupValue("store_days", history_.store_days);
+
+    // load follow mode settings
+    const libconfig::Setting& follow = editor.lookup("follow");
+    follow.lookupValue("enabled", follow_.enabled);
+    follow.lookupValue("pin_to_end", follow_.pin_to_end);
+    follow.lookupValue("interval_ms", follow_.interval_ms);
+
+    // load filter settings
+    const libconfig::Setting& filter = editor.lookup("filter");
+    filter.lookupValue("command", filter_.command);
+
     libconfig::Setting& dev = editor.lookup("dev");
 
     // load log settings
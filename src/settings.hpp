@@ -34,6 +34,75 @@ struct FontSettings {
     FontSettings();
 };
 
+struct TextSettings {
+    // lines at least this long are edited as gap buffers
+    int gap_buffer_threshold;
+    // threads parsing loaded files, 0 stands for the number of CPU cores
+    int load_threads;
+    // files at least this big are saved by rewriting only the changed tail
+    int incremental_save_min_size;
+
+    TextSettings();
+};
+
+struct PagedSettings {
+    // files at least this big are not decoded completely, only pages of lines around the view
+    long long min_file_size;
+    // memory for decoded pages of such files
+    long long cache_size;
+    // indices of lines of such files are saved, so they are opened again without reading them
+    bool index_cache;
+    // directory of saved indices, empty stands for $XDG_CACHE_HOME/editor
+    std::string index_dir;
+
+    PagedSettings();
+};
+
+struct JournalSettings {
+    // unsaved edits are written to a swap file next to the edited one
+    bool enabled;
+    // journal is synced to the disk at most once per this interval
+    int sync_interval_ms;
+
+    JournalSettings();
+};
+
+struct HistorySettings {
+    // edits which can be undone, the oldest ones are dropped
+    int max_items;
+    // memory for texts of the edits, texts of older edits are spilled to a temporary file
+    // and read back on undo, negative value keeps all of them in memory
+    long long memory_budget;
+    // directory of the temporary file, empty stands for $TMPDIR or /tmp
+    std::string spill_dir;
+    // history of a file is kept after it is closed and restored when the unchanged file is opened again
+    bool persistent;
+    // directory of kept histories, empty stands for $XDG_CACHE_HOME/editor/history
+    std::string store_dir;
+    // histories not written for this many days are removed, 0 keeps them
+    int store_days;
+
+    HistorySettings();
+};
+
+struct FollowSettings {
+    // opened files are followed: lines appended to them are shown at once
+    bool enabled;
+    // cursor on the last line stays there when lines are appended
+    bool pin_to_end;
+    // appends are batched and shown at most once per this interval
+    int interval_ms;
+
+    FollowSettings();
+};
+
+struct FilterSettings {
+    // shell command the selection, or the whole text, is piped through
+    std::string command;
+
+    FilterSettings();
+};
+
 struct LogSettings {
     int level;
 };
@@ -54,6 +123,24 @@ public:
     FontSettings& font() { return font_settings_; }
     const FontSettings& const_font() const { return font_settings_; }
 
+    TextSettings& text() { return text_; }
+    const TextSettings& const_text() const { return text_; }
+
+    PagedSettings& paged() { return paged_; }
+    const PagedSettings& const_paged() const { return paged_; }
+
+    JournalSettings& journal() { return journal_; }
+    const JournalSettings& const_journal() const { return journal_; }
+
+    HistorySettings& history() { return history_; }
+    const HistorySettings& const_history() const { return history_; }
+
+    FollowSettings& follow() { return follow_; }
+    const FollowSettings& const_follow() const { return follow_; }
+
+    FilterSettings& filter() { return filter_; }
+    const FilterSettings& const_filter() const { return filter_; }
+
     LogSettings& log() { return log_; }
     const LogSettings& const_log() const { return log_; }
 
@@ -71,6 +158,12 @@ private:
 
     Colors colors_;
     FontSettings font_settings_;
+    TextSettings text_;
+    PagedSettings paged_;
+    JournalSettings journal_;
+    HistorySettings history_;
+    FollowSettings follow_;
+    FilterSettings filter_;
     LogSettings log_;
     CursorSettings cursor_;
     std::vector<int> rulers_;
@@ -4,46 +4,46 @@
 
 
 Text::Text() {
-    content_.resize(1);
-    _recalc_max_line_width();
+    lines_.append_line(line_t());
 }
 
 Text::Text(const content_t& content)
-    : content_(content)
-{
-    _recalc_max_line_width();
-}
+    : lines_(content_t(content))
+{}
 
-Text::Text(const content_t&& content)
-    : content_(std::move(content))
-{
-    _recalc_max_line_width();
-}
+Text::Text(content_t&& content)
+    : lines_(std::move(content))
+{}
+
+Text::Text(pLineBuffer_t buffer)
+    : lines_(std::move(buffer))
+{}
+
+Text::Text(PieceTable&& lines)
+    : lines_(std::move(lines))
+{}
 
 Text::Text(const Text& other)
-    : content_(other.content()), max_line_width_(other.max_line_width())
+    : lines_(other.lines())
 {}
 
-Text::Text(const Text&& other)
-    : content_(std::move(other.content())), max_line_width_(other.max_line_width())
+Text::Text(Text&& other) noexcept
+    : lines_(std::move(other.lines_))
 {}
 
 Text& Text::operator=(const Text& other) {
-    content_ = other.content();
-    max_line_width_ = other.max_line_width();
+    lines_ = other.lines();
     return *this;
 }
 
-int Text::line_width(int row) const {
-    row = (row >= 0)? row: total_lines() + row;
-    return static_cast<int>(content_[row].size());
+Text& Text::operator=(Text&& other) noexcept {
+    lines_ = std::move(other.lines_);
+    return *this;
 }
 
-int Text::max_line_width() const {
-    if (!total_lines()) {
-        return 0;
-    }
-    return static_cast<int>(max_line_width_);
+int Text::line_width(int row) const {
+    row = (row >= 0)? row: total_lines() + row;
+    return static_cast<int>(lines_.line_at(row).size());
 }
 
 const Vec2i Text::get_end(const Vec2i& start, SelectionShape shape) const {
@@ -72,128 +72,149 @@ const Vec2i Text::get_end(const Vec2i& start, SelectionShape shape) const {
     return Vec2i(x, y);
 }
 
-void Text::_recalc_max_line_width() {
-    max_line_width_ = 0;
-    for (const auto& line: content_) {
-        max_line_width_ = std::max(max_line_width_, line.size());
+void Text::resize(size_t nlines) {
+    size_t total = lines_.total_lines();
+    if (nlines < total) {
+        lines_.erase(nlines, total - nlines);
+    }
+    for (size_t i = total; i < nlines; i++) {
+        lines_.append_line(line_t());
     }
 }
 
 Text& Text::operator+=(const Text& t) {
-    // if (content_.size() == 0) {
-    //     content_.resize(1);
-    // }
-    const content_t& other = t.content();
-    if ( other.size() ) {
-        const line_t& first = other.front();
-        line_t& back = content_.back();
-        back.insert(back.end(), first.begin(), first.end());
-
-        content_.insert(content_.end(), std::next(other.begin(), 1), other.end());
+    int other_lines = t.total_lines();
+    if ( other_lines ) {
+        // Slicing first keeps the joined line from being edited in place when `t` shares it.
+        // A single line of another text is only copied, so typed text is appended without allocating.
+        PieceTable rest = ((other_lines > 1) || (&t == this))? t.lines().slice(1, other_lines - 1): PieceTable();
+        const line_t& first = t.line_at({0, 0});
+        lines_.edit_line(total_lines() - 1, [&first](line_t& back) {
+            back.insert(back.end(), first.begin(), first.end());
+        });
+        if (rest.total_lines() > 0) {
+            lines_.insert(lines_.total_lines(), std::move(rest));
+        }
     }
     return *this;
 }
 
+void Text::append_lines(Text&& text) {
+    lines_.insert(lines_.total_lines(), std::move(text.lines_));
+}
+
 std::pair<Text, Text> Text::split(const Vec2i& pos) {
     assert((pos.x >= 0) && (pos.y >= 0));
 
     size_t ux = static_cast<size_t>(pos.x);
     size_t uy = static_cast<size_t>(pos.y);
+    size_t total = lines_.total_lines();
 
-    if (uy >= content_.size() || ux >= content_[pos.y].size()) {
+    if (uy >= total || ux >= lines_.line_at(uy).size()) {
         return std::make_pair(*this, Text());
     }
 
-    content_t first, second;
-    first.reserve(pos.y + 1);
-    second.reserve(content_.size() - pos.y);
+    const line_t& line = lines_.line_at(uy);
 
-    first.insert(first.begin(), content_.begin(), std::next(content_.begin(), pos.y));
-    first.push_back(line_t());
-    first.back().insert(first.back().begin(), content_[pos.y].begin(), std::next(content_[pos.y].begin(), pos.x));
+    PieceTable first = lines_.slice(0, uy);
+    first.append_line(line_t(line.begin(), std::next(line.begin(), pos.x)));
 
-    second.push_back(line_t());
-    second.front().insert(second.front().begin(), std::next(content_[pos.y].begin(), pos.x), content_[pos.y].end());
-    second.insert(std::next(second.begin(), 1), std::next(content_.begin(), pos.y+1), content_.end());
+    PieceTable second = lines_.slice(uy + 1, total - uy - 1);
+    second.insert_line(0, line_t(std::next(line.begin(), pos.x), line.end()));
 
-    return std::make_pair(Text(first), Text(second));
+    return std::make_pair(Text(std::move(first)), Text(std::move(second)));
 }
 
 void Text::insert_at(const Vec2i& pos, const Text& text, SelectionShape shape) {
-    const auto& raw = text.content();
+    int text_lines = text.total_lines();
 
-    if (!raw.size()) {
+    if (!text_lines) {
         return;
     }
 
     switch (shape) {
         case SelectionShape::TEXT_LIKE: {
-            line_t rem;
-            line_t& line = content_[pos.y];
+            const line_t& first = text.line_at({0, 0});
 
-            // move text to the right of the cursor to temporary buffer
-            std::move(line.begin() + pos.x, line.end(), std::back_inserter(rem));
-            line.erase(line.begin() + pos.x, line.end());
+            if (text_lines == 1) {
+                lines_.edit_line(pos.y, [&pos, &first](line_t& line) {
+                    line.insert(line.begin() + pos.x, first.begin(), first.end());
+                });
+                break;
+            }
 
-            // insert first line of `text` next to cursor
-            line.insert(line.end(), raw[0].begin(), raw[0].end());
+            const line_t& line = lines_.line_at(pos.y);
 
-            // insert all lines starting from second one
-            auto it = content_.begin() + pos.y + 1;
-            content_.insert(it, raw.begin()+1, raw.end());
+            const line_t& last = text.line_at({0, text_lines - 1});
 
-            // insert text from tempropary buffer
-            auto& last_line = content_[pos.y + raw.size() - 1];
-            last_line.insert(last_line.end(), rem.begin(), rem.end());
+            // text to the left of the cursor is followed by the first line of `text`
+            line_t head(line.begin(), line.begin() + pos.x);
+            head.insert(head.end(), first.begin(), first.end());
+
+            // last line of `text` is followed by text to the right of the cursor
+            line_t tail;
+            tail.reserve(last.size() + line.size() - pos.x);
+            tail.insert(tail.end(), last.begin(), last.end());
+            tail.insert(tail.end(), line.begin() + pos.x, line.end());
+
+            // lines between first and last ones are shared with `text`, not copied
+            lines_.replace_line(pos.y, std::move(head));
+            lines_.insert(pos.y + 1, text.lines().slice(1, text_lines - 2));
+            lines_.insert_line(pos.y + text_lines - 1, std::move(tail));
             break;
         }
         case SelectionShape::RECTANGULAR: {
             int start_col = pos.x;
-            int finish_row = pos.y + text.total_lines() - 1;
+            int finish_row = pos.y + text_lines - 1;
             for (int row=pos.y; row <= finish_row; row++) {
-                line_t& line = content_[row];
-                int actual_start_col = std::min(line_width(row)-1, start_col);
-                int text_row = row - pos.y;
-                line.insert(line.begin() + actual_start_col, raw[text_row].begin(), raw[text_row].end());
+                const line_t& line = lines_.line_at(row);
+                const line_t& inserted = text.line_at({0, row - pos.y});
+                int actual_start_col = std::max(0, std::min(line_width(row)-1, start_col));
+
+                line_t updated;
+                updated.reserve(line.size() + inserted.size());
+                updated.insert(updated.end(), line.begin(), line.begin() + actual_start_col);
+                updated.insert(updated.end(), inserted.begin(), inserted.end());
+                updated.insert(updated.end(), line.begin() + actual_start_col, line.end());
+                lines_.replace_line(row, std::move(updated));
             }
             break;
         }
         default:
             Logger::instance().critical(std::string("Unhandled selection shape in ") + __func__);
     }
-
-
-    _recalc_max_line_width();
 }
 
 Text Text::remove(const Vec2i& from, const Vec2i& to, SelectionShape shape) {
-    content_t deleted_text;
+    PieceTable deleted_text;
 
     switch (shape) {
         case SelectionShape::TEXT_LIKE: {
-            line_t first_deleted_line, last_deleted_line;
-
             int dy = to.y - from.y;
 
-            line_t rem;
-            line_t& start = content_[from.y];
-            line_t& finish = content_[to.y];
+            const line_t& start = lines_.line_at(from.y);
+            const line_t& finish = lines_.line_at(to.y);
 
             if (dy == 0) {
-                std::move(finish.begin() + from.x, finish.begin() + to.x, std::back_inserter(last_deleted_line));
-                finish.erase(finish.begin() + from.x, finish.begin() + to.x);
-                deleted_text.push_back(last_deleted_line);
+                deleted_text.append_line(line_t(finish.begin() + from.x, finish.begin() + to.x));
+                lines_.edit_line(from.y, [&from, &to](line_t& line) {
+                    line.erase(line.begin() + from.x, line.begin() + to.x);
+                });
             } else {
-                std::copy(start.begin() + from.x, start.end(), std::back_inserter(first_deleted_line));
-                deleted_text.push_back(first_deleted_line);
-                std::copy(content_.begin() + from.y + 1, content_.begin() + to.y, std::back_inserter(deleted_text));
-                std::copy(finish.begin(), finish.begin() + to.x, std::back_inserter(last_deleted_line));
-                deleted_text.push_back(last_deleted_line);
-
-                std::move(finish.begin() + to.x, finish.end(), std::back_inserter(rem));
-                content_.erase(content_.begin() + from.y + 1, content_.begin() + to.y + 1);
-                start.erase(start.begin() + from.x, start.end());
-                start.insert(start.end(), rem.begin(), rem.end());
+                line_t first_deleted_line(start.begin() + from.x, start.end());
+                line_t last_deleted_line(finish.begin(), finish.begin() + to.x);
+
+                line_t joined(start.begin(), start.begin() + from.x);
+                joined.insert(joined.end(), finish.begin() + to.x, finish.end());
+
+                // whole lines between `from` and `to` are moved to deleted text as they are
+                PieceTable erased = lines_.erase(from.y + 1, dy);
+                erased.erase(dy - 1, 1);
+                lines_.replace_line(from.y, std::move(joined));
+
+                deleted_text.append_line(std::move(first_deleted_line));
+                deleted_text.insert(1, std::move(erased));
+                deleted_text.append_line(std::move(last_deleted_line));
             }
             break;
         }
@@ -204,49 +225,51 @@ Text Text::remove(const Vec2i& from, const Vec2i& to, SelectionShape shape) {
                 std::swap(start_col, finish_col);
             int finish_row = std::min(to.y, total_lines()-1);
             for (int row=from.y; row <= finish_row; row++) {
-                line_t line;
                 if (start_col >= line_width(row)) {
-                    deleted_text.push_back(line);
+                    deleted_text.append_line(line_t());
                     continue;
                 }
                 int actual_finish_col = std::min(line_width(row)-1, finish_col);
-                line_t& cur = content_[row];
-                std::move(cur.begin() + start_col, cur.begin() + actual_finish_col, std::back_inserter(line));
-                cur.erase(cur.begin() + start_col, cur.begin() + actual_finish_col);
-                deleted_text.push_back(line);
+                const line_t& cur = lines_.line_at(row);
+                deleted_text.append_line(line_t(cur.begin() + start_col, cur.begin() + actual_finish_col));
+
+                line_t updated(cur.begin(), cur.begin() + start_col);
+                updated.insert(updated.end(), cur.begin() + actual_finish_col, cur.end());
+                lines_.replace_line(row, std::move(updated));
             }
             break;
         }
         default:
             Logger::instance().critical(std::string("Unhandled selection shape in ") +  __func__);
     }
-    _recalc_max_line_width();
 
-    return Text(deleted_text);
+    return Text(std::move(deleted_text));
 }
 
 void Text::add_newline(const Vec2i& pos) {
-    line_t& current_line = content_[pos.y];
+    const line_t& current_line = lines_.line_at(pos.y);
+    line_t movable_str = line_t(std::next(current_line.begin(), pos.x), current_line.end());
 
-    auto line_start_it = std::next(current_line.begin(), pos.x);
-    line_t movable_str = line_t(line_start_it, current_line.end());
-    content_[pos.y].resize(pos.x);
-    content_.insert(std::next(content_.begin(), pos.y + 1), movable_str);
+    lines_.edit_line(pos.y, [&pos](line_t& line) {
+        line.erase(line.begin() + pos.x, line.end());
+    });
+    lines_.insert_line(pos.y + 1, std::move(movable_str));
 }
 
 void Text::remove_newline(const Vec2i& pos) {
-    line_t& current_line = content_[pos.y];
+    const line_t& next_line = lines_.line_at(pos.y + 1);
 
-    line_t& next_line = content_[pos.y + 1];
-    current_line.insert(current_line.end(), next_line.begin(), next_line.end());
-    content_.erase(std::next(content_.begin(), pos.y + 1));
+    lines_.edit_line(pos.y, [&next_line](line_t& line) {
+        line.insert(line.end(), next_line.begin(), next_line.end());
+    });
+    lines_.erase(pos.y + 1, 1);
 }
 
 void Text::debug(std::ostream& out) {
-    for (const auto& line: content_) {
+    for_each_line([&out](const line_t& line) {
         for (const auto& g: line) {
             out << g;
         }
         out << std::endl;
-    }
+    });
 }
@@ -3,46 +3,63 @@
 
 #include "glyph.hpp"
 #include "common.hpp"
+#include "piece_table.hpp"
 
+#include <algorithm>
 
-typedef std::vector<Glyph> line_t;
-typedef std::vector<line_t> content_t;
 
 class Text {
 public:
     explicit Text();
     explicit Text(const content_t& content);
-    explicit Text(const content_t&& content);
-    explicit Text(const Text& other);
-    explicit Text(const Text&& other);
+    explicit Text(content_t&& content);
+    // text of all lines of the buffer, e.g. of a paged file
+    explicit Text(pLineBuffer_t buffer);
+    // copies share stored lines, glyphs are never copied
+    Text(const Text& other);
+    Text(Text&& other) noexcept;
 
     Text& operator=(const Text& other);
+    Text& operator=(Text&& other) noexcept;
 
-    int total_lines() const { return static_cast<int>(content_.size());}
+    int total_lines() const { return static_cast<int>(lines_.total_lines());}
     int line_width(int row) const;
-    int max_line_width() const;
-    const line_t& line_at(const Vec2i& pos) const { return content_[pos.y];}
+    int max_line_width() const { return static_cast<int>(lines_.max_line_width()); }
+    size_t total_glyphs() const { return lines_.total_glyphs(); }
+    const line_t& line_at(const Vec2i& pos) const { return lines_.line_at(pos.y);}
 
     const Vec2i get_end(const Vec2i& start, SelectionShape shape) const;
 
-    void resize(size_t nlines) { content_.resize(nlines); }
+    void resize(size_t nlines);
 
     Text& operator+=(const Text& t);
+    // appends lines of `text` after the last line, lines are moved, not copied
+    void append_lines(Text&& text);
     std::pair<Text, Text> split(const Vec2i& pos);
     void insert_at(const Vec2i& pos, const Text& text, SelectionShape shape);
     Text remove(const Vec2i& from, const Vec2i& to, SelectionShape shape);
     void add_newline(const Vec2i& pos);
     void remove_newline(const Vec2i& pos);
 
-    const content_t& content() const { return content_; }
+    const PieceTable& lines() const { return lines_; }
+
+    // calls `callback` for every line starting from the row `first`
+    template<typename F>
+    void for_each_line(F callback, size_t first = 0) const {
+        size_t total = lines_.total_lines();
+        lines_.for_each_piece(std::min(first, total), total - std::min(first, total), [&callback](const Piece& piece) {
+            for (size_t i = 0; i < piece.count; i++) {
+                callback(piece.buffer->line(piece.start + i));
+            }
+        });
+    }
 
     void debug(std::ostream& o);
 private:
-    void _recalc_max_line_width();
-private:
-    content_t content_;
+    explicit Text(PieceTable&& lines);
 
-    size_t max_line_width_;
+private:
+    PieceTable lines_;
 };
 
 
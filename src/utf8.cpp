@@ -0,0 +1,193 @@
+#include "utf8.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <string>
+
+
+static constexpr unsigned char PRINTABLE_LOW = 0x20;
+static constexpr unsigned char PRINTABLE_HIGH = 0x7E;
+
+// U+FFFD REPLACEMENT CHARACTER
+static const char* const REPLACEMENT = "\xEF\xBF\xBD";
+
+
+Utf8Decoder::Utf8Decoder() : plain_printable_(true) {
+    for (int c = 0; c < 0x80; c++) {
+        table_[c] = Glyph::from_codepoint(c);
+    }
+    for (int c = 0x80; c < 0x100; c++) {
+        std::string real(1, static_cast<char>(c));
+        table_[c] = Glyph(real.c_str(), REPLACEMENT);
+    }
+}
+
+void Utf8Decoder::set_special(char c, const Glyph& glyph) {
+    unsigned char u = static_cast<unsigned char>(c);
+    table_[u] = glyph;
+    if ((u >= PRINTABLE_LOW) && (u <= PRINTABLE_HIGH)) {
+        plain_printable_ = false;
+    }
+}
+
+bool Utf8Decoder::decode(const char* start, const char* stop, Line& line) const {
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(start);
+    const unsigned char* end = reinterpret_cast<const unsigned char*>(stop);
+
+    // every byte gives at most one glyph
+    size_t first = line.size();
+    Glyph* const begin = line.extend(end - s);
+    Glyph* out = begin;
+    bool valid = true;
+
+    while (s < end) {
+        if (plain_printable_ && (*s >= PRINTABLE_LOW) && (*s <= PRINTABLE_HIGH)) {
+            // Bytes >= 0x80 are negative as signed chars, so one signed comparison
+            // finds both them and control chars. Blocks are always widened completely:
+            // the line has room for all remaining bytes, extra glyphs are overwritten.
+#if defined(__AVX2__)
+            const __m256i low = _mm256_set1_epi8(PRINTABLE_LOW);
+            const __m256i del = _mm256_set1_epi8(PRINTABLE_HIGH + 1);
+            while (end - s >= 32) {
+                __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s));
+                __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi8(low, bytes), _mm256_cmpeq_epi8(bytes, del));
+                uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(outside));
+
+                size_t plain = mask? __builtin_ctz(mask): 32;
+                for (size_t i = 0; i < plain; i += 8) {
+                    __m128i part = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(s + i));
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_cvtepu8_epi32(part));
+                }
+                s += plain;
+                out += plain;
+                if (mask) {
+                    break;
+                }
+            }
+#elif defined(__SSE2__)
+            const __m128i low = _mm_set1_epi8(PRINTABLE_LOW);
+            const __m128i del = _mm_set1_epi8(PRINTABLE_HIGH + 1);
+            const __m128i zero = _mm_setzero_si128();
+            while (end - s >= 16) {
+                __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+                __m128i outside = _mm_or_si128(_mm_cmplt_epi8(bytes, low), _mm_cmpeq_epi8(bytes, del));
+                uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(outside));
+
+                __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+                __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+                __m128i* dst = reinterpret_cast<__m128i*>(out);
+                _mm_storeu_si128(dst + 0, _mm_unpacklo_epi16(lo, zero));
+                _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(lo, zero));
+                _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(hi, zero));
+                _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(hi, zero));
+
+                size_t plain = mask? __builtin_ctz(mask): 16;
+                s += plain;
+                out += plain;
+                if (mask) {
+                    break;
+                }
+            }
+#endif
+            while ((s < end) && (*s >= PRINTABLE_LOW) && (*s <= PRINTABLE_HIGH)) {
+                *out++ = Glyph::from_codepoint(*s++);
+            }
+            if (s == end) {
+                break;
+            }
+        }
+
+        unsigned char c = *s;
+        if (c < 0x80) {
+            *out++ = table_[c];
+            s++;
+            continue;
+        }
+
+        uint32_t codepoint;
+        size_t len = _decode_sequence(s, end, codepoint);
+        if (len) {
+            *out++ = Glyph::from_codepoint(codepoint);
+            s += len;
+        } else {
+            *out++ = table_[c];
+            s++;
+            valid = false;
+        }
+    }
+
+    line.resize(first + (out - begin));
+    return valid;
+}
+
+// Returns length of a valid multi-byte sequence at `s`, or 0 if it is malformed:
+// truncated, overlong, encodes a surrogate or a codepoint above U+10FFFF
+size_t Utf8Decoder::_decode_sequence(const unsigned char* s, const unsigned char* end, uint32_t& codepoint) {
+    unsigned char c = s[0];
+    size_t len;
+    unsigned char min = 0x80, max = 0xBF;   // allowed range of the second byte
+
+    if ((c >= 0xC2) && (c <= 0xDF)) {
+        len = 2;
+        codepoint = c & 0x1F;
+    } else if ((c >= 0xE0) && (c <= 0xEF)) {
+        len = 3;
+        codepoint = c & 0x0F;
+        if (c == 0xE0) {
+            min = 0xA0;
+        } else if (c == 0xED) {
+            max = 0x9F;
+        }
+    } else if ((c >= 0xF0) && (c <= 0xF4)) {
+        len = 4;
+        codepoint = c & 0x07;
+        if (c == 0xF0) {
+            min = 0x90;
+        } else if (c == 0xF4) {
+            max = 0x8F;
+        }
+    } else {
+        return 0;
+    }
+
+    if (static_cast<size_t>(end - s) < len) {
+        return 0;
+    }
+    if ((s[1] < min) || (s[1] > max)) {
+        return 0;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+        codepoint = (codepoint << 6) | (s[i] & 0x3F);
+    }
+    return len;
+}
+
+size_t encode_utf8(uint32_t codepoint, char* out) {
+    if (codepoint < 0x80) {
+        out[0] = static_cast<char>(codepoint);
+        return 1;
+    }
+    if (codepoint < 0x800) {
+        out[0] = static_cast<char>(0xC0 | (codepoint >> 6));
+        out[1] = static_cast<char>(0x80 | (codepoint & 0x3F));
+        return 2;
+    }
+    if (codepoint < 0x10000) {
+        out[0] = static_cast<char>(0xE0 | (codepoint >> 12));
+        out[1] = static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+        out[2] = static_cast<char>(0x80 | (codepoint & 0x3F));
+        return 3;
+    }
+    out[0] = static_cast<char>(0xF0 | (codepoint >> 18));
+    out[1] = static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F));
+    out[2] = static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+    out[3] = static_cast<char>(0x80 | (codepoint & 0x3F));
+    return 4;
+}
@@ -0,0 +1,36 @@
+#ifndef UTF8_HPP_
+#define UTF8_HPP_
+
+#include "glyph.hpp"
+#include "line.hpp"
+
+
+// Decoder of UTF-8 text into glyphs.
+// Runs of printable ASCII are checked and widened to glyphs 16 (SSE2) or 32 (AVX2)
+// bytes at once; other bytes are looked up in a 256-entry table of single-byte glyphs,
+// which also holds special characters, and multi-byte sequences are validated and
+// decoded one by one. Bytes that are not a part of valid UTF-8 are kept as special
+// glyphs shown as U+FFFD, so saving the text writes them back unchanged.
+class Utf8Decoder {
+public:
+    explicit Utf8Decoder();
+
+    void set_special(char c, const Glyph& glyph);
+
+    // Appends glyphs of [start, stop) to `line`, returns false if text is not valid UTF-8
+    bool decode(const char* start, const char* stop, Line& line) const;
+
+private:
+    static size_t _decode_sequence(const unsigned char* s, const unsigned char* end, uint32_t& codepoint);
+
+private:
+    Glyph table_[256];
+
+    // printable ASCII chars have no special glyphs, so their runs may be copied as they are
+    bool plain_printable_;
+};
+
+// Writes UTF-8 sequence of `codepoint` to `out`, which has room for 4 bytes, returns its length
+size_t encode_utf8(uint32_t codepoint, char* out);
+
+#endif // UTF8_HPP_
@@ -1,6 +1,10 @@
 #include "gtest/gtest.h"
 
+#include "settings.hpp"
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
+    // histories of test files are not kept in the user's cache, tests of the store set their own directory
+    Settings::instance().history().persistent = false;
     return RUN_ALL_TESTS();
 }
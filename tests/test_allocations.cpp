@@ -0,0 +1,36 @@
+#include "test_allocations.hpp"
+
+#include <new>
+#include <cstdlib>
+
+
+// Global operators are replaced for the whole test binary, allocations are only counted
+// on the thread running count_allocations()
+static thread_local bool counting = false;
+static thread_local size_t allocations = 0;
+
+void* operator new(size_t size) {
+    if (counting) {
+        allocations++;
+    }
+    if (void* memory = std::malloc(size? size: 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+size_t count_allocations(const std::function<void()>& action) {
+    allocations = 0;
+    counting = true;
+    action();
+    counting = false;
+    return allocations;
+}
@@ -0,0 +1,11 @@
+#ifndef TEST_ALLOCATIONS_HPP_
+#define TEST_ALLOCATIONS_HPP_
+
+#include <cstddef>
+#include <functional>
+
+
+// Number of times `action` called operator new on the current thread
+size_t count_allocations(const std::function<void()>& action);
+
+#endif // TEST_ALLOCATIONS_HPP_
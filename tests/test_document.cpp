@@ -0,0 +1,489 @@
+#include <gtest/gtest.h>
+
+#include "document.hpp"
+#include "settings.hpp"
+#include "test_files.hpp"
+
+#include <zlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+
+
+class DocumentTest: public TempFileFixture {
+protected:
+    // Appends `content` to `path` as a new gzip member, to be called in ASSERT_NO_FATAL_FAILURE()
+    static void append_gzip(const std::string& path, const std::string& content) {
+        gzFile out = gzopen(path.c_str(), "ab");
+        ASSERT_NE(out, nullptr) << "cannot open " << path;
+        int written = gzwrite(out, content.data(), static_cast<unsigned>(content.size()));
+        int closed = gzclose(out);
+        ASSERT_EQ(written, static_cast<int>(content.size())) << "cannot write " << path;
+        ASSERT_EQ(closed, Z_OK) << "cannot close " << path;
+    }
+};
+
+TEST_F(DocumentTest, LoadUtf8) {
+    Document doc;
+
+    // 1-, 2-, 3- and 4-byte sequences
+    Text text = doc.load_raw("aЫ中😀");
+    ASSERT_EQ(text.line_width(0), 4);
+    EXPECT_EQ(text.line_at({0, 0})[1].real(), "Ы");
+    EXPECT_EQ(text.line_at({0, 0})[2].real(), "中");
+    EXPECT_EQ(text.line_at({0, 0})[3].real(), "😀");
+    EXPECT_EQ(text.line_at({0, 0})[3].code(), 0x1F600);
+
+    // invalid bytes are kept as they are, but shown as replacement characters
+    text = doc.load_raw("a\xFF\xE4\xB8" "b\xED\xA0\x80");
+    ASSERT_EQ(text.line_width(0), 8);
+    EXPECT_EQ(text.line_at({0, 0})[1].real(), "\xFF");
+    EXPECT_EQ(text.line_at({0, 0})[1].visible(), "\xEF\xBF\xBD");
+    EXPECT_EQ(text.line_at({0, 0})[3].real(), "\xB8");
+    EXPECT_EQ(text.line_at({0, 0})[4].real(), "b");
+
+    // long runs of ASCII mixed with special and non-ASCII chars
+    std::string line;
+    for (int i = 0; i < 100; i++) {
+        line += (i % 37 == 0)? "\t": (i % 23 == 0)? "ж": std::string(1, static_cast<char>('a' + i % 26));
+    }
+    text = doc.load_raw(line.c_str());
+    std::string loaded;
+    for (const Glyph& g: text.line_at({0, 0})) {
+        loaded += g.real();
+    }
+    EXPECT_EQ(loaded, line);
+    EXPECT_EQ(text.line_at({0, 0})[0], doc.specials().at('\t'));
+}
+
+TEST_F(DocumentTest, LoadFromFile) {
+    std::string path = temp_path("editor_load_test.txt");
+    ASSERT_NO_FATAL_FAILURE(write_file(path, "first\n\nthird line\n"));
+
+    Document doc;
+    doc.load_from_file(path);
+    ASSERT_EQ(doc.total_lines(), 3);
+    EXPECT_EQ(doc.line_width(0), 5);
+    EXPECT_EQ(doc.line_width(1), 0);
+    EXPECT_EQ(doc.line_width(2), 10);
+
+    doc.save_to_file();
+    EXPECT_EQ(read_file(path), "first\n\nthird line\n");
+
+    // edits of the previous file cannot be undone in the next one, even without a history store
+    Settings::instance().history().persistent = false;
+    std::string other = temp_path("editor_load_other.txt");
+    ASSERT_NO_FATAL_FAILURE(write_file(other, "other\n"));
+    doc.load_from_file(path);
+    doc.insert_text(Vec2i(0, 0), doc.load_raw("+"), Vec2i(0, 0), SelectionShape::TEXT_LIKE, true);
+    doc.load_from_file(other);
+    EXPECT_EQ(doc.undo(), nullptr);
+    EXPECT_EQ(doc.total_lines(), 1);
+}
+
+TEST_F(DocumentTest, SaveToFile) {
+    std::string path = temp_path("editor_save_test.txt");
+    ASSERT_NO_FATAL_FAILURE(write_file(path, "tab\there\n\xD0\xAB\xE4\xB8\xAD\xF0\x9F\x98\x80\ninvalid \xFF byte\n"));
+    ::chmod(path.c_str(), 0600);
+
+    // special glyphs and invalid bytes are written back as they were
+    Document doc;
+    doc.load_from_file(path);
+    doc.insert_text(Vec2i(0, 1), doc.load_raw("+"), Vec2i(0, 1), SelectionShape::TEXT_LIKE, false);
+    doc.save_to_file();
+    EXPECT_EQ(read_file(path), "tab\there\n+\xD0\xAB\xE4\xB8\xAD\xF0\x9F\x98\x80\ninvalid \xFF byte\n");
+
+    // file is replaced by a new one with the same permissions
+    struct stat st;
+    ASSERT_EQ(::stat(path.c_str(), &st), 0);
+    EXPECT_EQ(st.st_mode & 0777, 0600);
+}
+
+TEST_F(DocumentTest, LoadGzip) {
+    std::string path = temp_path("editor_gzip_test.txt.gz");
+    const int total = 200000;
+    std::string content;
+    for (int i = 0; i < total; i++) {
+        content += "line " + std::to_string(i) + "\n";
+    }
+    // concatenated gzip members are decompressed as one file
+    ASSERT_NO_FATAL_FAILURE(append_gzip(path, content.substr(0, content.size() / 2)));
+    ASSERT_NO_FATAL_FAILURE(append_gzip(path, content.substr(content.size() / 2)));
+
+    Document doc;
+    doc.load_from_file(path);
+    EXPECT_TRUE(doc.is_compressed());
+    ASSERT_EQ(doc.total_lines(), total);
+    EXPECT_GT(doc.text().lines().total_pieces(), 1);
+    for (int i: {0, 1, total / 2, total - 1}) {
+        EXPECT_EQ(doc.line_width(i), static_cast<int>(("line " + std::to_string(i)).size()));
+    }
+
+    // saved file is compressed again
+    doc.insert_text(Vec2i(0, 0), doc.load_raw("+"), Vec2i(0, 0), SelectionShape::TEXT_LIKE, false);
+    doc.save_to_file();
+    ASSERT_TRUE(FileLoader::is_gzip(path));
+    gzFile in = gzopen(path.c_str(), "rb");
+    ASSERT_NE(in, nullptr);
+    std::string saved(content.size() + 16, '\0');
+    int size = gzread(in, &saved[0], static_cast<unsigned>(saved.size()));
+    gzclose(in);
+    ASSERT_GE(size, 0);
+    saved.resize(static_cast<size_t>(size));
+    EXPECT_EQ(saved, "+" + content);
+}
+
+TEST_F(DocumentTest, LoadPaged) {
+    std::string path = temp_path("editor_paged_test.txt");
+    const int total = 40 * PagedFile::PAGE_LINES;
+    std::string content;
+    for (int i = 0; i < total; i++) {
+        content += "line " + std::to_string(i) + "\n";
+    }
+    ASSERT_NO_FATAL_FAILURE(write_file(path, content));
+
+    Settings::instance().paged().min_file_size = 0;
+    Settings::instance().paged().cache_size = 1024 * 1024;
+    Settings::instance().paged().index_dir = temp_path("editor_index");
+
+    Document doc;
+    doc.load_from_file(path);
+    ASSERT_TRUE(doc.is_paged());
+    ASSERT_EQ(doc.total_lines(), total);
+    EXPECT_GE(doc.max_line_width(), static_cast<int>(("line " + std::to_string(total - 1)).size()));
+
+    // memory of decoded lines is bounded by the cache size, not by the file size
+    doc.prefetch(total / 2, 100);
+    for (int i = 0; i < total; i += 97) {
+        ASSERT_EQ(doc.line_width(i), static_cast<int>(("line " + std::to_string(i)).size()));
+    }
+    EXPECT_LT(doc.arena_used(), 3 * 1024 * 1024);
+
+    // edited lines are copied out of pages
+    doc.insert_text(Vec2i(0, total - 1), doc.load_raw("last "), Vec2i(0, total - 1), SelectionShape::TEXT_LIKE);
+    doc.remove_newline(Vec2i(6, 0), Vec2i(6, 0));
+    doc.save_to_file();
+    content.insert(content.rfind("line "), "last ");
+    content.erase(content.find('\n'), 1);
+    EXPECT_TRUE(read_file(path) == content);
+}
+
+TEST_F(DocumentTest, SaveChangedTail) {
+    std::string path = temp_path("editor_tail_test.txt");
+    std::string content;
+    for (int i = 0; i < 1000; i++) {
+        content += "line " + std::to_string(i) + "\n";
+    }
+    ASSERT_NO_FATAL_FAILURE(write_file(path, content));
+    Settings::instance().text().incremental_save_min_size = 0;
+
+    auto inode = [&path]() {
+        struct stat st;
+        ::stat(path.c_str(), &st);
+        return st.st_ino;
+    };
+
+    // edit near the end rewrites the file in place after the unchanged lines
+    Document doc;
+    doc.load_from_file(path);
+    ino_t loaded = inode();
+    doc.remove_newline(Vec2i(8, 990), Vec2i(8, 990));
+    doc.save_to_file();
+    size_t pos = content.find("line 991\n");
+    content.erase(pos - 1, 1);
+    EXPECT_EQ(read_file(path), content);
+    EXPECT_EQ(inode(), loaded);
+
+    // edit near the beginning writes a new file
+    doc.insert_text(Vec2i(0, 1), doc.load_raw("new\n"), Vec2i(0, 1), SelectionShape::TEXT_LIKE);
+    doc.save_to_file();
+    content.insert(content.find("line 1\n"), "new\n");
+    EXPECT_EQ(read_file(path), content);
+    EXPECT_NE(inode(), loaded);
+}
+
+TEST_F(DocumentTest, TornInPlaceSave) {
+    std::string path = temp_path("editor_torn_test.txt");
+    std::string content;
+    for (int i = 0; i < 1000; i++) {
+        content += "line " + std::to_string(i) + "\n";
+    }
+    ASSERT_NO_FATAL_FAILURE(write_file(path, content));
+
+    // journal of the edits being saved, the save crashed while it rewrote the tail in place
+    std::string journal_path = remove_after(Journal::path_for(path));
+    remove_after(journal_path + ".orphaned");
+    {
+        Journal journal(journal_path, FileStamp::of(path), 0, 1000);
+        journal.append({Journal::Op::INSERT_TEXT, SelectionShape::TEXT_LIKE, Vec2i(0, 995), Vec2i(0, 995), "new "});
+    }
+    size_t torn = content.find("line 995\n");
+    ASSERT_EQ(::truncate(path.c_str(), static_cast<off_t>(torn + 3)), 0);
+
+    // torn file does not match the journal, edits are not replayed but kept aside
+    Document doc;
+    doc.load_from_file(path);
+    EXPECT_EQ(doc.total_lines(), 996);
+    EXPECT_EQ(doc.line_width(995), 3);
+    EXPECT_NE(::access(journal_path.c_str(), F_OK), 0);
+    EXPECT_EQ(::access((journal_path + ".orphaned").c_str(), F_OK), 0);
+}
+
+TEST_F(DocumentTest, RecoverJournal) {
+    std::string path = temp_path("editor_journal_test.txt");
+    ASSERT_NO_FATAL_FAILURE(write_file(path, "one\ntwo\n"));
+
+    // journal left by a crashed session, the last record is torn
+    std::string journal_path = remove_after(Journal::path_for(path));
+    {
+        Journal journal(journal_path, FileStamp::of(path), 0, 1000);
+        journal.append({Journal::Op::INSERT_TEXT, SelectionShape::TEXT_LIKE, Vec2i(0, 1), Vec2i(0, 1), "X\ty"});
+        journal.append({Journal::Op::ADD_NEWLINE, SelectionShape::NONE, Vec2i(1, 0), Vec2i(1, 0), ""});
+        journal.append({Journal::Op::REMOVE_TEXT, SelectionShape::TEXT_LIKE, Vec2i(0, 2), Vec2i(1, 2), ""});
+    }
+    ASSERT_NO_FATAL_FAILURE(append_file(journal_path, "torn"));
+
+    Document doc;
+    doc.load_from_file(path);
+    ASSERT_EQ(doc.total_lines(), 3);
+    EXPECT_EQ(doc.line_width(0), 1);
+    EXPECT_EQ(doc.line_width(1), 2);
+    EXPECT_EQ(doc.line_width(2), 5);
+    EXPECT_EQ(doc.glyph_at(Vec2i(0, 2)).real(), "\t");
+
+    // saving starts the journal anew, closing the document removes it
+    doc.save_to_file();
+    EXPECT_EQ(read_file(path), "o\nne\n\tytwo\n");
+
+    doc.start_loading(path + ".missing");
+    EXPECT_NE(::access(journal_path.c_str(), F_OK), 0);
+}
+
+TEST_F(DocumentTest, RecoverFilteredText) {
+    std::string path = temp_path("editor_journal_filter_test.txt");
+    std::string journal_path = remove_after(Journal::path_for(path));
+    std::string line(1000, 'x');
+    std::string content = "head\n";
+    for (int i = 0; i < 3000; i++) {
+        content += line + "\n";
+    }
+    ASSERT_NO_FATAL_FAILURE(write_file(path, content + "tail\n"));
+    auto saved = [&path](Document& doc) {
+        doc.save_to_file();
+        return read_file(path);
+    };
+
+    // long output is journaled in several blocks of lines
+    Document doc;
+    doc.load_from_file(path);
+    ASSERT_TRUE(doc.filter_text({0, 1}, {1000, 3000}, "tr x y", {0, 0}, SelectionShape::TEXT_LIKE));
+    ASSERT_TRUE(doc.filter_text({0, 1}, {500, 3000}, "tr y z", {0, 0}, SelectionShape::RECTANGULAR));
+    std::vector<Journal::Record> records;
+    size_t stable = 0;
+    for (int i = 0; (i < 500) && (stable < 10); i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        size_t count = records.size();
+        size_t valid_size;
+        records.clear();
+        Journal::read(journal_path, FileStamp::of(path), records, valid_size);
+        stable = (records.size() == count)? stable + 1: 0;
+    }
+    EXPECT_GT(records.size(), 4);
+
+    // the same text is recovered from the blocks
+    Document recovered;
+    recovered.load_from_file(path);
+    std::string text = saved(recovered);
+    EXPECT_NE(text.find("zzz"), std::string::npos);
+    EXPECT_EQ(text.find("x"), std::string::npos);
+    EXPECT_EQ(saved(doc), text);
+}
+
+TEST_F(DocumentTest, FollowFile) {
+    std::string path = temp_path("editor_follow_test.txt");
+    ASSERT_NO_FATAL_FAILURE(write_file(path, "one\ntw"));
+    // waits until the follower thread reads appended lines, or until the file is loaded again
+    auto poll = [](Document& doc, int lines) {
+        for (int i = 0; (i < 500) && ((doc.total_lines() != lines) || doc.is_loading()); i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            doc.poll_following();
+            doc.poll_loading();
+        }
+    };
+
+    Document doc;
+    doc.set_following(true);
+    doc.load_from_file(path);
+    ASSERT_TRUE(doc.is_following());
+    ASSERT_EQ(doc.total_lines(), 2);
+
+    // unfinished line continues the last loaded one, the line being written is held back
+    ASSERT_NO_FATAL_FAILURE(append_file(path, "o\nthree\nfo"));
+    poll(doc, 3);
+    ASSERT_EQ(doc.total_lines(), 3);
+    EXPECT_EQ(doc.line_width(1), 3);
+    EXPECT_EQ(doc.line_width(2), 5);
+    ASSERT_NO_FATAL_FAILURE(append_file(path, "ur\n"));
+    poll(doc, 4);
+    ASSERT_EQ(doc.total_lines(), 4);
+    EXPECT_EQ(doc.line_width(3), 4);
+
+    // truncated file is loaded again and followed further
+    ASSERT_NO_FATAL_FAILURE(write_file(path, "new\n"));
+    poll(doc, 1);
+    ASSERT_EQ(doc.total_lines(), 1);
+    ASSERT_NO_FATAL_FAILURE(append_file(path, "line\n"));
+    poll(doc, 2);
+    ASSERT_EQ(doc.total_lines(), 2);
+    EXPECT_EQ(doc.line_width(1), 4);
+    EXPECT_TRUE(doc.is_following());
+
+    doc.set_following(false);
+}
+
+TEST_F(DocumentTest, ReadStream) {
+    std::string path = temp_path("editor_stream_test.txt");
+    int fds[2];
+    ASSERT_EQ(::pipe(fds), 0);
+    auto write_all = [&fds](const std::string& data) {
+        ASSERT_EQ(::write(fds[1], data.data(), data.size()), static_cast<ssize_t>(data.size()));
+    };
+
+    Document doc;
+    ASSERT_TRUE(doc.start_reading(fds[0], path));
+    ::close(fds[0]);
+    EXPECT_TRUE(doc.is_streaming());
+
+    // lines appear while the stream is still open, the line being written is held back
+    write_all("zero\nfirst\nsec");
+    for (int i = 0; (i < 500) && (doc.total_lines() < 2); i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        doc.poll_following();
+    }
+    ASSERT_EQ(doc.total_lines(), 2);
+    EXPECT_EQ(doc.line_width(0), 4);
+    EXPECT_EQ(doc.line_width(1), 5);
+
+    // the last line is complete at the end of the stream even without a newline
+    std::string rest = "ond\n";
+    for (int i = 0; i < 1000; i++) {
+        rest += "line " + std::to_string(i) + "\n";
+    }
+    write_all(rest + "last");
+    ::close(fds[1]);
+    for (int i = 0; (i < 500) && doc.is_streaming(); i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        doc.poll_following();
+    }
+    ASSERT_FALSE(doc.is_streaming());
+    ASSERT_EQ(doc.total_lines(), 1004);
+    EXPECT_EQ(doc.line_width(2), 6);
+    EXPECT_EQ(doc.line_width(1002), 8);
+    EXPECT_EQ(doc.line_width(1003), 4);
+
+    doc.save_to_file();
+    EXPECT_EQ(read_file(path), "zero\nfirst\nsecond\n" + rest.substr(4) + "last\n");
+}
+
+TEST_F(DocumentTest, FilterText) {
+    std::string path = temp_path("editor_filter_test.txt");
+    ASSERT_NO_FATAL_FAILURE(write_file(path, "head\nc\nb\na\ntail\n"));
+    auto saved = [&path](Document& doc) {
+        doc.save_to_file();
+        return read_file(path);
+    };
+
+    // lines between the first and the last one are sorted, the replacement is undone in one step
+    Document doc;
+    doc.load_from_file(path);
+    ASSERT_TRUE(doc.filter_text({0, 1}, {1, 3}, "sort", {0, 0}, SelectionShape::TEXT_LIKE));
+    EXPECT_EQ(saved(doc), "head\na\nb\nc\ntail\n");
+    doc.undo();
+    EXPECT_EQ(saved(doc), "head\nc\nb\na\ntail\n");
+    doc.redo();
+    EXPECT_EQ(saved(doc), "head\na\nb\nc\ntail\n");
+
+    // failed command does not change the text
+    EXPECT_FALSE(doc.filter_text({0, 0}, {4, 4}, "cat >/dev/null; exit 3", {0, 0}, SelectionShape::TEXT_LIKE));
+    EXPECT_EQ(doc.total_lines(), 5);
+
+    // output of a block should have a line for every row of the block
+    EXPECT_FALSE(doc.filter_text({1, 4}, {3, 4}, "seq 5", {0, 0}, SelectionShape::RECTANGULAR));
+    EXPECT_FALSE(doc.filter_text({0, 2}, {1, 4}, "head -n 1", {0, 0}, SelectionShape::RECTANGULAR));
+    EXPECT_EQ(saved(doc), "head\na\nb\nc\ntail\n");
+    ASSERT_TRUE(doc.filter_text({0, 0}, {2, 0}, "tr a-z A-Z", {0, 0}, SelectionShape::RECTANGULAR));
+    EXPECT_EQ(saved(doc), "HEad\na\nb\nc\ntail\n");
+    doc.undo();
+    EXPECT_EQ(saved(doc), "head\na\nb\nc\ntail\n");
+
+    // command may stop reading before the whole input is written
+    std::string line(1000, 'x');
+    for (int i = 0; i < 5000; i++) {
+        doc.insert_text({0, 0}, doc.load_raw((line + "\n").c_str()), {0, 0}, SelectionShape::TEXT_LIKE);
+    }
+    ASSERT_TRUE(doc.filter_text({0, 0}, {4, 5004}, "head -n 2", {0, 0}, SelectionShape::TEXT_LIKE));
+    EXPECT_EQ(saved(doc), line + "\n" + line + "\n");
+
+    // empty output leaves an empty line
+    ASSERT_TRUE(doc.filter_text({0, 0}, {1000, 1}, "true", {0, 0}, SelectionShape::TEXT_LIKE));
+    EXPECT_EQ(doc.total_lines(), 1);
+    EXPECT_EQ(doc.line_width(0), 0);
+}
+
+TEST_F(DocumentTest, LoadInBackground) {
+    std::string path = temp_path("editor_background_test.txt");
+    const int total = 50000;
+    std::string content;
+    for (int i = 0; i < total; i++) {
+        content += "line " + std::to_string(i) + "\n";
+    }
+    ASSERT_NO_FATAL_FAILURE(write_file(path, content));
+
+    Document doc;
+    ASSERT_TRUE(doc.start_loading(path));
+    while (doc.is_loading()) {
+        doc.poll_loading();
+    }
+    EXPECT_TRUE(doc.is_complete());
+    ASSERT_EQ(doc.total_lines(), total);
+    // several chunks are appended as separate pieces
+    EXPECT_GT(doc.text().lines().total_pieces(), 1);
+    for (int i: {0, 1, total / 2, total - 1}) {
+        EXPECT_EQ(doc.line_width(i), static_cast<int>(("line " + std::to_string(i)).size()));
+    }
+
+    // cancelled loading never leaves worker running
+    ASSERT_TRUE(doc.start_loading(path));
+    doc.cancel_loading();
+    while (doc.is_loading()) {
+        doc.poll_loading();
+    }
+    EXPECT_GE(doc.total_lines(), 1);
+
+    EXPECT_FALSE(doc.start_loading(path + ".missing"));
+    EXPECT_FALSE(doc.is_loading());
+}
+
+TEST_F(DocumentTest, LoadInParallel) {
+    std::string path = temp_path("editor_parallel_test.txt");
+    const int total = 200000;
+    std::string content;
+    for (int i = 0; i < total; i++) {
+        content += std::string(i % 7, '.') + std::to_string(i) + "\n";
+    }
+    ASSERT_NO_FATAL_FAILURE(write_file(path, content));
+
+    Settings::instance().text().load_threads = 4;
+
+    // chunks parsed by different threads are stitched in the file order
+    Document doc;
+    doc.load_from_file(path);
+    EXPECT_TRUE(doc.is_complete());
+    ASSERT_EQ(doc.total_lines(), total);
+    for (int i = 0; i < total; i++) {
+        ASSERT_EQ(doc.line_width(i), static_cast<int>(i % 7 + std::to_string(i).size()));
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef TEST_FILES_HPP_
+#define TEST_FILES_HPP_
+
+#include <gtest/gtest.h>
+
+#include "settings.hpp"
+
+#include <dirent.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+
+
+// Test working with files in the temporary directory. Files and directories named by
+// temp_path() or remove_after() are removed with everything under them when the test ends,
+// also when an assertion has failed; settings of texts, files and history are restored then.
+class TempFileFixture: public ::testing::Test {
+protected:
+    void SetUp() override {
+        Settings& settings = Settings::instance();
+        text_ = settings.text();
+        paged_ = settings.paged();
+        journal_ = settings.journal();
+        history_ = settings.history();
+        follow_ = settings.follow();
+        filter_ = settings.filter();
+    }
+
+    void TearDown() override {
+        Settings& settings = Settings::instance();
+        settings.text() = text_;
+        settings.paged() = paged_;
+        settings.journal() = journal_;
+        settings.history() = history_;
+        settings.follow() = follow_;
+        settings.filter() = filter_;
+        for (auto it = paths_.rbegin(); it != paths_.rend(); ++it) {
+            remove_tree(*it);
+        }
+    }
+
+    // Path of `name` in the temporary directory, anything left there by a crashed run is removed
+    std::string temp_path(const std::string& name) {
+        std::string path = ::testing::TempDir() + name;
+        remove_tree(path);
+        return remove_after(path);
+    }
+
+    // `path` made by the code under test is removed after the test
+    std::string remove_after(const std::string& path) {
+        paths_.push_back(path);
+        return path;
+    }
+
+    // Writes `content` to `path`, to be called in ASSERT_NO_FATAL_FAILURE()
+    static void write_file(const std::string& path, const std::string& content) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out << content;
+        out.close();
+        ASSERT_FALSE(out.fail()) << "cannot write " << path;
+    }
+
+    static void append_file(const std::string& path, const std::string& content) {
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        out << content;
+        out.close();
+        ASSERT_FALSE(out.fail()) << "cannot append to " << path;
+    }
+
+    static std::string read_file(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    }
+
+    // regular files in the directory `path`
+    static std::vector<std::string> files_in(const std::string& path) {
+        std::vector<std::string> files;
+        if (DIR* dir = ::opendir(path.c_str())) {
+            while (const dirent* entry = ::readdir(dir)) {
+                if (entry->d_type == DT_REG) {
+                    files.push_back(path + "/" + entry->d_name);
+                }
+            }
+            ::closedir(dir);
+        }
+        return files;
+    }
+
+    // Removes files and directories under `path` and `path` itself
+    static void remove_tree(const std::string& path) {
+        if (DIR* dir = ::opendir(path.c_str())) {
+            while (const dirent* entry = ::readdir(dir)) {
+                std::string name = entry->d_name;
+                if ((name != ".") && (name != "..")) {
+                    remove_tree(path + "/" + name);
+                }
+            }
+            ::closedir(dir);
+            ::rmdir(path.c_str());
+        } else {
+            std::remove(path.c_str());
+        }
+    }
+
+private:
+    std::vector<std::string> paths_;
+    TextSettings text_;
+    PagedSettings paged_;
+    JournalSettings journal_;
+    HistorySettings history_;
+    FollowSettings follow_;
+    FilterSettings filter_;
+};
+
+#endif // TEST_FILES_HPP_
@@ -0,0 +1,357 @@
+#include <gtest/gtest.h>
+
+#include "document.hpp"
+#include "settings.hpp"
+#include "test_files.hpp"
+#include "test_allocations.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <ctime>
+#include <string>
+#include <vector>
+
+
+class HistoryTest: public TempFileFixture {
+};
+
+// Histories are kept in a temporary store directory
+class HistoryStoreTest: public TempFileFixture {
+protected:
+    void SetUp() override {
+        TempFileFixture::SetUp();
+        store_dir = temp_path("editor_history");
+        Settings::instance().history().persistent = true;
+        Settings::instance().history().store_dir = store_dir;
+    }
+
+    std::string store_dir;
+};
+
+TEST_F(HistoryTest, UndoHistory) {
+    Settings::instance().history().max_items = 1024;
+    Document doc;
+    const int total = 1024 + 500;
+    for (int i = 0; i < total; i++) {
+        doc.add_newline({0, 0}, {0, 0});
+    }
+    ASSERT_EQ(doc.total_lines(), total + 1);
+
+    // the oldest edits are dropped, the rest is undone and redone in order
+    int undone = 0;
+    while (doc.undo()) {
+        undone++;
+    }
+    EXPECT_EQ(undone, 1024);
+    EXPECT_EQ(doc.total_lines(), total + 1 - undone);
+    for (int i = 0; i < 10; i++) {
+        ASSERT_NE(doc.redo(), nullptr);
+    }
+    EXPECT_EQ(doc.total_lines(), total + 1 - undone + 10);
+
+    // a new edit starts a branch with nothing to redo, typed characters make one item
+    doc.insert_text({0, 0}, doc.load_raw("a"), {0, 0}, SelectionShape::TEXT_LIKE);
+    doc.insert_text({1, 0}, doc.load_raw("b"), {1, 0}, SelectionShape::TEXT_LIKE);
+    EXPECT_EQ(doc.redo(), nullptr);
+    const HistoryItem* item = doc.undo();
+    ASSERT_NE(item, nullptr);
+    EXPECT_EQ(item->kind, EditKind::ADD_TEXT);
+    EXPECT_EQ(doc.line_width(0), 0);
+    EXPECT_EQ(doc.total_lines(), total + 1 - undone + 10);
+}
+
+TEST_F(HistoryStoreTest, UndoTree) {
+    std::string path = temp_path("editor_tree_test.txt");
+    ASSERT_NO_FATAL_FAILURE(write_file(path, "text\n"));
+    {
+        Document doc;
+        doc.load_from_file(path);
+        doc.insert_text({4, 0}, doc.load_raw(" one"), {4, 0}, SelectionShape::TEXT_LIKE);
+        doc.add_newline({8, 0}, {8, 0});
+
+        // an edit after undo starts a new branch, the undone newline is kept in the other one
+        doc.undo();
+        doc.insert_text({8, 0}, doc.load_raw(" two"), {8, 0}, SelectionShape::TEXT_LIKE);
+        EXPECT_EQ(doc.redo(), nullptr);
+        EXPECT_EQ(doc.line_width(0), 12);
+        EXPECT_EQ(doc.history().size(), 3);
+        ASSERT_NE(doc.undo(), nullptr);
+        EXPECT_TRUE(doc.switch_branch());
+        ASSERT_NE(doc.redo(), nullptr);
+        EXPECT_EQ(doc.line_width(0), 8);
+        EXPECT_EQ(doc.total_lines(), 2);
+
+        // states are visited in the order they were made, through the common ancestor
+        ASSERT_NE(doc.later(), nullptr);
+        EXPECT_EQ(doc.line_width(0), 12);
+        EXPECT_EQ(doc.total_lines(), 1);
+        EXPECT_EQ(doc.later(), nullptr);
+        ASSERT_NE(doc.earlier(), nullptr);
+        EXPECT_EQ(doc.total_lines(), 2);
+        ASSERT_NE(doc.earlier(), nullptr);
+        EXPECT_EQ(doc.line_width(0), 8);
+        EXPECT_EQ(doc.total_lines(), 1);
+        ASSERT_NE(doc.jump_to(History::ROOT), nullptr);
+        EXPECT_EQ(doc.line_width(0), 4);
+        EXPECT_EQ(doc.earlier(), nullptr);
+        while (doc.later()) {
+        }
+        EXPECT_EQ(doc.line_width(0), 12);
+        doc.save_to_file();
+    }
+    {
+        // branches are restored with the history of the file
+        Document doc;
+        doc.load_from_file(path);
+        ASSERT_NE(doc.undo(), nullptr);
+        EXPECT_EQ(doc.line_width(0), 8);
+        EXPECT_TRUE(doc.switch_branch());
+        ASSERT_NE(doc.redo(), nullptr);
+        EXPECT_EQ(doc.line_width(0), 8);
+        EXPECT_EQ(doc.total_lines(), 2);
+    }
+}
+
+TEST_F(HistoryTest, SquashBackspaces) {
+    Document doc;
+    doc.insert_text({0, 0}, doc.load_raw("abcdef"), {0, 0}, SelectionShape::TEXT_LIKE);
+    doc.add_newline({6, 0}, {6, 0});
+
+    // characters removed by backspace are prepended to one item
+    for (int x = 6; x > 0; x--) {
+        doc.remove_text({x - 1, 0}, {x, 0}, {x, 0}, SelectionShape::TEXT_LIKE);
+    }
+    EXPECT_EQ(doc.line_width(0), 0);
+    const HistoryItem* item = doc.undo();
+    ASSERT_NE(item, nullptr);
+    EXPECT_EQ(item->kind, EditKind::REMOVE_TEXT);
+    EXPECT_EQ(item->pos, Vec2i(0, 0));
+    ASSERT_EQ(item->text.line_width(0), 6);
+    EXPECT_EQ(item->text.line_at({0, 0}).front().real(), "a");
+    EXPECT_EQ(item->text.line_at({0, 0}).back().real(), "f");
+    EXPECT_EQ(doc.line_width(0), 6);
+    EXPECT_EQ(doc.total_lines(), 2);
+}
+
+TEST_F(HistoryTest, SquashWithoutAllocating) {
+    History history;
+    const int total = 500;
+    std::vector<Text> typed;
+    std::vector<Text> removed;
+    for (int i = 0; i < total; i++) {
+        typed.push_back(Text(content_t(1, line_t(1, Glyph::from_codepoint('a' + i % 26)))));
+        removed.push_back(Text(content_t(1, line_t(1, Glyph::from_codepoint('a' + i % 26)))));
+    }
+
+    // the first squash moves the line to the item's own buffer, the next ones append to it in place
+    history.push_text(EditKind::ADD_TEXT, {0, 0}, typed[0], {0, 0}, SelectionShape::TEXT_LIKE);
+    history.push_text(EditKind::ADD_TEXT, {1, 0}, typed[1], {1, 0}, SelectionShape::TEXT_LIKE);
+    int grown = 0;
+    for (int x = 2; x < total; x++) {
+        size_t capacity = history.current_item()->text.line_at({0, 0}).capacity();
+        size_t count = count_allocations([&history, &typed, x]() {
+            history.push_text(EditKind::ADD_TEXT, {x, 0}, typed[x], {x, 0}, SelectionShape::TEXT_LIKE);
+        });
+        if (history.current_item()->text.line_at({0, 0}).capacity() == capacity) {
+            EXPECT_EQ(count, 0) << "character " << x;
+        } else {
+            grown++;
+        }
+    }
+    EXPECT_EQ(history.size(), 1);
+    EXPECT_EQ(history.current_item()->text.line_width(0), total);
+    // capacity of the line doubles
+    EXPECT_LT(grown, 10);
+
+    // backspaces prepend removed characters in place the same way
+    for (int x = total; x > total - 2; x--) {
+        history.push_back(HistoryItem(EditKind::REMOVE_TEXT, {x - 1, 0}, std::move(removed[x - 1]), {x, 0}, SelectionShape::TEXT_LIKE));
+    }
+    grown = 0;
+    for (int x = total - 2; x > 0; x--) {
+        size_t capacity = history.current_item()->text.line_at({0, 0}).capacity();
+        size_t count = count_allocations([&history, &removed, x]() {
+            history.push_back(HistoryItem(EditKind::REMOVE_TEXT, {x - 1, 0}, std::move(removed[x - 1]), {x, 0}, SelectionShape::TEXT_LIKE));
+        });
+        if (history.current_item()->text.line_at({0, 0}).capacity() == capacity) {
+            EXPECT_EQ(count, 0) << "backspace " << x;
+        } else {
+            grown++;
+        }
+    }
+    EXPECT_EQ(history.size(), 2);
+    EXPECT_EQ(history.current_item()->pos, Vec2i(0, 0));
+    EXPECT_EQ(history.current_item()->text.line_width(0), total);
+    EXPECT_LT(grown, 10);
+
+    // moving between the items and reading them back allocates nothing
+    size_t count = count_allocations([&history]() {
+        for (int i = 0; i < 100; i++) {
+            history.load_undo_group();
+            history.dec();
+            history.load_undo_group();
+            history.dec();
+            history.load_redo_group();
+            history.inc();
+            history.load_redo_group();
+            history.inc();
+        }
+    });
+    EXPECT_EQ(count, 0);
+    EXPECT_EQ(history.current_item()->kind, EditKind::REMOVE_TEXT);
+}
+
+TEST_F(HistoryTest, SpillHistory) {
+    std::string path = temp_path("editor_spill_test.txt");
+    std::string kept_path = temp_path("editor_spill_kept_test.txt");
+    std::string content;
+    for (int i = 0; i < 1000; i++) {
+        content += std::to_string(i) + ": " + std::string(200, 'a' + i % 26) + " \xd1\x8b\n";
+    }
+    ASSERT_NO_FATAL_FAILURE(write_file(path, content));
+    ASSERT_NO_FATAL_FAILURE(write_file(kept_path, content));
+    auto saved = [&path](Document& doc) {
+        doc.save_to_file();
+        return read_file(path);
+    };
+
+    // the same edits are made with a small budget and with all texts kept in memory
+    HistorySettings& settings = Settings::instance().history();
+    settings.memory_budget = 64 * 1024;
+    settings.spill_dir = ::testing::TempDir();
+    settings.persistent = false;
+    Document doc;
+    doc.load_from_file(path);
+    settings.memory_budget = -1;
+    Document kept;
+    kept.load_from_file(kept_path);
+
+    // every rectangle is cut into lines of its own, which are held by the history only;
+    // newlines keep the rectangles from being squashed
+    for (Document* edited: {&doc, &kept}) {
+        for (int i = 0; i < 8; i++) {
+            edited->remove_text({0, i * 100}, {150, i * 100 + 99}, {0, 0}, SelectionShape::RECTANGULAR);
+            edited->add_newline({0, 0}, {0, 0});
+        }
+    }
+    EXPECT_GT(doc.history().spilled(), 0);
+    EXPECT_LT(doc.history().memory_used(), 4 * 100 * 150 * sizeof(Glyph));
+    // spilled lines are freed
+    EXPECT_LT(doc.arena_used() + 4 * 100 * 150 * sizeof(Glyph), kept.arena_used());
+
+    // removed lines shared with the loaded text would not be freed, so they are not counted
+    size_t used = kept.history().memory_used();
+    kept.remove_text({0, 900}, {0, 1000}, {0, 0}, SelectionShape::TEXT_LIKE);
+    EXPECT_LT(kept.history().memory_used() - used, 10 * 220 * sizeof(Glyph));
+
+    // spilled texts are read back on undo, and spilled again when undo goes further
+    while (doc.undo()) {
+    }
+    EXPECT_EQ(saved(doc), content);
+    while (doc.redo()) {
+    }
+    while (doc.undo()) {
+    }
+    EXPECT_EQ(saved(doc), content);
+}
+
+TEST_F(HistoryStoreTest, PersistentHistory) {
+    std::string path = temp_path("editor_persistent_test.txt");
+    std::string content;
+    for (int i = 0; i < 100; i++) {
+        content += "line " + std::to_string(i) + "\n";
+    }
+    ASSERT_NO_FATAL_FAILURE(write_file(path, content));
+
+    {
+        // file which is only viewed has no store
+        Document doc;
+        doc.load_from_file(path);
+        EXPECT_EQ(doc.undo(), nullptr);
+        doc.save_to_file();
+    }
+    EXPECT_TRUE(files_in(store_dir).empty());
+
+    // stores not written for `store_days` are removed when a store is written
+    ::mkdir(store_dir.c_str(), 0700);
+    std::string old_store = store_dir + "/0123456789abcdef.hist";
+    ASSERT_NO_FATAL_FAILURE(write_file(old_store, "old"));
+    struct timespec times[2] = {{0, 0}, {0, 0}};
+    times[0].tv_sec = times[1].tv_sec = std::time(nullptr) - (Settings::instance().history().store_days + 1) * 24 * 60 * 60;
+    ::utimensat(AT_FDCWD, old_store.c_str(), times, 0);
+    std::string edited;
+    {
+        Document doc;
+        doc.load_from_file(path);
+        doc.insert_text({0, 0}, doc.load_raw("abc"), {0, 0}, SelectionShape::TEXT_LIKE);
+        doc.add_newline({3, 0}, {3, 0});
+        doc.remove_text({0, 5}, {4, 6}, {0, 5}, SelectionShape::TEXT_LIKE);
+        doc.save_to_file();
+        edited = read_file(path);
+        // edit which is not saved can be redone after the file is opened again
+        doc.insert_text({0, 10}, doc.load_raw("unsaved"), {0, 10}, SelectionShape::TEXT_LIKE);
+    }
+    ASSERT_NE(edited, content);
+    ASSERT_EQ(files_in(store_dir).size(), 1);
+    EXPECT_NE(files_in(store_dir)[0], old_store);
+    {
+        Document doc;
+        doc.load_from_file(path);
+        // items are read on first use
+        EXPECT_EQ(doc.history().size(), 0);
+        int undone = 0;
+        while (doc.undo()) {
+            undone++;
+        }
+        EXPECT_EQ(undone, 3);
+        EXPECT_EQ(doc.history().size(), 4);
+        doc.save_to_file();
+        EXPECT_EQ(read_file(path), content);
+        while (doc.redo()) {
+        }
+        EXPECT_EQ(doc.line_width(10), static_cast<int>(std::string("unsaved").size() + std::string("line 10").size()));
+        doc.undo();
+        doc.save_to_file();
+        EXPECT_EQ(read_file(path), edited);
+    }
+
+    // history of another version of the file is not used
+    ASSERT_NO_FATAL_FAILURE(write_file(path, content + "changed\n"));
+    {
+        Document doc;
+        doc.load_from_file(path);
+        EXPECT_EQ(doc.undo(), nullptr);
+    }
+    // the store of the previous version is removed
+    EXPECT_TRUE(files_in(store_dir).empty());
+}
+
+TEST_F(HistoryStoreTest, UnreadableGroup) {
+    std::string path = temp_path("editor_group_test.txt");
+    ASSERT_NO_FATAL_FAILURE(write_file(path, "head\none\ntwo\ntail\n"));
+    {
+        Document doc;
+        doc.load_from_file(path);
+        ASSERT_TRUE(doc.filter_text({0, 1}, {3, 2}, "tr a-z A-Z", {0, 0}, SelectionShape::TEXT_LIKE));
+        doc.save_to_file();
+    }
+    ASSERT_EQ(read_file(path), "head\nONE\nTWO\ntail\n");
+
+    // text removed by the filter is damaged in the store, its output can still be read
+    std::vector<std::string> stores = files_in(store_dir);
+    ASSERT_EQ(stores.size(), 1);
+    std::string store = read_file(stores[0]);
+    size_t removed = store.find("one\ntwo");
+    ASSERT_NE(removed, std::string::npos);
+    store[removed] = 'O';
+    ASSERT_NO_FATAL_FAILURE(write_file(stores[0], store));
+
+    // the filter is undone whole or not at all
+    Document doc;
+    doc.load_from_file(path);
+    EXPECT_EQ(doc.undo(), nullptr);
+    EXPECT_EQ(doc.earlier(), nullptr);
+    EXPECT_EQ(doc.jump_to(History::ROOT), nullptr);
+    doc.save_to_file();
+    EXPECT_EQ(read_file(path), "head\nONE\nTWO\ntail\n");
+}
@@ -0,0 +1,36 @@
+#include <gtest/gtest.h>
+
+#include "journal.hpp"
+#include "test_files.hpp"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+
+class JournalTest: public TempFileFixture {
+};
+
+TEST_F(JournalTest, ResetWhileAppending) {
+    std::string path = temp_path(".editor_journal_reset_test.txt.swp");
+    const FileStamp saved = {100, 200};
+    for (int round = 0; round < 2000; round++) {
+        {
+            // the file is saved while the worker writes the edit made before, after a delay
+            // which varies, so the reset falls on every step of the worker
+            Journal journal(path, {1, 1}, 0, 1000);
+            journal.append({Journal::Op::INSERT_TEXT, SelectionShape::TEXT_LIKE, Vec2i(0, 0), Vec2i(0, 0), "before"});
+            for (volatile int spin = 0; spin < round % 200 * 20; spin++) {
+            }
+            journal.reset(saved);
+            journal.append({Journal::Op::ADD_NEWLINE, SelectionShape::NONE, Vec2i(0, 0), Vec2i(0, 0), "after"});
+        }
+
+        // records made before the reset are never written after its header
+        std::vector<Journal::Record> records;
+        size_t valid_size;
+        ASSERT_EQ(Journal::read(path, saved, records, valid_size), Journal::Status::OK);
+        ASSERT_EQ(records.size(), 1) << "round " << round;
+        EXPECT_EQ(records[0].text, "after");
+    }
+}
@@ -0,0 +1,93 @@
+#include <gtest/gtest.h>
+
+#include "paged_file.hpp"
+#include "test_files.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+
+
+class PagedFileTest: public TempFileFixture {
+};
+
+TEST_F(PagedFileTest, SavedIndex) {
+    std::string path = temp_path("editor_index_test.txt");
+    std::string index_dir = temp_path("editor_index") + "/nested";
+    const int total = 10 * PagedFile::PAGE_LINES + 5;
+    std::string content;
+    for (int i = 0; i < total; i++) {
+        content += "line " + std::to_string(i) + "\n";
+    }
+    ASSERT_NO_FATAL_FAILURE(write_file(path, content));
+    // lines of blank glyphs as long as the lines of the file
+    auto parse = [](const char* start, const char* stop) {
+        content_t lines;
+        for (const char* pos = start; ; ) {
+            const char* eol = std::find(pos, stop, '\n');
+            lines.push_back(line_t(eol - pos));
+            if (eol == stop) {
+                break;
+            }
+            pos = eol + 1;
+        }
+        return lines;
+    };
+
+    // the first open builds the index and saves it, the second one loads it
+    std::vector<uint64_t> offsets;
+    {
+        PagedFile file(path, 1024 * 1024, index_dir, parse);
+        EXPECT_FALSE(file.index_loaded());
+        for (size_t page = 0; page < file.pages(); page++) {
+            offsets.push_back(file.page_offset(page));
+        }
+    }
+    {
+        PagedFile file(path, 1024 * 1024, index_dir, parse);
+        EXPECT_TRUE(file.index_loaded());
+        ASSERT_EQ(file.size(), static_cast<size_t>(total));
+        ASSERT_EQ(file.pages(), offsets.size());
+        for (size_t page = 0; page < file.pages(); page++) {
+            EXPECT_EQ(file.page_offset(page), offsets[page]);
+        }
+        EXPECT_EQ(file.line(total - 1).size(), ("line " + std::to_string(total - 1)).size());
+    }
+
+    // index with pages out of order is built again, header is 48 bytes and page infos are 24 bytes long
+    std::vector<std::string> indices = files_in(index_dir);
+    ASSERT_EQ(indices.size(), 1);
+    {
+        std::fstream out(indices[0], std::ios::in | std::ios::out | std::ios::binary);
+        out.seekp(48 + 3 * 24);
+        out.write(reinterpret_cast<const char*>(&offsets[4]), sizeof(offsets[4]));
+        out.close();
+        ASSERT_FALSE(out.fail());
+    }
+    {
+        PagedFile file(path, 1024 * 1024, index_dir, parse);
+        EXPECT_FALSE(file.index_loaded());
+        EXPECT_EQ(file.page_offset(3), offsets[3]);
+    }
+
+    // file changed in place keeping its size and time is indexed again
+    struct stat st;
+    ASSERT_EQ(::stat(path.c_str(), &st), 0);
+    {
+        std::fstream out(path, std::ios::in | std::ios::out);
+        out.seekp(0);
+        out << "LINE";
+        out.close();
+        ASSERT_FALSE(out.fail());
+    }
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    ASSERT_EQ(::utimensat(AT_FDCWD, path.c_str(), times, 0), 0);
+    {
+        PagedFile file(path, 1024 * 1024, index_dir, parse);
+        EXPECT_FALSE(file.index_loaded());
+        EXPECT_EQ(file.size(), static_cast<size_t>(total));
+    }
+}
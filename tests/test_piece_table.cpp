@@ -0,0 +1,342 @@
+#include <gtest/gtest.h>
+
+#include "piece_table.hpp"
+#include "settings.hpp"
+#include "line_arena.hpp"
+
+#include <string>
+#include <memory>
+#include <thread>
+
+
+static line_t make_line(const std::string& s) {
+    line_t line;
+    char buf[2] = {0};
+    for (char c: s) {
+        buf[0] = c;
+        line.push_back(Glyph(buf, nullptr));
+    }
+    return line;
+}
+
+static std::string line_str(const line_t& line) {
+    std::string s;
+    for (const Glyph& g: line) {
+        s += g.real();
+    }
+    return s;
+}
+
+class PieceTableFixture: public ::testing::Test {
+protected:
+    void SetUp() override {
+        content_t content;
+        for (int i = 0; i < 10; i++) {
+            content.push_back(make_line(std::to_string(i)));
+        }
+        table = PieceTable(std::move(content));
+    }
+
+    PieceTable table;
+};
+
+TEST_F(PieceTableFixture, PieceTableInit) {
+    EXPECT_EQ(table.total_lines(), 10);
+    EXPECT_EQ(table.total_pieces(), 1);
+    EXPECT_EQ(line_str(table.line_at(0)), "0");
+    EXPECT_EQ(line_str(table.line_at(9)), "9");
+
+    PieceTable empty;
+    EXPECT_EQ(empty.total_lines(), 0);
+}
+
+TEST_F(PieceTableFixture, PieceTableInsertErase) {
+    table.insert_line(3, make_line("new"));
+    EXPECT_EQ(table.total_lines(), 11);
+    EXPECT_EQ(table.total_pieces(), 3);
+    EXPECT_EQ(line_str(table.line_at(2)), "2");
+    EXPECT_EQ(line_str(table.line_at(3)), "new");
+    EXPECT_EQ(line_str(table.line_at(4)), "3");
+
+    table.replace_line(0, make_line("zero"));
+    EXPECT_EQ(line_str(table.line_at(0)), "zero");
+    EXPECT_EQ(line_str(table.line_at(1)), "1");
+
+    PieceTable erased = table.erase(2, 3);
+    EXPECT_EQ(table.total_lines(), 8);
+    EXPECT_EQ(line_str(table.line_at(2)), "4");
+    EXPECT_EQ(erased.total_lines(), 3);
+    EXPECT_EQ(line_str(erased.line_at(0)), "2");
+    EXPECT_EQ(line_str(erased.line_at(1)), "new");
+    EXPECT_EQ(line_str(erased.line_at(2)), "3");
+
+    table.insert(8, std::move(erased));
+    EXPECT_EQ(table.total_lines(), 11);
+    EXPECT_EQ(line_str(table.line_at(10)), "3");
+}
+
+TEST_F(PieceTableFixture, PieceTableMetadata) {
+    EXPECT_EQ(table.total_glyphs(), 10);
+    EXPECT_EQ(table.max_line_width(), 1);
+
+    table.insert_line(4, make_line("longest line"));
+    EXPECT_EQ(table.total_glyphs(), 22);
+    EXPECT_EQ(table.max_line_width(), 12);
+
+    table.replace_line(7, make_line("even longer line"));
+    EXPECT_EQ(table.total_glyphs(), 37);
+    EXPECT_EQ(table.max_line_width(), 16);
+
+    table.erase(7, 1);
+    EXPECT_EQ(table.total_glyphs(), 21);
+    EXPECT_EQ(table.max_line_width(), 12);
+
+    PieceTable erased = table.erase(3, 3);
+    EXPECT_EQ(table.max_line_width(), 1);
+    EXPECT_EQ(erased.total_glyphs(), 14);
+    EXPECT_EQ(erased.max_line_width(), 12);
+}
+
+TEST_F(PieceTableFixture, PieceTableSlice) {
+    table.insert_line(5, make_line("middle"));
+
+    PieceTable slice = table.slice(4, 3);
+    EXPECT_EQ(slice.total_lines(), 3);
+    EXPECT_EQ(line_str(slice.line_at(0)), "4");
+    EXPECT_EQ(line_str(slice.line_at(1)), "middle");
+    EXPECT_EQ(line_str(slice.line_at(2)), "5");
+
+    // slice shares stored lines with the source table
+    EXPECT_EQ(&slice.line_at(0), &table.line_at(4));
+
+    PieceTable copy(table);
+    copy.replace_line(4, make_line("changed"));
+    EXPECT_EQ(line_str(table.line_at(4)), "4");
+    EXPECT_EQ(line_str(copy.line_at(4)), "changed");
+}
+
+TEST_F(PieceTableFixture, PieceTableManyEdits) {
+    std::vector<std::string> model;
+    for (int i = 0; i < 10; i++) {
+        model.push_back(std::to_string(i));
+    }
+
+    uint32_t seed = 12345;
+    auto next = [&seed]() { seed = seed * 1103515245u + 12345u; return (seed >> 16) & 0x7fff; };
+
+    for (int step = 0; step < 2000; step++) {
+        size_t total = model.size();
+        switch (next() % 3) {
+            case 0: {
+                size_t row = next() % (total + 1);
+                std::string s = "i" + std::to_string(step);
+                table.insert_line(row, make_line(s));
+                model.insert(model.begin() + row, s);
+                break;
+            }
+            case 1: {
+                if (total <= 1)
+                    break;
+                size_t row = next() % total;
+                size_t count = 1 + next() % std::min<size_t>(std::min<size_t>(3, total - row), total - 1);
+                table.erase(row, count);
+                model.erase(model.begin() + row, model.begin() + row + count);
+                break;
+            }
+            case 2: {
+                size_t row = next() % total;
+                std::string s = "r" + std::to_string(step);
+                table.replace_line(row, make_line(s));
+                model[row] = s;
+                break;
+            }
+        }
+        ASSERT_EQ(table.total_lines(), model.size());
+    }
+
+    for (size_t i = 0; i < model.size(); i++) {
+        EXPECT_EQ(line_str(table.line_at(i)), model[i]);
+    }
+}
+
+TEST(LineBufferTest, LineBufferRangeMetadata) {
+    uint32_t seed = 777;
+    auto next = [&seed]() { seed = seed * 1103515245u + 12345u; return (seed >> 16) & 0x7fff; };
+
+    std::vector<size_t> widths;
+    content_t content;
+    LineBuffer appended;
+    for (int i = 0; i < 3000; i++) {
+        size_t width = next() % 50;
+        widths.push_back(width);
+        content.push_back(line_t(width));
+        appended.append(line_t(width));
+    }
+    LineBuffer loaded(std::move(content));
+
+    for (int i = 0; i < 500; i++) {
+        size_t start = next() % widths.size();
+        size_t count = next() % (widths.size() - start + 1);
+
+        size_t glyphs = 0, width = 0;
+        for (size_t j = start; j < start + count; j++) {
+            glyphs += widths[j];
+            width = std::max(width, widths[j]);
+        }
+        EXPECT_EQ(loaded.glyphs(start, count), glyphs);
+        EXPECT_EQ(loaded.max_width(start, count), width);
+        EXPECT_EQ(appended.glyphs(start, count), glyphs);
+        EXPECT_EQ(appended.max_width(start, count), width);
+    }
+}
+
+TEST(LineTest, LineGapBufferEdits) {
+    // threshold of zero makes every line a gap buffer
+    int threshold = Settings::instance().text().gap_buffer_threshold;
+
+    for (int gap_threshold: {threshold, 0}) {
+        Settings::instance().text().gap_buffer_threshold = gap_threshold;
+        Line::init();
+
+        line_t line = make_line("hello world");
+        std::string model = "hello world";
+
+        line.insert(line.begin() + 5, Glyph(",", nullptr));
+        model.insert(5, ",");
+        line.erase(line.begin(), line.begin() + 2);
+        model.erase(0, 2);
+        line_t inserted = make_line("abc");
+        line.insert(line.begin() + 4, inserted.begin(), inserted.end());
+        model.insert(4, "abc");
+        line.push_back(Glyph("!", nullptr));
+        model += "!";
+        EXPECT_EQ(line_str(line), model);
+        EXPECT_EQ(line.size(), model.size());
+
+        line_t copy(line.begin() + 3, line.end() - 1);
+        EXPECT_EQ(line_str(copy), model.substr(3, model.size() - 4));
+
+        line.resize(4);
+        EXPECT_EQ(line_str(line), model.substr(0, 4));
+        line.clear();
+        EXPECT_TRUE(line.empty());
+    }
+
+    Settings::instance().text().gap_buffer_threshold = threshold;
+    Line::init();
+}
+
+TEST_F(PieceTableFixture, PieceTableEditLine) {
+    // first edit copies the loaded line, next ones change the copy in place
+    table.edit_line(4, [](line_t& line) { line.push_back(Glyph("a", nullptr)); });
+    const line_t* edited = &table.line_at(4);
+    table.edit_line(4, [](line_t& line) { line.push_back(Glyph("b", nullptr)); });
+    EXPECT_EQ(&table.line_at(4), edited);
+    EXPECT_EQ(line_str(table.line_at(4)), "4ab");
+    EXPECT_EQ(table.total_glyphs(), 12);
+    EXPECT_EQ(table.max_line_width(), 3);
+
+    // shared line is not changed in place
+    PieceTable copy(table);
+    table.edit_line(4, [](line_t& line) { line.erase(line.begin(), line.end()); });
+    EXPECT_EQ(line_str(copy.line_at(4)), "4ab");
+    EXPECT_EQ(line_str(table.line_at(4)), "");
+    EXPECT_EQ(table.max_line_width(), 1);
+}
+
+TEST_F(PieceTableFixture, PieceTableEditLineReclaims) {
+    std::unique_ptr<LineArena> arena(new LineArena());
+    LineArena::Scope scope(*arena);
+    auto set_line = [](const char* text) {
+        return [text](line_t& line) { line.erase(line.begin(), line.end()); line.push_back(Glyph(text, nullptr)); };
+    };
+    table.edit_line(2, set_line("a"));
+    table.edit_line(3, set_line("b"));
+    size_t used = arena->used();
+
+    // replaced copies are moved, not copied again, and the add buffer gets compacted
+    const line_t* shared = nullptr;
+    PieceTable copy;
+    for (size_t i = 0; i < 3 * PieceTable::COMPACT_MIN_DEAD; i++) {
+        const Glyph* data = &table.line_at(2 + i % 2)[0];
+        table.edit_line(2 + i % 2, set_line(i % 2? "d": "c"));
+        if (i <= PieceTable::COMPACT_MIN_DEAD) {
+            EXPECT_EQ(&table.line_at(2 + i % 2)[0], data);
+        }
+        if (i == PieceTable::COMPACT_MIN_DEAD) {
+            copy = table;
+            shared = &copy.line_at(3);
+        }
+    }
+    EXPECT_EQ(line_str(table.line_at(2)), "c");
+    EXPECT_EQ(line_str(table.line_at(3)), "d");
+    EXPECT_EQ(table.total_glyphs(), 10);
+    EXPECT_EQ(&copy.line_at(3), shared);
+    EXPECT_EQ(line_str(copy.line_at(3)), "d");
+    EXPECT_LE(arena->used(), used + 2 * table.line_at(2).capacity() * sizeof(Glyph));
+}
+
+TEST(LineArenaTest, LineArenaAllocations) {
+    std::unique_ptr<LineArena> arena(new LineArena());
+    line_t outliving;
+    {
+        LineArena::Scope scope(*arena);
+        line_t line = make_line("arena");
+        EXPECT_EQ(arena->reserved(), LineArena::SLAB_SIZE);
+        EXPECT_EQ(arena->used(), line.capacity() * sizeof(Glyph));
+
+        // freed block is reused by the next line of the same size class
+        const Glyph* data = &line[0];
+        line = line_t();
+        EXPECT_EQ(arena->used(), 0);
+        line_t reused = make_line("arena");
+        EXPECT_EQ(&reused[0], data);
+
+        // lines longer than the biggest size class are stored in the heap
+        line_t long_line(LineArena::MAX_CLASS_GLYPHS + 1);
+        EXPECT_EQ(arena->used(), reused.capacity() * sizeof(Glyph));
+
+        outliving = make_line("outliving");
+    }
+
+    line_t heap_line = make_line("heap");
+    EXPECT_EQ(arena->used(), outliving.capacity() * sizeof(Glyph));
+
+    // line keeps its slab alive after the arena is destroyed
+    arena.reset();
+    outliving.push_back(Glyph("!", nullptr));
+    EXPECT_EQ(line_str(outliving), "outliving!");
+}
+
+TEST(LineArenaTest, LineArenaFreeFromOtherThread) {
+    std::unique_ptr<LineArena> arena(new LineArena());
+    auto fill = [&arena](std::vector<line_t>& lines) {
+        LineArena::Scope scope(*arena);
+        for (int i = 0; i < 10000; i++) {
+            lines.push_back(make_line(std::to_string(i)));
+        }
+    };
+    std::vector<line_t> lines;
+    fill(lines);
+    size_t reserved = arena->reserved();
+
+    // lines are freed by another thread without the arena lock while the arena allocates
+    std::thread thread([&lines] { lines.clear(); });
+    {
+        LineArena::Scope scope(*arena);
+        for (int i = 0; i < 10000; i++) {
+            line_t line = make_line(std::to_string(i));
+        }
+    }
+    thread.join();
+    EXPECT_EQ(arena->used(), 0);
+
+    // blocks freed by the other thread are reused
+    fill(lines);
+    EXPECT_EQ(arena->reserved(), reserved);
+
+    // arena may be destroyed while its lines are freed
+    thread = std::thread([&lines] { lines.clear(); });
+    arena.reset();
+    thread.join();
+}
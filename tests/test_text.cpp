@@ -3,10 +3,13 @@
 #include "text.hpp"
 #include "glyph.hpp"
 #include "document.hpp"
+#include "settings.hpp"
+
+#include <thread>
+#include <vector>
+#include <functional>
 
 
-// TODO: add tests for special characters
-// TODO: add tests for real and visible text
 class GlyphFixture: public ::testing::Test {
 protected:
     void SetUp() override {
@@ -50,7 +53,50 @@ TEST_F(GlyphFixture, ValidGlyph) {
 
     std::hash<Glyph> glyph_hash;
     size_t hash_value = glyph_hash(g3);
-    EXPECT_EQ(hash_value, std::hash<std::string>()(g3.real()));
+    EXPECT_EQ(hash_value, std::hash<uint32_t>()(g3.code()));
+
+    EXPECT_EQ(sizeof(Glyph), 4);
+    EXPECT_EQ(g3.code(), 0x42B);
+    EXPECT_EQ(Glyph::from_codepoint(0x42B), g3);
+    EXPECT_FALSE(g2.special());
+}
+
+TEST_F(GlyphFixture, SpecialGlyph) {
+    Glyph tab("\t", "→");
+    EXPECT_TRUE(tab.special());
+    EXPECT_STREQ(tab.real().c_str(), "\t");
+    EXPECT_STREQ(tab.visible().c_str(), "→");
+    EXPECT_STREQ(g3.visible().c_str(), "Ы");
+
+    // special glyphs are interned, so equal glyphs share the same code
+    Glyph other_tab("\t", "→");
+    EXPECT_EQ(tab.code(), other_tab.code());
+    EXPECT_NE(tab, Glyph("\t", nullptr));
+
+    // color does not change identity of a glyph
+    uint32_t color = 0x888888ff;
+    other_tab.set_color(color);
+    EXPECT_EQ(other_tab.color(), color);
+    EXPECT_EQ(tab, other_tab);
+    EXPECT_EQ(std::hash<Glyph>()(tab), std::hash<Glyph>()(other_tab));
+}
+
+TEST_F(GlyphFixture, ConcurrentGlyphText) {
+    // text of glyphs is read without locking while other threads add new entries
+    auto run = [](uint32_t first, std::vector<const std::string*>& texts) {
+        for (uint32_t c = 0; c < 2048; c++) {
+            texts.push_back(&Glyph::from_codepoint(0x4E00 + (first + c) % 4096).real());
+        }
+    };
+    std::vector<const std::string*> first, second;
+    std::thread thread(run, 0, std::ref(first));
+    run(1024, second);
+    thread.join();
+
+    for (uint32_t c = 0; c < 1024; c++) {
+        EXPECT_EQ(first[1024 + c], second[c]);
+    }
+    EXPECT_EQ(*first[0], "\xE4\xB8\x80");
 }
 
 TEST_F(TextFixture, TextInit) {
@@ -192,6 +238,25 @@ TEST_F(TextFixture, TestRemoveMultiLine) {
     EXPECT_STREQ(last_removed.c_str(), removed.line_at({0, removed.total_lines()-1}).at(removed.line_width(removed.total_lines()-1)-1).real().c_str());
 }
 
+TEST_F(TextFixture, TestRemoveSharesLines) {
+    Document doc;
+    Text text = doc.load_raw("first\nsecond\nthird\nfourth");
+    const line_t* second = &text.line_at({0, 1});
+
+    // whole removed lines are moved to the removed text, not copied
+    Text removed = text.remove({2, 0}, {3, 3}, SelectionShape::TEXT_LIKE);
+    EXPECT_EQ(&removed.line_at({0, 1}), second);
+
+    Text moved(std::move(removed));
+    EXPECT_EQ(&moved.line_at({0, 1}), second);
+
+    // and back to the text when removing is undone
+    text.insert_at({2, 0}, moved, SelectionShape::TEXT_LIKE);
+    EXPECT_EQ(text.total_lines(), 4);
+    EXPECT_EQ(&text.line_at({0, 1}), second);
+    EXPECT_EQ(text.line_width(3), 6);
+}
+
 TEST_F(TextFixture, TextAddNewLine) {
     Vec2i pos = {2, 1};
 